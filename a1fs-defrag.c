@@ -0,0 +1,595 @@
+/*
+ * This code is provided solely for the personal and private use of students
+ * taking the CSC369H course at the University of Toronto. Copying for purposes
+ * other than this use is expressly prohibited. All forms of distribution of
+ * this code, including but not limited to public repositories on GitHub,
+ * GitLab, Bitbucket, or any other online platform, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Alexey Khrabrov, Karen Reid
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2019 Karen Reid
+ */
+
+/**
+ * CSC369 Assignment 1 - a1fs offline defragmenter.
+ *
+ * Goes through the inode table in order. Extents of a file that follow each
+ * other on disk are merged, and a file that still takes more than one extent
+ * is copied into the first free run large enough for all of its blocks,
+ * starting from its inode's group. The extent table is then rewritten in
+ * inode order, so that the extents in use are at its start. Fragment runs
+ * (file tails in shared blocks) are left where they are.
+ */
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "a1fs.h"
+#include "map.h"
+
+
+/** Command line options. */
+typedef struct defrag_opts {
+	/** File system image file path. */
+	const char *img_path;
+	/** Print help and exit. */
+	bool help;
+	/** Only report how fragmented the image is; don't write to it. */
+	bool dry_run;
+	/** Run even if the image was not unmounted cleanly. */
+	bool force;
+	/** Verbose output: report every file that is moved. */
+	bool verbose;
+
+} defrag_opts;
+
+static const char *help_str = "\
+Usage: %s options image\n\
+\n\
+Defragment an a1fs image: move the blocks of each file into one contiguous\n\
+run where there is free space for it, and compact the extent table. The\n\
+image must not be mounted. Fragmentation statistics are printed before and\n\
+after.\n\
+\n\
+Options:\n\
+    -n      only print the statistics, don't write to the image\n\
+    -f      run even if the image was not unmounted cleanly\n\
+    -h      print help and exit\n\
+    -v      verbose output; report every file that is moved\n\
+";
+
+static void print_help(FILE *f, const char *progname)
+{
+	fprintf(f, help_str, progname);
+}
+
+
+static bool parse_args(int argc, char *argv[], defrag_opts *opts)
+{
+	char o;
+	while ((o = getopt(argc, argv, "nfhv")) != -1) {
+		switch (o) {
+			case 'n': opts->dry_run = true; break;
+			case 'f': opts->force   = true; break;
+
+			case 'h': opts->help    = true; return true;// skip other arguments
+			case 'v': opts->verbose = true; break;
+
+			case '?': return false;
+			default : assert(false);
+		}
+	}
+
+	if (optind >= argc) {
+		fprintf(stderr, "Missing image path\n");
+		return false;
+	}
+	opts->img_path = argv[optind];
+	return true;
+}
+
+
+/** Defragmenter state. */
+typedef struct defrag_ctx {
+	/** Pointer to the start of the image. */
+	void *image;
+	/** Image size in bytes. */
+	size_t size;
+	/** Image file descriptor, used to punch out the blocks that are freed. */
+	int fd;
+	const defrag_opts *opts;
+
+	a1fs_superblock *sb;
+	unsigned char *inode_bitmap;
+	unsigned char *block_bitmap;
+	a1fs_extent *extents;
+	/** Number of entries of the extent table that have been initialized. */
+	uint64_t extent_count;
+	a1fs_inode *inodes;
+	/** First data block. */
+	uint64_t data_start;
+	/** Group descriptors; NULL in images made before they were added. */
+	a1fs_group_desc *descs;
+	uint64_t group_inodes;
+
+	/** Whether progress is shown on stderr (only if it's a terminal). */
+	bool progress;
+
+} defrag_ctx;
+
+/** Fragmentation statistics. */
+typedef struct defrag_stats {
+	/** Files and directories that have data blocks. */
+	uint64_t files;
+	/** Extents of those, not counting fragment runs. */
+	uint64_t extents;
+	/** Files and directories that take more than one extent. */
+	uint64_t fragmented;
+	/** Most extents taken by one file or directory. */
+	uint64_t max_extents;
+	/** Free data blocks. */
+	uint64_t free_blocks;
+	/** Runs of free data blocks. */
+	uint64_t free_runs;
+	/** Longest run of free data blocks. */
+	uint64_t largest_run;
+
+} defrag_stats;
+
+
+/** Work out where the areas of the image are, as in a1fsck. */
+static bool defrag_layout(defrag_ctx *dc)
+{
+	a1fs_superblock *sb = dc->sb;
+	uint64_t inode_bitmap_start = 1, block_bitmap_start = 2, block_bitmap_blocks = 1;
+	uint64_t inode_bitmap_blocks = 1, extent_table_start = 3, extent_table_blocks = 1;
+	uint64_t inode_table_start = 4, data_start = 4 + sb->inode_blocks, extent_table_uninit = 0;
+	if (sb->inode_bitmap_start != 0) {
+		inode_bitmap_start = sb->inode_bitmap_start;
+		inode_bitmap_blocks = sb->inode_bitmap_blocks;
+		block_bitmap_start = sb->block_bitmap_start;
+		block_bitmap_blocks = sb->block_bitmap_blocks;
+		extent_table_start = sb->extent_table_start;
+		extent_table_blocks = sb->extent_table_blocks;
+		extent_table_uninit = sb->extent_table_uninit;
+		inode_table_start = sb->inode_table_start;
+		data_start = sb->data_start;
+	}
+	uint64_t bits = (uint64_t)A1FS_BLOCK_SIZE * 8;
+	uint64_t image_blocks = dc->size / A1FS_BLOCK_SIZE;
+	if (sb->inode_count > inode_bitmap_blocks * bits || sb->data_block_count > block_bitmap_blocks * bits ||
+	    extent_table_uninit >= extent_table_blocks || sb->inode_count * sizeof(a1fs_inode) > sb->inode_blocks * A1FS_BLOCK_SIZE ||
+	    inode_table_start + sb->inode_blocks > image_blocks || data_start + sb->data_block_count > image_blocks ||
+	    data_start + sb->data_block_count > UINT32_MAX) {
+		fprintf(stderr, "The superblock describes areas that don't fit in the image\n");
+		return false;
+	}
+
+	dc->inode_bitmap = (unsigned char *)dc->image + A1FS_BLOCK_SIZE * inode_bitmap_start;
+	dc->block_bitmap = (unsigned char *)dc->image + A1FS_BLOCK_SIZE * block_bitmap_start;
+	dc->extents = (a1fs_extent *)((char *)dc->image + A1FS_BLOCK_SIZE * extent_table_start);
+	dc->extent_count = (extent_table_blocks - extent_table_uninit) * (A1FS_BLOCK_SIZE / sizeof(a1fs_extent));
+	dc->inodes = (a1fs_inode *)((char *)dc->image + A1FS_BLOCK_SIZE * inode_table_start);
+	dc->data_start = data_start;
+
+	if (sb->group_desc_start != 0) {
+		dc->group_inodes = sb->group_inodes;
+		if (sb->group_count == 0 || sb->group_inodes == 0 || sb->group_count * A1FS_GROUP_BLOCKS < sb->data_block_count ||
+		    sb->group_count * sb->group_inodes < sb->inode_count ||
+		    sb->group_desc_start + sb->group_desc_blocks > image_blocks) {
+			fprintf(stderr, "The superblock describes invalid block groups\n");
+			return false;
+		}
+		dc->descs = (a1fs_group_desc *)((char *)dc->image + A1FS_BLOCK_SIZE * sb->group_desc_start);
+	}
+	return true;
+}
+
+
+/** Whether data block i (counted from the first data block) is free. */
+static bool block_free(const defrag_ctx *dc, uint64_t i)
+{
+	if (dc->descs && (dc->descs[i / A1FS_GROUP_BLOCKS].flags & A1FS_GROUP_BLOCK_UNINIT)) return true;
+	return !(dc->block_bitmap[i / 8] >> (i % 8) & 1);
+}
+
+/**
+ * Number of data blocks from i on, up to end, that are all free or all in
+ * use as block i is; looks at whole groups and bitmap words where it can, so
+ * that the bitmap of a large image is gone through quickly.
+ */
+static uint64_t block_span(const defrag_ctx *dc, uint64_t i, uint64_t end, bool *free)
+{
+	if (dc->descs && (dc->descs[i / A1FS_GROUP_BLOCKS].flags & A1FS_GROUP_BLOCK_UNINIT)) {
+		uint64_t group_end = (i / A1FS_GROUP_BLOCKS + 1) * A1FS_GROUP_BLOCKS;
+		*free = true;
+		return (group_end < end ? group_end : end) - i;
+	}
+	if (i % 64 == 0 && i + 64 <= end) {
+		uint64_t word;
+		memcpy(&word, dc->block_bitmap + i / 8, sizeof(word));
+		if (word == 0 || word == ~0ull) {
+			*free = word == 0;
+			return 64;
+		}
+	}
+	*free = block_free(dc, i);
+	return 1;
+}
+
+/**
+ * Whether an inode holds a file or directory whose extent slots are in use:
+ * its bit is set in a group that has been initialized, and it is not inline.
+ * Inode 1 is reserved and never holds one.
+ */
+static bool has_extents(const defrag_ctx *dc, uint64_t ino)
+{
+	if (ino == 1) return false;
+	if (dc->descs && (dc->descs[ino / dc->group_inodes].flags & A1FS_GROUP_INODE_UNINIT)) return false;
+	if (!(dc->inode_bitmap[ino / 8] >> (ino % 8) & 1)) return false;
+	mode_t mode = dc->inodes[ino].mode;
+	return (S_ISREG(mode) || S_ISDIR(mode)) && !(mode & A1FS_S_INLINE);
+}
+
+/** Number of extents of a file, not counting a fragment run. */
+static uint64_t count_extents(const defrag_ctx *dc, const a1fs_inode *inode)
+{
+	uint64_t n = 0;
+	for (int i = 0; i < 24; i++) {
+		uint32_t e = inode->extent_number[i];
+		if (e != 0 && !(dc->extents[e - 1].count & A1FS_EXTENT_FRAG)) n++;
+	}
+	return n;
+}
+
+/**
+ * Check that every extent slot in use points into the initialized part of
+ * the extent table and at an extent within the data blocks, and that no two
+ * slots share an entry, so that the table can be rewritten safely.
+ */
+static bool check_extents(const defrag_ctx *dc)
+{
+	uint64_t end = dc->data_start + dc->sb->data_block_count;
+	uint64_t *seen = calloc((dc->extent_count + 63) / 64, sizeof(uint64_t));
+	if (seen == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		return false;
+	}
+	bool ok = true;
+	for (uint64_t ino = 0; ino < dc->sb->inode_count && ok; ino++) {
+		if (!has_extents(dc, ino)) continue;
+		for (int i = 0; i < 24; i++) {
+			uint32_t n = dc->inodes[ino].extent_number[i];
+			if (n == 0) continue;
+			const a1fs_extent *extent = n - 1 < dc->extent_count ? &dc->extents[n - 1] : NULL;
+			uint64_t count = extent && (extent->count & A1FS_EXTENT_FRAG) ? 1 : extent ? extent->count : 0;
+			if (!extent || extent->start < dc->data_start || count == 0 || extent->start + count > end ||
+			    (seen[(n - 1) / 64] >> ((n - 1) % 64) & 1)) {
+				fprintf(stderr, "Inode %" PRIu64 " has an invalid extent; run a1fsck first\n", ino);
+				ok = false;
+				break;
+			}
+			seen[(n - 1) / 64] |= 1ull << ((n - 1) % 64);
+		}
+	}
+	free(seen);
+	return ok;
+}
+
+
+/** Gather the fragmentation statistics of the image. */
+static void get_stats(const defrag_ctx *dc, defrag_stats *st)
+{
+	memset(st, 0, sizeof(*st));
+	for (uint64_t ino = 0; ino < dc->sb->inode_count; ino++) {
+		if (dc->descs && ino % dc->group_inodes == 0 && (dc->descs[ino / dc->group_inodes].flags & A1FS_GROUP_INODE_UNINIT)) {
+			ino += dc->group_inodes - 1;
+			continue;
+		}
+		if (!has_extents(dc, ino)) continue;
+		uint64_t n = count_extents(dc, &dc->inodes[ino]);
+		if (n == 0) continue;
+		st->files++;
+		st->extents += n;
+		if (n > 1) st->fragmented++;
+		if (n > st->max_extents) st->max_extents = n;
+	}
+
+	uint64_t end = dc->sb->data_block_count, run = 0;
+	for (uint64_t i = 0; i < end; ) {
+		bool free;
+		uint64_t n = block_span(dc, i, end, &free);
+		if (free) {
+			if (run == 0) st->free_runs++;
+			run += n;
+			st->free_blocks += n;
+			if (run > st->largest_run) st->largest_run = run;
+		} else {
+			run = 0;
+		}
+		i += n;
+	}
+}
+
+static void print_stats(const char *when, const defrag_stats *st)
+{
+	printf("%s: %" PRIu64 " files, %" PRIu64 " extents (%.2f per file, at most %" PRIu64 "), %" PRIu64 " fragmented\n",
+	       when, st->files, st->extents, st->files ? (double)st->extents / st->files : 0.0, st->max_extents, st->fragmented);
+	printf("%*s  %" PRIu64 " free blocks in %" PRIu64 " runs, the largest %" PRIu64 " blocks\n",
+	       (int)strlen(when), "", st->free_blocks, st->free_runs, st->largest_run);
+}
+
+
+/** First free run of count data blocks in [from, end); -1 if there is none. */
+static int64_t find_run(const defrag_ctx *dc, uint64_t count, uint64_t from, uint64_t end)
+{
+	uint64_t run = 0;
+	for (uint64_t i = from; i < end; ) {
+		bool free;
+		uint64_t n = block_span(dc, i, end, &free);
+		if (free) {
+			if (run + n >= count) return i - run;
+			run += n;
+		} else {
+			run = 0;
+		}
+		i += n;
+	}
+	return -1;
+}
+
+/** Mark count data blocks from data block i (counted from the first) as used. */
+static void take_blocks(defrag_ctx *dc, uint64_t i, uint64_t count)
+{
+	a1fs_superblock *sb = dc->sb;
+	for (uint64_t b = i; b < i + count; b++) {
+		a1fs_group_desc *desc = dc->descs ? &dc->descs[b / A1FS_GROUP_BLOCKS] : NULL;
+		if (desc && (desc->flags & A1FS_GROUP_BLOCK_UNINIT)) {
+			// Zero the group's bits first, as the driver does (see init_group())
+			uint64_t first = b / A1FS_GROUP_BLOCKS * A1FS_GROUP_BLOCKS;
+			uint64_t n = sb->data_block_count - first < A1FS_GROUP_BLOCKS ? sb->data_block_count - first : A1FS_GROUP_BLOCKS;
+			memset(dc->block_bitmap + first / 8, 0, (n + 7) / 8);
+			desc->flags &= ~A1FS_GROUP_BLOCK_UNINIT;
+		}
+		dc->block_bitmap[b / 8] |= 1 << (b % 8);
+		if (desc) desc->free_blocks--;
+	}
+	sb->free_data_block_count -= count;
+}
+
+/** Zero and free count data blocks from absolute block start, as the driver does with --punch. */
+static void give_blocks(defrag_ctx *dc, uint64_t start, uint64_t count)
+{
+	off_t pos = (off_t)start * A1FS_BLOCK_SIZE;
+	off_t len = (off_t)count * A1FS_BLOCK_SIZE;
+	if (fallocate(dc->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, pos, len) < 0) {
+		memset((char *)dc->image + pos, 0, len);
+	}
+	for (uint64_t b = start - dc->data_start; b < start - dc->data_start + count; b++) {
+		dc->block_bitmap[b / 8] &= ~(1 << (b % 8));
+		if (dc->descs) {
+			a1fs_group_desc *desc = &dc->descs[b / A1FS_GROUP_BLOCKS];
+			desc->free_blocks++;
+			if (b % A1FS_GROUP_BLOCKS < desc->first_free_block) desc->first_free_block = b % A1FS_GROUP_BLOCKS;
+		}
+	}
+	dc->sb->free_data_block_count += count;
+}
+
+/**
+ * Merge the extents of a file that follow each other on disk, and move its
+ * slots in use to the front, keeping their order.
+ *
+ * @return  number of extent table entries freed.
+ */
+static uint64_t merge_extents(defrag_ctx *dc, a1fs_inode *inode)
+{
+	uint64_t freed = 0;
+	int last = -1;// slot of the previous whole extent
+	int used = 0;
+	for (int i = 0; i < 24; i++) {
+		uint32_t n = inode->extent_number[i];
+		if (n == 0) continue;
+		a1fs_extent *extent = &dc->extents[n - 1];
+		inode->extent_number[i] = 0;
+		if (last >= 0 && !(extent->count & A1FS_EXTENT_FRAG)) {
+			a1fs_extent *prev = &dc->extents[inode->extent_number[last] - 1];
+			if (prev->start + prev->count == extent->start && (uint64_t)prev->count + extent->count < A1FS_EXTENT_FRAG) {
+				prev->count += extent->count;
+				*extent = (a1fs_extent){0, 0};
+				freed++;
+				continue;
+			}
+		}
+		if (!(extent->count & A1FS_EXTENT_FRAG)) last = used;
+		inode->extent_number[used++] = n;
+	}
+	return freed;
+}
+
+/**
+ * Copy the whole extents of a file, in order, into one free run and free
+ * their old blocks; the first extent's entry then describes the run. The run
+ * is looked for from the first block of the inode's group on.
+ *
+ * @return  whether the file was moved; false if there is no run large enough.
+ */
+static bool move_file(defrag_ctx *dc, a1fs_ino_t ino, uint64_t *freed)
+{
+	a1fs_inode *inode = &dc->inodes[ino];
+	uint64_t blocks = 0;
+	for (int i = 0; i < 24; i++) {
+		uint32_t n = inode->extent_number[i];
+		if (n != 0 && !(dc->extents[n - 1].count & A1FS_EXTENT_FRAG)) blocks += dc->extents[n - 1].count;
+	}
+	if (blocks >= A1FS_EXTENT_FRAG) return false;
+
+	uint64_t end = dc->sb->data_block_count;
+	uint64_t from = dc->descs ? (ino / dc->group_inodes) * A1FS_GROUP_BLOCKS : 0;
+	if (from >= end) from = 0;
+	int64_t index = find_run(dc, blocks, from, end);
+	if (index < 0 && from > 0) index = find_run(dc, blocks, 0, from);
+	if (index < 0) return false;
+
+	take_blocks(dc, index, blocks);
+	uint64_t dst = index + dc->data_start, pos = dst;
+	a1fs_extent *first = NULL;
+	for (int i = 0; i < 24; i++) {
+		uint32_t n = inode->extent_number[i];
+		if (n == 0 || (dc->extents[n - 1].count & A1FS_EXTENT_FRAG)) continue;
+		a1fs_extent *extent = &dc->extents[n - 1];
+		memcpy((char *)dc->image + pos * A1FS_BLOCK_SIZE, (char *)dc->image + (uint64_t)extent->start * A1FS_BLOCK_SIZE,
+		       (size_t)extent->count * A1FS_BLOCK_SIZE);
+		pos += extent->count;
+		give_blocks(dc, extent->start, extent->count);
+		if (first == NULL) {
+			first = extent;
+		} else {
+			*extent = (a1fs_extent){0, 0};
+			inode->extent_number[i] = 0;
+			(*freed)++;
+		}
+	}
+	first->start = dst;
+	first->count = blocks;
+	merge_extents(dc, inode);// only moves the slots up
+	if (dc->opts->verbose) printf("inode %" PRIu32 ": %" PRIu64 " blocks moved to block %" PRIu64 "\n", ino, blocks, dst);
+	return true;
+}
+
+/**
+ * Rewrite the extent table with the entries in use in inode order. The first
+ * extent of the root directory stays at index 0, where mkfs puts it and the
+ * driver never allocates.
+ *
+ * @return  number of entries in use; 0 if out of memory.
+ */
+static uint64_t compact_extents(defrag_ctx *dc)
+{
+	a1fs_extent *table = calloc(dc->extent_count, sizeof(a1fs_extent));
+	if (table == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		return 0;
+	}
+	uint64_t next = 1, used = 0;
+	for (uint64_t ino = 0; ino < dc->sb->inode_count; ino++) {
+		if (!has_extents(dc, ino)) continue;
+		a1fs_inode *inode = &dc->inodes[ino];
+		for (int i = 0; i < 24; i++) {
+			uint32_t n = inode->extent_number[i];
+			if (n == 0) continue;
+			uint64_t to = ino == 0 && used == 0 ? 0 : next++;
+			table[to] = dc->extents[n - 1];
+			inode->extent_number[i] = to + 1;
+			used++;
+		}
+	}
+	memcpy(dc->extents, table, dc->extent_count * sizeof(a1fs_extent));
+	free(table);
+	dc->sb->reserved_extent_number = used;
+	return used;
+}
+
+static int defrag(void *image, size_t size, int fd, const defrag_opts *opts)
+{
+	defrag_ctx dc = {0};
+	dc.image = image;
+	dc.size = size;
+	dc.fd = fd;
+	dc.opts = opts;
+	dc.sb = (a1fs_superblock *)image;
+	dc.progress = isatty(STDERR_FILENO) && !opts->verbose;
+
+	a1fs_superblock *sb = dc.sb;
+	if (size < A1FS_BLOCK_SIZE || sb->magic != A1FS_MAGIC) {
+		fprintf(stderr, "Not an a1fs image\n");
+		return 1;
+	}
+	if (sb->block_size != 0 && sb->block_size != A1FS_BLOCK_SIZE) {
+		fprintf(stderr, "The image has %" PRIu64 "-byte blocks; this build is for %d-byte blocks\n",
+		        (uint64_t)sb->block_size, A1FS_BLOCK_SIZE);
+		return 1;
+	}
+	if (!defrag_layout(&dc) || !check_extents(&dc)) return 1;
+	if (!sb->clean && sb->group_desc_start != 0 && !opts->dry_run && !opts->force) {
+		fprintf(stderr, "The file system was not unmounted cleanly; run a1fsck first, or use -f\n");
+		return 1;
+	}
+
+	defrag_stats before, after;
+	get_stats(&dc, &before);
+	print_stats("before", &before);
+	if (opts->dry_run) return 0;
+
+	// Marked dirty until done, so that a mount after a crash counts the free space again
+	uint64_t clean = sb->clean;
+	sb->clean = 0;
+	uint64_t moved = 0, stuck = 0, freed = 0;
+	int shown = -1;
+	for (uint64_t ino = 0; ino < sb->inode_count; ino++) {
+		int percent = ino * 100 / sb->inode_count;
+		if (dc.progress && percent != shown) {
+			fprintf(stderr, "\rdefragmenting: %3d%%", percent);
+			shown = percent;
+		}
+		if (!has_extents(&dc, ino)) continue;
+		a1fs_inode *inode = &dc.inodes[ino];
+		freed += merge_extents(&dc, inode);
+		if (count_extents(&dc, inode) < 2) continue;
+		if (move_file(&dc, ino, &freed)) {
+			moved++;
+		} else {
+			stuck++;
+		}
+	}
+	if (dc.progress) fprintf(stderr, "\rdefragmenting: 100%%\n");
+
+	uint64_t used = compact_extents(&dc);
+	sb->clean = clean;
+	printf("%" PRIu64 " files moved, %" PRIu64 " left fragmented for lack of a large enough free run\n", moved, stuck);
+	printf("%" PRIu64 " extents freed; %" PRIu64 " in use\n", freed, used);
+	get_stats(&dc, &after);
+	print_stats("after", &after);
+	return used == 0 ? 1 : 0;
+}
+
+int main(int argc, char *argv[])
+{
+	defrag_opts opts = {0};// defaults are all 0
+	if (!parse_args(argc, argv, &opts)) {
+		// Invalid arguments, print help to stderr
+		print_help(stderr, argv[0]);
+		return 1;
+	}
+
+	if (opts.help) {
+		// Help requested, print it to stdout
+		print_help(stdout, argv[0]);
+		return 0;
+	}
+
+	// Map image file into memory
+	size_t size;
+	int fd;
+	void *image = map_file(opts.img_path, A1FS_BLOCK_SIZE, &size, &fd);
+	if (image == NULL) return 1;
+
+	int ret = defrag(image, size, fd, &opts);
+	if (!opts.dry_run && ret == 0 && msync(image, size, MS_SYNC) < 0) {
+		perror("msync");
+		ret = 1;
+	}
+	munmap(image, size);
+	close(fd);
+	return ret;
+}
@@ -16,22 +16,33 @@
  * CSC369 Assignment 1 - a1fs driver implementation.
  */
 
+// For fallocate()
+#define _GNU_SOURCE
+
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <dirent.h>
 #include <time.h>
+#include <unistd.h>
 
 // Using 2.9.x FUSE API
 #define FUSE_USE_VERSION 29
 #include <fuse.h>
 
 #include "a1fs.h"
+#include "batch.h"
 #include "fs_ctx.h"
 #include "options.h"
+#include "dirblk.h"
 #include "map.h"
+#include "path.h"
 
 //NOTE: All path arguments are absolute paths within the a1fs file system and
 // start with a '/' that corresponds to the a1fs root directory.
@@ -49,24 +60,12 @@
 
 
 
-/** Ceiling function for ceil(number/8) 
-	Helper for bitmap modification
-*/
-int ceiling_bit(uint64_t number) {
-	unsigned int k = number / 8;
-	if (k * 8 < number){
-		return k + 1;
-	}else{
-		return k;
-	}
-}
-
 /** Ceiling function for ceil(size/4096) 
 	Helper for truncate
 */
 unsigned int ceiling_block(off_t size) {
 	unsigned int k = size / A1FS_BLOCK_SIZE;
-	if (k * A1FS_BLOCK_SIZE < size){
+	if ((off_t)k * A1FS_BLOCK_SIZE < size){
 		return k + 1;
 	}else{
 		return k;
@@ -74,128 +73,345 @@ unsigned int ceiling_block(off_t size) {
 }
 
 
-/** Helper for count the number of components 
-	"/tmp/mnt/a/b/c" will return 5
-*/
-int count_components(char *path_cp) {
-	int number_of_components = 0;
-	for (unsigned int i = 0; i < strlen(path_cp); i++) {
-		if (path_cp[i] == '/' && i != strlen(path_cp) - 1) {
-			number_of_components++;
-		}
-	}
-	return number_of_components;
-}
-
-/** Helper for getting a list of components 
-	"/tmp/mnt/a/b/c" will return
-	["tmp", "mnt", "a", "b", "c"]
-*/
-void list_of_components(char *path_cp, char **components) {
-	char *component;
-	int i = 0;
-	component = strtok(path_cp, "/");
-	while (component != NULL) {
-		components[i] = component;
-		component = strtok(NULL, "/");
-		i++;
-	}
-}
-
 /** 
 	Assign information from the found inode to st in getattr 
 */
 void assign_info(struct stat *st, struct a1fs_inode *inode) {
-	st->st_mode = inode->mode;
+	st->st_mode = inode->mode & ~A1FS_S_INLINE;
 	st->st_nlink = 2;
 	st->st_size = inode->size;
-	st->st_blocks = inode->size / 512;
+	st->st_blocks = (inode->mode & A1FS_S_INLINE) ? 0 : inode->size / 512;
 	st->st_mtim = inode->mtime;
-	printf("\n\n");
 }
 
 
-/** 
- *	Helper for getting the inode number of last component in a path
+/**
+ *	Get the inode with the given number
+ */
+struct a1fs_inode *get_inode(fs_ctx *fs, a1fs_ino_t ino) {
+	return fs->layout.inodes + ino;
+}
+
+/**
+ *	Get the address of the given block in the image
+ *	The offset is computed in 64 bits so blocks past 4 GiB don't wrap
  */
-int check_new(fs_ctx *fs, int number_of_components, char **components){
+void *block_ptr(fs_ctx *fs, a1fs_blk_t block) {
+	return (char *)fs->image + (uint64_t)block * A1FS_BLOCK_SIZE;
+}
 
-	/*Set up for the check*/
+/**
+ *	Helper for looking up a name in a directory
+ *	name doesn't have to be null-terminated; hash is its name_hash()
+ *	Returns the inode number of the live entry and stores its location in pos
+ *	(if not NULL), or -ENOENT if there is none
+ */
+int dir_lookup(fs_ctx *fs, a1fs_ino_t dir, const char *name, size_t len, uint32_t hash, dir_pos *pos) {
 	struct a1fs_superblock *sb = (struct a1fs_superblock *)(fs->image);
-	struct a1fs_extent *extent_block = (struct a1fs_extent *)(fs->image + A1FS_BLOCK_SIZE * 3);
-	struct a1fs_inode *first_inode = (struct a1fs_inode *)(fs->image + A1FS_BLOCK_SIZE * 4);
-	struct a1fs_inode *cur_inode = first_inode;
-	int inode_number = 0;
-	
-	/*Check the different part*/
-	for (int i = 0; i < number_of_components; i++) { // Iterate through all components
-		int found = 0;
-		if ((cur_inode->mode & S_IFDIR) != S_IFDIR && i != number_of_components - 1){
-			inode_number = -ENOTDIR;
-		}else if ((cur_inode->mode & S_IFDIR) == S_IFDIR){
-			for (int j = 0; j < 24; j++) { // Iterate through 24 extent numbers in the inode
-				if (cur_inode->extent_number[j] > 0) { // Valid extent number
-				// Valid extent number ==> valid extent
-				uint32_t valid_extent_start = extent_block[cur_inode->extent_number[j] - 1].start;
-				// Valid extent's start ==> valid resered data block
-				struct a1fs_dentry *subdirectories = (struct a1fs_dentry *)(fs->image + A1FS_BLOCK_SIZE * valid_extent_start);
-					for (unsigned int k = 0; k < A1FS_BLOCK_SIZE / sizeof(struct a1fs_dentry); k++) { // Iterate through 16 dentries
-						if (subdirectories[k].ino < sb->inode_count && strcmp(subdirectories[k].name, components[i]) == 0) { // Component found
-							inode_number = subdirectories[k].ino;
-							cur_inode = (struct a1fs_inode *)(fs->image + A1FS_BLOCK_SIZE * 4 + subdirectories[k].ino * sizeof(struct a1fs_inode));
-							j = 24;
-							found = 1;
-							break;
-						}
+	struct a1fs_extent *extent_block = fs->layout.extents;
+	struct a1fs_inode *dir_inode = get_inode(fs, dir);
+	dir_pos found;
+
+	// Directory listed recently, e.g. by "ls -l": no need to scan it
+	if (dcache_lookup(&fs->dcache, dir, name, len, hash, &found)) {
+		if (pos) *pos = found;
+		return *(a1fs_ino_t *)((char *)block_ptr(fs, found.block) + found.off);
+	}
+
+	for (int j = 0; j < 24; j++) { // Iterate through 24 extent numbers in the inode
+		if (dir_inode->extent_number[j] > 0) { // Valid extent number
+			struct a1fs_extent extent = extent_block[dir_inode->extent_number[j] - 1];
+			for (unsigned int b = 0; b < extent.count; b++) { // Iterate through all blocks
+				unsigned char *block = block_ptr(fs, extent.start + b);
+				int off = dirblk_find(block, sb->inode_count, name, len, hash);
+				if (off >= 0) { // Component found
+					if (pos) {
+						pos->block = extent.start + b;
+						pos->off = off;
 					}
+					// Both formats start an entry with its inode number
+					return *(a1fs_ino_t *)(block + off);
 				}
 			}
 		}
-		if (!found){
-			inode_number = -ENOENT;
-			break;
+	}
+	return -ENOENT;
+}
+
+/**
+ *	Helper for resolving a path, shared by all the callbacks
+ *	Walks the path in place with a path_iter (no copies, one pass)
+ *	If last is NULL, returns the inode number of the file at path
+ *	Otherwise, stops before the final component, returns the inode number of
+ *	its parent directory and stores the final component in last
+ *	Returns -errno on error
+ */
+int path_walk(fs_ctx *fs, const char *path, path_iter *last) {
+	path_iter it, cur;
+	path_iter_init(&it, path);
+	a1fs_ino_t ino = 0; // Root directory
+
+	bool more = path_iter_next(&it);
+	while (more) {
+		cur = it;
+		if (cur.len >= A1FS_NAME_MAX || cur.next - path >= A1FS_PATH_MAX) {
+			return -ENAMETOOLONG;
 		}
+		more = path_iter_next(&it);
+		if (!more && last) { // cur is the final component
+			*last = cur;
+			return ino;
+		}
+		if (!S_ISDIR(get_inode(fs, ino)->mode)) {
+			return -ENOTDIR;
+		}
+		int found = dir_lookup(fs, ino, cur.name, cur.len, cur.hash, NULL);
+		if (found < 0) {
+			return found;
+		}
+		ino = found;
+	}
+	if (last) { // No final component, i.e. the root directory
+		return -EINVAL;
 	}
-	return inode_number;
+	return ino;
 }
 
 
-/** 
- * Helper for mkdir 
- */
-int allocate_block(fs_ctx *fs){
-    struct a1fs_superblock *sb = (struct a1fs_superblock *)(fs->image);
-    unsigned int *block_bitmap = fs->image + A1FS_BLOCK_SIZE * 2;
-	int ceil = ceiling_bit(sb->data_block_count);
-    for (int i = 0; i < ceil; i++) {
-       for (unsigned j = 0; j < 8; j++){
-			if (strcmp((block_bitmap[i] & (1 << j) ? "1" : "0"), "0") == 0){
-				block_bitmap[i] |= (1 << j);
-				sb->free_data_block_count--;
-				return i * 8 + j + 4 + sb->inode_blocks;
+/**
+ * Helper for allocation
+ * Allocation group of an inode
+ */
+unsigned int inode_group(fs_ctx *fs, a1fs_ino_t ino){
+	return ino / fs->group_inodes;
+}
+
+/**
+ * Helper for allocation
+ * Inode number of an inode in the inode table
+ */
+a1fs_ino_t inode_number(fs_ctx *fs, struct a1fs_inode *inode){
+	return inode - fs->layout.inodes;
+}
+
+/**
+ * Helper for allocation
+ * Keep a group's first free hint (see a1fs_group_desc) right after bit rel
+ * of the group (counted from its first) has been taken
+ */
+void hint_taken(uint32_t *hint, uint64_t rel){
+	if (*hint == rel) {
+		*hint = rel + 1;
+	}
+}
+
+/**
+ * Helper for allocation
+ * Keep a group's first free hint right after bit rel of the group has been
+ * released
+ */
+void hint_released(uint32_t *hint, uint64_t rel){
+	if (rel < *hint) {
+		*hint = rel;
+	}
+}
+
+/**
+ * Helper for allocation
+ * Zero the bitmap bits of a group that mkfs left uninitialized, and for
+ * inodes also its part of the inode table, before anything is allocated in
+ * it (see A1FS_GROUP_BLOCK_UNINIT)
+ */
+void init_group(fs_ctx *fs, unsigned int group, bool blocks){
+	struct a1fs_superblock *sb = (struct a1fs_superblock *)(fs->image);
+	a1fs_group_desc *desc = fs->groups[group].desc;
+	uint32_t flag = blocks ? A1FS_GROUP_BLOCK_UNINIT : A1FS_GROUP_INODE_UNINIT;
+	if (!(desc->flags & flag)) {
+		return;
+	}
+	uint64_t group_bits = blocks ? A1FS_GROUP_BLOCKS : fs->group_inodes;
+	uint64_t nbits = blocks ? sb->data_block_count : sb->inode_count;
+	uint64_t first = (uint64_t)group * group_bits;
+	uint64_t count = nbits - first < group_bits ? nbits - first : group_bits;
+	unsigned char *bitmap = blocks ? fs->layout.block_bitmap : fs->layout.inode_bitmap;
+	// Groups start on a byte, and only the last one can end inside one
+	memset(bitmap + first / 8, 0, (count + 7) / 8);
+	if (!blocks) {
+		memset(fs->layout.inodes + first, 0, count * sizeof(struct a1fs_inode));
+	}
+	desc->flags &= ~flag;
+}
+
+/**
+ * Mark the data block (absolute block number) as used
+ */
+void claim_block(fs_ctx *fs, a1fs_blk_t block){
+	unsigned char *block_bitmap = fs->layout.block_bitmap;
+	a1fs_blk_t index = block - fs->layout.data_start;
+	alloc_group *ag = &fs->groups[index / A1FS_GROUP_BLOCKS];
+	init_group(fs, index / A1FS_GROUP_BLOCKS, true);
+	block_bitmap[index / 8] |= (1 << (index % 8));
+	ag->desc->free_blocks--;
+	hint_taken(&ag->desc->first_free_block, index % A1FS_GROUP_BLOCKS);
+	bitsum_update(&fs->block_sum, index, 1);
+}
+
+/**
+ * Helper for allocation
+ * Whether the data block (absolute block number) is in the image and free
+ */
+bool block_is_free(fs_ctx *fs, uint64_t block){
+	struct a1fs_superblock *sb = (struct a1fs_superblock *)(fs->image);
+	if (block < fs->layout.data_start || block - fs->layout.data_start >= sb->data_block_count) {
+		return false;
+	}
+	uint64_t index = block - fs->layout.data_start;
+	alloc_group *ag = &fs->groups[index / A1FS_GROUP_BLOCKS];
+	bool free = (ag->desc->flags & A1FS_GROUP_BLOCK_UNINIT) ||
+	            !(fs->layout.block_bitmap[index / 8] & (1 << (index % 8)));
+	return free;
+}
+
+/**
+ * Helper for allocate_block and allocate_inode
+ * Find and take a free bit of a bitmap split into groups of group_bits bits,
+ * at or after the first bit of the given group and then wrapping around. The
+ * summary points to the next group with a free bit, whose bitmap is then
+ * checked and the bit set
+ * Returns the bit, or -1 if the bitmap is full
+ */
+int64_t take_free_bit(fs_ctx *fs, bitsum *bs, unsigned char *bitmap, uint64_t group_bits, unsigned int group, bool blocks){
+	uint64_t start = (uint64_t)group * group_bits;
+	uint64_t from = start < bs->nbits ? start : 0;
+	bool wrapped = from < start;
+	for (;;) {
+		int64_t next = bitsum_next(bs, from);
+		if (next < 0 || (wrapped && (uint64_t)next >= start)) {
+			if (wrapped) {
+				return -1;
+			}
+			wrapped = true;
+			from = 0;
+			continue;
+		}
+		alloc_group *ag = &fs->groups[next / group_bits];
+		uint64_t end = (next / group_bits + 1) * group_bits;
+		init_group(fs, next / group_bits, blocks);
+		int64_t bit = bitsum_find(bs, next, end);
+		if (bit >= 0) {
+			bitmap[bit / 8] |= (1 << (bit % 8));
+			uint64_t rel = bit % group_bits;
+			if (blocks) {
+				ag->desc->free_blocks--;
+				hint_taken(&ag->desc->first_free_block, rel);
+			} else {
+				ag->desc->free_inodes--;
+				hint_taken(&ag->desc->first_free_inode, rel);
 			}
+			bitsum_update(bs, bit, 1);
+			return bit;
 		}
-    }
-    return -ENOSPC;
+		// Free bits only before next in its word
+		from = (uint64_t)next / 64 * 64 + 64;
+		if (from >= bs->nbits && !wrapped) {
+			wrapped = true;
+			from = 0;
+		} else if (from >= bs->nbits) {
+			return -1;
+		}
+	}
 }
 
 /** 
- * Helper for mkdir 
- */
-int allocate_inode(fs_ctx *fs){
-    struct a1fs_superblock *sb = (struct a1fs_superblock *)(fs->image);
-    unsigned char *inode_bitmap = fs->image + A1FS_BLOCK_SIZE;
-	int ceil = ceiling_bit(sb->inode_count);
-    for (int i = 0; i < ceil; i++){
-		for (unsigned j = 0; j < 8; j++){
-			if (strcmp((inode_bitmap[i] & (1 << j) ? "1" : "0"), "0") == 0){
-				inode_bitmap[i] |= (1 << j);
-				sb->free_inodes_count--;
-				return i * 8 + j ;
-			}
+ * Allocate a data block, preferably in the given allocation group
+ * The first free block at or after the start of the group is taken, so
+ * groups after it are used once it is full
+ * Returns the absolute block number, or -ENOSPC
+ */
+int64_t allocate_block(fs_ctx *fs, unsigned int group){
+    unsigned char *block_bitmap = fs->layout.block_bitmap;
+	int64_t bit = take_free_bit(fs, &fs->block_sum, block_bitmap, A1FS_GROUP_BLOCKS, group, true);
+	if (bit < 0) {
+		return -ENOSPC;
+	}
+	return bit + fs->layout.data_start;
+}
+
+/** 
+ * Allocate an inode, preferably in the given allocation group
+ * Returns the inode number, or -ENOSPC
+ */
+int allocate_inode(fs_ctx *fs, unsigned int group){
+    unsigned char *inode_bitmap = fs->layout.inode_bitmap;
+	int64_t bit = take_free_bit(fs, &fs->inode_sum, inode_bitmap, fs->group_inodes, group, false);
+	if (bit < 0) {
+		return -ENOSPC;
+	}
+	return bit;
+}
+
+/**
+ * Count a new directory in the allocation group of its inode
+ */
+void add_group_dir(fs_ctx *fs, a1fs_ino_t ino){
+	alloc_group *ag = &fs->groups[inode_group(fs, ino)];
+	ag->desc->dirs++;
+}
+
+/**
+ * Release an inode; call before the inode itself is cleared
+ */
+void free_inode(fs_ctx *fs, a1fs_ino_t ino){
+	unsigned char *inode_bitmap = fs->layout.inode_bitmap;
+	alloc_group *ag = &fs->groups[inode_group(fs, ino)];
+	inode_bitmap[ino / 8] &= ~(1 << (ino % 8));
+	ag->desc->free_inodes++;
+	hint_released(&ag->desc->first_free_inode, ino % fs->group_inodes);
+	bitsum_update(&fs->inode_sum, ino, 1);
+	if (S_ISDIR(get_inode(fs, ino)->mode)) {
+		ag->desc->dirs--;
+	}
+}
+
+/**
+ * Helper for mkdir
+ * Pick the allocation group of a new directory, in the manner of the Orlov
+ * allocator. A directory deeper in the tree stays in its parent's group while
+ * that group has at least half the average free inodes and blocks, so that a
+ * subtree is kept together. Directories at the top, and those whose parent's
+ * group is getting full, go to the group with the fewest directories among
+ * those with at least the average free inodes and blocks, so that unrelated
+ * trees are spread out and leave room next to them to grow; ties go to the
+ * first group after the one the last spread directory went to
+ */
+unsigned int find_group_dir(fs_ctx *fs, a1fs_ino_t parent){
+	struct a1fs_superblock *sb = (struct a1fs_superblock *)(fs->image);
+	fs_ctx_sync_counts(fs);
+	uint64_t avg_inodes = sb->free_inodes_count / fs->group_count;
+	uint64_t avg_blocks = sb->free_data_block_count / fs->group_count;
+	unsigned int parent_group = inode_group(fs, parent);
+	a1fs_group_desc *pg = fs->groups[parent_group].desc;
+	if (parent != 0 && pg->free_inodes > 0 &&
+	    pg->free_inodes >= avg_inodes / 2 && pg->free_blocks >= avg_blocks / 2) {
+		return parent_group;
+	}
+
+	int best = -1;
+	for (unsigned int n = 0; n < fs->group_count; n++) {
+		unsigned int g = (fs->dir_cursor + n) % fs->group_count;
+		a1fs_group_desc *desc = fs->groups[g].desc;
+		if (desc->free_inodes == 0 || desc->free_inodes < avg_inodes || desc->free_blocks < avg_blocks) {
+			continue;
 		}
-    }
-    return -ENOSPC;
+		if (best < 0 || desc->dirs < fs->groups[best].desc->dirs) {
+			best = g;
+		}
+	}
+	if (best < 0) {
+		return parent_group;
+	}
+	fs->dir_cursor = (best + 1) % fs->group_count;
+	return best;
 }
 
 /** 
@@ -203,14 +419,23 @@ int allocate_inode(fs_ctx *fs){
 */
 int allocate_extent(fs_ctx *fs){
 	struct a1fs_superblock *sb = (struct a1fs_superblock *)(fs->image);
-	struct a1fs_extent *extent_block = (struct a1fs_extent *)(fs->image + A1FS_BLOCK_SIZE * 3);
-	for (int i = 1; i < 512; i++){
+	struct a1fs_extent *extent_block = fs->layout.extents;
+	for (uint32_t i = 1; i < fs->layout.extent_count; i++){
 		if (extent_block[i].start == 0){
 			sb->reserved_extent_number++;
 			return i + 1;
 		}
 	}
-	return -ENOSPC;
+	// All in use: zero the next block of the table that mkfs left as it was
+	if (sb->extent_table_uninit == 0) {
+		return -ENOSPC;
+	}
+	uint32_t i = fs->layout.extent_count;
+	memset(extent_block + i, 0, A1FS_BLOCK_SIZE);
+	fs->layout.extent_count += A1FS_BLOCK_SIZE / sizeof(struct a1fs_extent);
+	sb->extent_table_uninit--;
+	sb->reserved_extent_number++;
+	return i + 1;
 }
 
 /** 
@@ -221,9 +446,9 @@ void make_new_inode(fs_ctx *fs, int new_inode_number, mode_t mode, int extent_nu
 	new_inode.links = 2;
 	if (symbol){
 		new_inode.mode = mode | S_IFDIR;
-		new_inode.size = 2 * sizeof(struct a1fs_dentry);
+		new_inode.size = A1FS_DIRENT_SIZE(1) + A1FS_DIRENT_SIZE(2); // "." and ".."
 	}else{
-		new_inode.mode = mode | S_IFREG;
+		new_inode.mode = mode | S_IFREG | A1FS_S_INLINE; // Data lives in the inode until it grows
 		new_inode.size = 0;
 	}
 	new_inode.extent_number[0] = extent_number;
@@ -234,91 +459,188 @@ void make_new_inode(fs_ctx *fs, int new_inode_number, mode_t mode, int extent_nu
 	struct timespec ts;
 	clock_gettime(CLOCK_REALTIME, &ts);
 	new_inode.mtime = ts;
-	memcpy(fs->image + (new_inode_number) * sizeof(struct a1fs_inode) + 4 * A1FS_BLOCK_SIZE, &new_inode, sizeof(struct a1fs_inode));
+	memcpy(fs->layout.inodes + new_inode_number, &new_inode, sizeof(struct a1fs_inode));
 }
 
 /** 
 	Copy the new extent to the memory 
 */
-void make_new_extent(fs_ctx *fs, int new_extent_number, int new_block_number){
+void make_new_extent(fs_ctx *fs, int new_extent_number, a1fs_blk_t new_block_number){
 	struct a1fs_extent new_extent;
 	new_extent.start = new_block_number;
 	new_extent.count = 1; 
 	
-	memcpy(fs->image + (new_extent_number - 1) * sizeof(struct a1fs_extent) + 3 * A1FS_BLOCK_SIZE, &new_extent, sizeof(struct a1fs_extent));
+	memcpy(fs->layout.extents + (new_extent_number - 1), &new_extent, sizeof(struct a1fs_extent));
 }
 
 /** 
 	Initialize the basic block for the new dir 
+	New directories use the packed format
 */
-void make_new_dir_block(fs_ctx *fs, int new_block_number, int new_inode_number){
+void make_new_dir_block(fs_ctx *fs, a1fs_blk_t new_block_number, int new_inode_number, int parent_inode_number){
+	struct a1fs_superblock *sb = (struct a1fs_superblock *)(fs->image);
+	void *block = block_ptr(fs, new_block_number);
+	dirblk_init(block);
+	dirblk_insert(block, sb->inode_count, new_inode_number, ".", 1);
+	dirblk_insert(block, sb->inode_count, parent_inode_number, "..", 2);
+}
 
+/** 
+	Initialize a directory block of the original format with only empty dentries
+*/
+void make_empty_dir_block(fs_ctx *fs, a1fs_blk_t new_block_number){
 	struct a1fs_superblock *sb = (struct a1fs_superblock *)(fs->image);
-	// initialize the '.' entry
-	struct a1fs_dentry *root_directory = (struct a1fs_dentry *)(fs->image + A1FS_BLOCK_SIZE * new_block_number);
-	struct a1fs_dentry first_dentry;
-	first_dentry.ino = new_inode_number;
-	first_dentry.name[0] = '\0';
-	strcat(first_dentry.name, ".");
-	root_directory[0] = first_dentry;
-	memcpy((fs->image + A1FS_BLOCK_SIZE * new_block_number), &first_dentry, sizeof(struct a1fs_dentry));
-	
-	// initialize the ".." entry
-	struct a1fs_dentry second_dentry;
-	second_dentry.ino = new_inode_number;
-	second_dentry.name[0] = '\0';
-	strcat(second_dentry.name, "..");
-	root_directory[1] = second_dentry;
-	memcpy(fs->image + A1FS_BLOCK_SIZE * new_block_number + sizeof(struct a1fs_dentry), &second_dentry, sizeof(struct a1fs_dentry));
+	struct a1fs_dentry *dentries = (struct a1fs_dentry *)(block_ptr(fs, new_block_number));
+	for (unsigned int i = 0; i < A1FS_BLOCK_SIZE / sizeof(struct a1fs_dentry); i++){
+		dentries[i].ino = sb->inode_count + 1;
+		dentries[i].name[0] = '\0';
+	}
+}
 
-	//Set the default value
-	for (int i = 2; i < 16; i++){
-		struct a1fs_dentry new_dentry;
-		new_dentry.ino = sb->inode_count + 1;
-		new_dentry.name[0] = '\0';
-		memcpy(fs->image + A1FS_BLOCK_SIZE * new_block_number + sizeof(struct a1fs_dentry) * i, &new_dentry, sizeof(struct a1fs_dentry));
+/** 
+	Add a block to a directory's free slot list
+*/
+int push_dir_slot(dir_slots *slots, a1fs_blk_t block){
+	if (slots->count == slots->capacity) {
+		size_t capacity = slots->capacity ? slots->capacity * 2 : 16;
+		a1fs_blk_t *blocks = realloc(slots->blocks, capacity * sizeof(a1fs_blk_t));
+		if (!blocks) {
+			return -ENOMEM;
+		}
+		slots->blocks = blocks;
+		slots->capacity = capacity;
 	}
+	slots->blocks[slots->count++] = block;
+	return 0;
 }
 
 /** 
-	Update the parent dir's infomation 
+	Get a directory's free slot list, building it with one scan on first use
+	Returns NULL if memory runs out
 */
-void update_parent(fs_ctx *fs, struct a1fs_inode *parent_inode, struct a1fs_dentry *dentry, uint32_t parent_inode_number){
+dir_slots *get_dir_slots(fs_ctx *fs, a1fs_ino_t dir){
+	if (fs->dir_slots[dir]) {
+		return fs->dir_slots[dir];
+	}
 	struct a1fs_superblock *sb = (struct a1fs_superblock *)(fs->image);
-	struct a1fs_extent *extent_block = (struct a1fs_extent *)(fs->image + A1FS_BLOCK_SIZE * 3);
-	
-	int success = 0;
-	for (unsigned int j = 0; j < 24; j++){
-		if (parent_inode->extent_number[j] != 0){
-			uint32_t valid_extent_start = extent_block[parent_inode->extent_number[j] - 1].start;
-			struct a1fs_dentry *parent_dentry = (struct a1fs_dentry *)(fs->image + A1FS_BLOCK_SIZE * valid_extent_start);
-			for (unsigned int k = 0; k < A1FS_BLOCK_SIZE / sizeof(struct a1fs_dentry); k++) { // Iterate through 16 dentries
-				if (parent_dentry[k].ino >= sb->inode_count) {//find a blank dentry and copy the data
-					memcpy(fs->image + valid_extent_start * A1FS_BLOCK_SIZE + k * sizeof(a1fs_dentry), dentry, sizeof(a1fs_dentry));
-					success = 1;
-					break;
+	struct a1fs_extent *extent_block = fs->layout.extents;
+	struct a1fs_inode *dir_inode = get_inode(fs, dir);
+	dir_slots *slots = calloc(1, sizeof(dir_slots));
+	if (!slots) {
+		return NULL;
+	}
+	fs->dir_slots[dir] = slots;
+
+	for (int j = 0; j < 24; j++) {
+		if (dir_inode->extent_number[j] > 0) {
+			struct a1fs_extent extent = extent_block[dir_inode->extent_number[j] - 1];
+			for (unsigned int b = 0; b < extent.count; b++) {
+				void *block = block_ptr(fs, extent.start + b);
+				if (dirblk_room(block, sb->inode_count) > 0 && push_dir_slot(slots, extent.start + b) < 0) {
+					fs_ctx_drop_dir_slots(fs, dir);
+					return NULL;
 				}
 			}
-			if (success){
-				break;
-			}
 		}
 	}
-	
-	if (!success){//if the current dentry is full
-		int new_block = allocate_block(fs);
-		int new_extent = allocate_extent(fs);
-		make_new_extent(fs, new_extent, new_block);
-		make_new_dir_block(fs, new_block, parent_inode_number);
-		memcpy(fs->image + new_block * A1FS_BLOCK_SIZE + 2 * sizeof(a1fs_dentry), dentry, sizeof(a1fs_dentry));
-		for (int i = 0; i < 24; i++){
-			if (parent_inode->extent_number[i] == 0){
-				parent_inode->extent_number[i] = new_extent;
-				break;
-			}
+	// Insertions take from the end; fill the holes nearest the start first
+	for (size_t i = 0; i < slots->count / 2; i++) {
+		a1fs_blk_t tmp = slots->blocks[i];
+		slots->blocks[i] = slots->blocks[slots->count - 1 - i];
+		slots->blocks[slots->count - 1 - i] = tmp;
+	}
+	return slots;
+}
+
+/** 
+	Remove the i-th block from a directory's free slot list
+*/
+void drop_dir_slot(dir_slots *slots, size_t i){
+	memmove(&slots->blocks[i], &slots->blocks[i + 1], (slots->count - i - 1) * sizeof(a1fs_blk_t));
+	slots->count--;
+}
+
+/** 
+	Copy an entry into the last block of a directory's free slot list that
+	has room for its name
+	Returns the number of bytes the directory grows by, or -1 if no block
+	has room
+*/
+int fill_dir_hole(fs_ctx *fs, dir_slots *slots, struct a1fs_dentry *dentry){
+	struct a1fs_superblock *sb = (struct a1fs_superblock *)(fs->image);
+	size_t len = strlen(dentry->name);
+	size_t i = slots->count;
+	while (i > 0) {
+		i--;
+		void *block = block_ptr(fs, slots->blocks[i]);
+		size_t room = dirblk_room(block, sb->inode_count);
+		if (room == 0) { // No hole left in this block
+			drop_dir_slot(slots, i);
+			continue;
 		}
+		if (room < len) { // Only shorter names fit
+			continue;
+		}
+		int used = dirblk_insert(block, sb->inode_count, dentry->ino, dentry->name, len);
+		if (dirblk_room(block, sb->inode_count) == 0) { // Block is full now
+			drop_dir_slot(slots, i);
+		}
+		return used;
+	}
+	return -1;
+}
+
+/** 
+	Update the parent dir's infomation 
+	The new entry goes into a hole from the free slot list, or else into a
+	new tail block
+*/
+int update_parent(fs_ctx *fs, struct a1fs_inode *parent_inode, struct a1fs_dentry *dentry, uint32_t parent_inode_number){
+	struct a1fs_superblock *sb = (struct a1fs_superblock *)(fs->image);
+	struct a1fs_extent *extent_block = fs->layout.extents;
+	dir_slots *slots = get_dir_slots(fs, parent_inode_number);
+	if (!slots) {
+		return -ENOMEM;
+	}
+
+	int used = fill_dir_hole(fs, slots, dentry);
+	if (used > 0) {
+		parent_inode->size += used;
+		return 0;
+	}
+
+	//if every block is full, append a new one
+	int index = 0;
+	while (index < 24 && parent_inode->extent_number[index] != 0) {
+		index++;
+	}
+	if (index == 24) {
+		return -ENOSPC;
 	}
-	parent_inode->size += sizeof(a1fs_dentry);
+	int new_extent = allocate_extent(fs);
+	if (new_extent < 0) {
+		return -ENOSPC;
+	}
+	int64_t new_block = allocate_block(fs, inode_group(fs, parent_inode_number));
+	if (new_block < 0) {
+		sb->reserved_extent_number--;
+		return -ENOSPC;
+	}
+	make_new_extent(fs, new_extent, new_block);
+	// The new block takes the format of the first one
+	void *block = block_ptr(fs, new_block);
+	if (dirblk_packed(block_ptr(fs, extent_block[parent_inode->extent_number[0] - 1].start))) {
+		dirblk_init(block);
+	} else {
+		make_empty_dir_block(fs, new_block);
+	}
+	used = dirblk_insert(block, sb->inode_count, dentry->ino, dentry->name, strlen(dentry->name));
+	parent_inode->extent_number[index] = new_extent;
+	if (push_dir_slot(slots, new_block) < 0) { // Rebuilt on next use
+		fs_ctx_drop_dir_slots(fs, parent_inode_number);
+	}
+	parent_inode->size += used;
+	return 0;
 }
 
 /**  
@@ -339,105 +661,1095 @@ void assign_bitmap(unsigned char*bitmap, uint32_t destination){
 	bitmap[byte] |= (1 << bit);
 }
 
-/** 
- * Helper for truncate
- * Should modify the list of integers to map the postions of zeros appear in block bitmap
- */
-void find_zero_postions(fs_ctx *fs, int *zero_pos) {
-    struct a1fs_superblock *sb = (struct a1fs_superblock *)(fs->image);
-    unsigned char *block_bitmap = fs->image + A1FS_BLOCK_SIZE * 2;
-	int ceil = ceiling_bit(sb->data_block_count);
-	int pos = 0;
-    for (int i = 0; i < ceil; i++) {
-       	for (unsigned j = 0; j < 8; j++) {
-			// Found one segment of consecutive empty blocks (within 1 byte)
-			if (strcmp((block_bitmap[i] & (1 << j) ? "1" : "0"), "0") == 0) {
-				zero_pos[pos] = 8 * i + j;
-				pos++;
-			}
-		}
-    }
+/**
+ * Set (if set is true) or clear count bits of a bitmap starting at first, a
+ * 64-bit word at a time; bitmaps take whole blocks, so the word holding the
+ * last bit is always there
+ */
+void fill_bitmap_range(unsigned char *bitmap, uint64_t first, uint64_t count, bool set){
+	uint64_t end = first + count;
+	while (first < end) {
+		uint64_t shift = first % 64;
+		uint64_t n = end - first < 64 - shift ? end - first : 64 - shift;
+		uint64_t mask = (n == 64 ? ~0ull : (1ull << n) - 1) << shift;
+		uint64_t word;
+		memcpy(&word, bitmap + first / 64 * 8, sizeof(word));
+		word = set ? word | mask : word & ~mask;
+		memcpy(bitmap + first / 64 * 8, &word, sizeof(word));
+		first += n;
+	}
 }
 
-
-/**=========================================================================A1FS System Call Function Below============================================================================*/
-
 /**
- * Initialize the file system.
- *
- * Called when the file system is mounted. NOTE: we are not using the FUSE
- * init() callback since it doesn't support returning errors. This function must
- * be called explicitly before fuse_main().
- *
- * @param fs    file system context to initialize.
- * @param opts  command line options.
- * @return      true on success; false on failure.
+ * Mark count data blocks starting at start (absolute block number) as used;
+ * each group they span is updated once
  */
-static bool a1fs_init(fs_ctx *fs, a1fs_opts *opts)
-{
-	// Nothing to initialize if only printing help or version
-	if (opts->help || opts->version) return true;
+void claim_range(fs_ctx *fs, a1fs_blk_t start, a1fs_blk_t count){
+	uint64_t index = start - fs->layout.data_start;
+	uint64_t end = index + count;
+	while (index < end) {
+		unsigned int group = index / A1FS_GROUP_BLOCKS;
+		uint64_t rel = index % A1FS_GROUP_BLOCKS;
+		uint64_t n = end - index < A1FS_GROUP_BLOCKS - rel ? end - index : A1FS_GROUP_BLOCKS - rel;
+		alloc_group *ag = &fs->groups[group];
+		init_group(fs, group, true);
+		fill_bitmap_range(fs->layout.block_bitmap, index, n, true);
+		ag->desc->free_blocks -= n;
+		if (ag->desc->first_free_block >= rel && ag->desc->first_free_block < rel + n) {
+			ag->desc->first_free_block = rel + n;
+		}
+		bitsum_update(&fs->block_sum, index, n);
+		index += n;
+	}
+}
 
-	size_t size;
-	void *image = map_file(opts->img_path, A1FS_BLOCK_SIZE, &size);
-	if (!image) return false;
+/**
+ * Mark count data blocks starting at start (absolute block number) as free;
+ * each group they span is updated once
+ */
+void free_range(fs_ctx *fs, a1fs_blk_t start, a1fs_blk_t count){
+	uint64_t index = start - fs->layout.data_start;
+	uint64_t end = index + count;
+	while (index < end) {
+		unsigned int group = index / A1FS_GROUP_BLOCKS;
+		uint64_t rel = index % A1FS_GROUP_BLOCKS;
+		uint64_t n = end - index < A1FS_GROUP_BLOCKS - rel ? end - index : A1FS_GROUP_BLOCKS - rel;
+		alloc_group *ag = &fs->groups[group];
+		fill_bitmap_range(fs->layout.block_bitmap, index, n, false);
+		ag->desc->free_blocks += n;
+		hint_released(&ag->desc->first_free_block, rel);
+		bitsum_update(&fs->block_sum, index, n);
+		index += n;
+	}
+}
 
-	return fs_ctx_init(fs, image, size, opts);
+/**
+ * Helper for truncate
+ * Number of free data blocks in a row from the one at bitmap index index, up
+ * to max; the bitmap is read a word at a time, and a group that was never
+ * initialized is free as a whole
+ */
+a1fs_blk_t free_run_length(fs_ctx *fs, uint64_t index, a1fs_blk_t max){
+	uint64_t nbits = fs->block_sum.nbits;
+	uint64_t end = nbits - index < max ? nbits : index + max;
+	uint64_t i = index;
+	bool used = false;
+	while (i < end && !used) {
+		unsigned int group = i / A1FS_GROUP_BLOCKS;
+		uint64_t group_end = (uint64_t)(group + 1) * A1FS_GROUP_BLOCKS < end ? (uint64_t)(group + 1) * A1FS_GROUP_BLOCKS : end;
+		alloc_group *ag = &fs->groups[group];
+		if (ag->desc->flags & A1FS_GROUP_BLOCK_UNINIT) {
+			i = group_end;
+		}
+		while (i < group_end) {
+			uint64_t shift = i % 64;
+			uint64_t n = group_end - i < 64 - shift ? group_end - i : 64 - shift;
+			uint64_t word;
+			memcpy(&word, fs->layout.block_bitmap + i / 64 * 8, sizeof(word));
+			word = (word >> shift) & (n == 64 ? ~0ull : (1ull << n) - 1);
+			if (word != 0) {
+				i += __builtin_ctzll(word);
+				used = true;
+				break;
+			}
+			i += n;
+		}
+	}
+	return i - index;
 }
 
 /**
- * Cleanup the file system.
- *
- * Called when the file system is unmounted. Must cleanup all the resources
- * created in a1fs_init().
+ * Helper for truncate
+ * Find the first free data block, going through the allocation groups from
+ * the given one on and wrapping around to the ones before it, and how many
+ * free blocks follow it, up to max. Returns the bitmap index of the block
+ * and sets *count, or returns -1 if there are no free blocks
  */
-static void a1fs_destroy(void *ctx)
-{
-	fs_ctx *fs = (fs_ctx*)ctx;
-	if (fs->image) {
-		if (fs->opts->sync && (msync(fs->image, fs->size, MS_SYNC) < 0)) {
-			perror("msync");
+int64_t find_free_extent(fs_ctx *fs, unsigned int group, a1fs_blk_t max, a1fs_blk_t *count){
+	uint64_t nbits = fs->block_sum.nbits;
+	if (group >= fs->group_count) group = 0;
+	for (unsigned int i = 0; i < fs->group_count; i++) {
+		unsigned int g = (group + i) % fs->group_count;
+		uint64_t from = (uint64_t)g * A1FS_GROUP_BLOCKS;
+		uint64_t to = from + A1FS_GROUP_BLOCKS < nbits ? from + A1FS_GROUP_BLOCKS : nbits;
+		// The summary can only be searched where the bitmap has been written
+		init_group(fs, g, true);
+		int64_t bit = bitsum_find(&fs->block_sum, from + fs->groups[g].desc->first_free_block, to);
+		if (bit >= 0) {
+			*count = free_run_length(fs, bit, max);
+			return bit;
 		}
-		munmap(fs->image, fs->size);
-		fs_ctx_destroy(fs);
 	}
+	return -1;
 }
 
-/** Get file system context. */
-static fs_ctx *get_fs(void)
-{
-	return (fs_ctx*)fuse_get_context()->private_data;
+/** 
+	Release a data block
+*/
+void free_block(fs_ctx *fs, a1fs_blk_t block){
+	unsigned char *block_bitmap = fs->layout.block_bitmap;
+	a1fs_blk_t index = block - fs->layout.data_start;
+	alloc_group *ag = &fs->groups[index / A1FS_GROUP_BLOCKS];
+	reset_bitmap(block_bitmap, index);
+	ag->desc->free_blocks++;
+	hint_released(&ag->desc->first_free_block, index % A1FS_GROUP_BLOCKS);
+	bitsum_update(&fs->block_sum, index, 1);
 }
 
+/** 
+	Zero count data blocks starting at start
+	With --punch, the blocks are punched out of the image file, which also
+	zeroes them, so that the file's disk usage only covers blocks holding
+	data; they are written with zeros if the host file system can't punch holes
+*/
+void zero_blocks(fs_ctx *fs, a1fs_blk_t start, a1fs_blk_t count){
+	off_t pos = (off_t)start * A1FS_BLOCK_SIZE;
+	off_t len = (off_t)count * A1FS_BLOCK_SIZE;
+	if (!fs->opts->punch || fallocate(fs->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, pos, len) < 0) {
+		memset(fs->image + pos, 0, len);
+	}
+}
 
-/**
- * Get file system statistics.
- *
- * Implements the statvfs() system call. See "man 2 statvfs" for details.
- * The f_bfree and f_bavail fields should be set to the same value.
- * The f_ffree and f_favail fields should be set to the same value.
- * The f_fsid and f_flag fields are ignored.
- *
- * @param path  path to any file in the file system. Can be ignored.
- * @param st    pointer to the struct statvfs that receives the result.
- * @return      0 on success; -errno on error.
- */
-static int a1fs_statfs(const char *path, struct statvfs *st)
-{
-	(void)path;// unused
-	fs_ctx *fs = get_fs();
+/** 
+	Zero and release count data blocks starting at start
+*/
+void release_blocks(fs_ctx *fs, a1fs_blk_t start, a1fs_blk_t count){
+	zero_blocks(fs, start, count);
+	free_range(fs, start, count);
+}
 
-	memset(st, 0, sizeof(*st));
-	st->f_bsize   = A1FS_BLOCK_SIZE;
-	st->f_frsize  = A1FS_BLOCK_SIZE;
-	
+/** 
+	Compact a directory
+	Once at least A1FS_COMPACT_MIN_DEAD bytes are dead and they make up half
+	of the directory, the live entries of the tail block are moved into holes
+	further up and the emptied tail block is freed, along with its extent if
+	that was its last block. At most budget blocks are released per call so
+	that removals stay cheap; the directory shrinks a little with each one.
+	The first block is never released.
+*/
+void compact_dir(fs_ctx *fs, a1fs_ino_t dir, unsigned int budget){
 	struct a1fs_superblock *sb = (struct a1fs_superblock *)(fs->image);
-	if (sb->magic != A1FS_MAGIC){
+	struct a1fs_extent *extent_block = fs->layout.extents;
+	struct a1fs_inode *dir_inode = get_inode(fs, dir);
+
+	// The size of a directory is the space taken by its live entries
+	uint64_t capacity = 0;
+	for (int j = 0; j < 24; j++) {
+		if (dir_inode->extent_number[j] > 0) {
+			capacity += (uint64_t)extent_block[dir_inode->extent_number[j] - 1].count * A1FS_BLOCK_SIZE;
+		}
+	}
+	uint64_t live = dir_inode->size;
+	if (live * 2 > capacity || capacity - live < A1FS_COMPACT_MIN_DEAD) {
+		return;
+	}
+	dir_slots *slots = get_dir_slots(fs, dir);
+	if (!slots) {
+		return;
+	}
+
+	bool moved = false;
+	while (budget > 0 && capacity > A1FS_BLOCK_SIZE) {
+		// The holes outside the tail can only take all of its entries if at
+		// least a block's worth of space is dead. Packed records may not fit
+		// even then; we find out as we go.
+		if (capacity - live < A1FS_BLOCK_SIZE) {
+			break;
+		}
+
+		// The tail is the last block of the last extent
+		int last = 23;
+		while (dir_inode->extent_number[last] == 0) {
+			last--;
+		}
+		struct a1fs_extent *extent = &extent_block[dir_inode->extent_number[last] - 1];
+		a1fs_blk_t tail = extent->start + extent->count - 1;
+		void *block = block_ptr(fs, tail);
+
+		// Its entries must not be moved back into it
+		size_t n = 0;
+		for (size_t i = 0; i < slots->count; i++) {
+			if (slots->blocks[i] != tail) {
+				slots->blocks[n++] = slots->blocks[i];
+			}
+		}
+		slots->count = n;
+
+		uint32_t cursor = 0;
+		dirblk_ent ent;
+		while (dirblk_next(block, sb->inode_count, &cursor, &ent)) {
+			struct a1fs_dentry moving;
+			moving.ino = ent.ino;
+			memcpy(moving.name, ent.name, ent.len + 1);
+			if (fill_dir_hole(fs, slots, &moving) < 0) { // Tail stays, with what is left
+				fs_ctx_drop_dir_slots(fs, dir);
+				goto done;
+			}
+			dirblk_remove(block, sb->inode_count, ent.off);
+			moved = true;
+		}
+
+		release_blocks(fs, tail, 1);
+		extent->count--;
+		if (extent->count == 0) {
+			extent->start = 0;
+			dir_inode->extent_number[last] = 0;
+			sb->reserved_extent_number--;
+		}
+		capacity -= A1FS_BLOCK_SIZE;
+		budget--;
+	}
+done:
+	// Cached entries may have moved or sit in a freed block
+	if (moved && fs->dcache.dir == dir) {
+		dcache_invalidate(&fs->dcache);
+	}
+}
+
+/** 
+	Remove an entry from a directory
+	Removes it from its block, records the hole in the directory's free slot
+	list and compacts the directory if enough of it is dead
+*/
+void remove_dentry(fs_ctx *fs, a1fs_ino_t dir, dir_pos pos){
+	struct a1fs_superblock *sb = (struct a1fs_superblock *)(fs->image);
+	void *block = block_ptr(fs, pos.block);
+	bool was_full = dirblk_room(block, sb->inode_count) == 0;
+
+	uint32_t cursor = pos.off;
+	dirblk_ent ent;
+	if (dirblk_next(block, sb->inode_count, &cursor, &ent)) {
+		dcache_remove(&fs->dcache, dir, pos, name_hash(ent.name, ent.len));
+	}
+	get_inode(fs, dir)->size -= dirblk_remove(block, sb->inode_count, pos.off);
+
+	if (was_full && fs->dir_slots[dir] && push_dir_slot(fs->dir_slots[dir], pos.block) < 0) {
+		fs_ctx_drop_dir_slots(fs, dir);
+	}
+	if (fs->dir_opens[dir] == 0) {
+		compact_dir(fs, dir, A1FS_COMPACT_STEP);
+	}
+}
+
+
+/**
+ * Number of bytes of file data an extent holds
+ */
+off_t extent_bytes(const struct a1fs_extent *extent) {
+	if (extent->count & A1FS_EXTENT_FRAG) {
+		return (off_t)A1FS_FRAG_COUNT(extent->count) * A1FS_FRAG_SIZE;
+	}
+	return (off_t)extent->count * A1FS_BLOCK_SIZE;
+}
+
+/**
+ * Position in the image of the first byte of an extent
+ */
+off_t extent_pos(const struct a1fs_extent *extent) {
+	off_t pos = (off_t)extent->start * A1FS_BLOCK_SIZE;
+	if (extent->count & A1FS_EXTENT_FRAG) {
+		pos += (off_t)A1FS_FRAG_FIRST(extent->count) * A1FS_FRAG_SIZE;
+	}
+	return pos;
+}
+
+/**
+ * Helper for read_buf/write_buf
+ * Fill segs with fd+offset buffers for the image ranges that hold bytes
+ * [offset, offset + size) of the file, one buffer per extent.
+ * segs must have room for 24 buffers. Returns the number of buffers filled.
+ */
+size_t map_extents(fs_ctx *fs, struct a1fs_inode *inode, off_t offset, size_t size, struct fuse_buf *segs) {
+	struct a1fs_extent *extent_block = fs->layout.extents;
+	size_t n = 0;
+	off_t pos = 0; // File offset of the current extent
+	for (int i = 0; i < 24 && size > 0; i++) {
+		if (inode->extent_number[i] == 0) {
+			continue;
+		}
+		struct a1fs_extent extent = extent_block[inode->extent_number[i] - 1];
+		if (extent.start == 0) {
+			continue;
+		}
+		off_t len = extent_bytes(&extent);
+		if (offset < pos + len) { // Requested range starts in this extent
+			off_t skip = offset - pos;
+			size_t chunk = len - skip < (off_t)size ? (size_t)(len - skip) : size;
+			segs[n].size = chunk;
+			segs[n].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+			segs[n].mem = NULL;
+			segs[n].fd = fs->fd;
+			segs[n].pos = extent_pos(&extent) + skip;
+			n++;
+			offset += chunk;
+			size -= chunk;
+		}
+		pos += len;
+	}
+	return n;
+}
+
+/**
+ * Helper for read_buf/write_buf
+ * Allocate a bufvec that can describe a whole file, i.e. one buffer for each
+ * of the 24 possible extents. Must be released with free().
+ */
+struct fuse_bufvec *alloc_extent_bufvec(void) {
+	struct fuse_bufvec *vec = malloc(sizeof(struct fuse_bufvec) + 23 * sizeof(struct fuse_buf));
+	if (vec) {
+		*vec = FUSE_BUFVEC_INIT(0);
+	}
+	return vec;
+}
+
+
+/**
+ * Helper for truncate and release
+ * Index in extent_number of the last extent of a file; -1 if it has none
+ */
+int last_extent(struct a1fs_inode *inode)
+{
+	int last = 23;
+	while (last >= 0 && inode->extent_number[last] == 0) {
+		last--;
+	}
+	return last;
+}
+
+/**
+ * Helper for truncate, unpack_tail and the defragmenter
+ * Merge the whole extents of a file that follow each other on disk, giving
+ * the table entries of the merged ones back, and move the slots in use to
+ * the front in the same order. Returns the number of extents merged away
+ */
+int merge_extents(fs_ctx *fs, struct a1fs_inode *inode)
+{
+	struct a1fs_superblock *sb = (struct a1fs_superblock *)(fs->image);
+	struct a1fs_extent *extent_block = fs->layout.extents;
+	struct a1fs_extent *prev = NULL;
+	int merged = 0;
+	int used = 0;
+	for (int i = 0; i < 24; i++) {
+		uint32_t n = inode->extent_number[i];
+		if (n == 0) {
+			continue;
+		}
+		struct a1fs_extent *extent = &extent_block[n - 1];
+		inode->extent_number[i] = 0;
+		if (prev != NULL && !(extent->count & A1FS_EXTENT_FRAG) && prev->start + prev->count == extent->start &&
+		    (uint64_t)prev->count + extent->count < A1FS_EXTENT_FRAG) {
+			prev->count += extent->count;
+			extent->start = 0;
+			extent->count = 0;
+			sb->reserved_extent_number--;
+			merged++;
+			continue;
+		}
+		prev = (extent->count & A1FS_EXTENT_FRAG) ? NULL : extent;
+		inode->extent_number[used++] = n;
+	}
+	return merged;
+}
+
+/**
+ * Helper for truncate
+ * Grow the last extent of a file in place by up to count zeroed blocks, for
+ * as long as the blocks right after it are free, so that growing a file
+ * doesn't take another extent. Returns the number of blocks added
+ */
+a1fs_blk_t grow_last_extent(fs_ctx *fs, struct a1fs_inode *inode, a1fs_blk_t count)
+{
+	int last = last_extent(inode);
+	if (last < 0) {
+		return 0;
+	}
+	struct a1fs_extent *extent = &fs->layout.extents[inode->extent_number[last] - 1];
+	if (extent->count & A1FS_EXTENT_FRAG) {
+		return 0;
+	}
+	a1fs_blk_t room = A1FS_EXTENT_FRAG - 1 - extent->count;
+	a1fs_blk_t end = extent->start + extent->count;
+	if (end < fs->layout.data_start) {
+		return 0;
+	}
+	a1fs_blk_t added = free_run_length(fs, end - fs->layout.data_start, count < room ? count : room);
+	if (added > 0) {
+		zero_blocks(fs, end, added);
+		claim_range(fs, end, added);
+		extent->count += added;
+	}
+	return added;
+}
+
+/**
+ * Helper for truncate and write_buf
+ * Move the tail of a file out of its fragment run into a block of its own,
+ * so that the file can change size like any other
+ * Returns 0 on success (or if the tail is not a fragment run), -ENOSPC if
+ * there is no free block
+ */
+int unpack_tail(fs_ctx *fs, struct a1fs_inode *inode)
+{
+	struct a1fs_extent *extent_block = fs->layout.extents;
+	int last = last_extent(inode);
+	if (last < 0 || !(extent_block[inode->extent_number[last] - 1].count & A1FS_EXTENT_FRAG)) {
+		return 0;
+	}
+	struct a1fs_extent *run = &extent_block[inode->extent_number[last] - 1];
+	// The block right after the extent before the tail is taken if it's free, so the two merge
+	int64_t new_block_number = -1;
+	for (int i = last - 1; i >= 0; i--) {
+		if (inode->extent_number[i] > 0) {
+			struct a1fs_extent *prev = &extent_block[inode->extent_number[i] - 1];
+			if (block_is_free(fs, prev->start + prev->count)) {
+				new_block_number = prev->start + prev->count;
+				claim_block(fs, new_block_number);
+			}
+			break;
+		}
+	}
+	if (new_block_number < 0) {
+		new_block_number = allocate_block(fs, inode_group(fs, inode_number(fs, inode)));
+	}
+	if (new_block_number < 0) {
+		return -ENOSPC;
+	}
+
+	unsigned char *block = block_ptr(fs, new_block_number);
+	off_t bytes = extent_bytes(run);
+	memcpy(block, fs->image + extent_pos(run), bytes);
+	memset(block + bytes, 0, A1FS_BLOCK_SIZE - bytes);
+	memset(fs->image + extent_pos(run), 0, bytes);
+	if (frag_release(&fs->frags, run->start, A1FS_FRAG_FIRST(run->count), A1FS_FRAG_COUNT(run->count))) {
+		free_block(fs, run->start);
+	}
+	run->start = new_block_number;
+	run->count = 1;
+	merge_extents(fs, inode);
+	return 0;
+}
+
+/**
+ * Helper for release
+ * Move the tail of a file into a fragment run if it uses at most
+ * A1FS_FRAG_TAIL_MAX bytes of its last block, and free that block. The run
+ * goes into a block that already has fragments in use if one has room, so
+ * that the tails of files written one after another share blocks.
+ * Packing is opportunistic: the file is left as it is if anything is short.
+ */
+void pack_tail(fs_ctx *fs, struct a1fs_inode *inode)
+{
+	struct a1fs_extent *extent_block = fs->layout.extents;
+	int last = last_extent(inode);
+	if ((inode->mode & A1FS_S_INLINE) || last < 0) {
+		return;
+	}
+	struct a1fs_extent *extent = &extent_block[inode->extent_number[last] - 1];
+	if ((extent->count & A1FS_EXTENT_FRAG) || extent->start == 0 || extent->count == 0) {
+		return;
+	}
+
+	// Bytes of the file in its last block
+	uint64_t before = 0;
+	for (int i = 0; i < last; i++) {
+		if (inode->extent_number[i] > 0) {
+			before += extent_bytes(&extent_block[inode->extent_number[i] - 1]);
+		}
+	}
+	before += (uint64_t)(extent->count - 1) * A1FS_BLOCK_SIZE;
+	if (inode->size <= before || inode->size - before > A1FS_FRAG_TAIL_MAX) {
+		return;
+	}
+	uint64_t tail = inode->size - before;
+	unsigned int n = (tail + A1FS_FRAG_SIZE - 1) / A1FS_FRAG_SIZE;
+
+	// The run replaces the extent if the tail is all of it, else follows it
+	int new_extent_number = 0;
+	if (extent->count > 1) {
+		if (last == 23) {
+			return;
+		}
+		new_extent_number = allocate_extent(fs);
+		if (new_extent_number < 0) {
+			return;
+		}
+	}
+	a1fs_blk_t frag_block;
+	int first = frag_alloc(&fs->frags, n, &frag_block);
+	if (first < 0) {
+		int64_t new_block_number = allocate_block(fs, inode_group(fs, inode_number(fs, inode)));
+		if (new_block_number < 0 || frag_take(&fs->frags, new_block_number, 0, n) < 0) {
+			if (new_block_number >= 0) {
+				free_block(fs, new_block_number);
+			}
+			if (new_extent_number > 0) {
+				((struct a1fs_superblock *)(fs->image))->reserved_extent_number--;
+			}
+			return;
+		}
+		frag_block = new_block_number;
+		first = 0;
+		memset(block_ptr(fs, frag_block), 0, A1FS_BLOCK_SIZE);
+	}
+
+	a1fs_blk_t tail_block = extent->start + extent->count - 1;
+	unsigned char *dst = (unsigned char *)block_ptr(fs, frag_block) + first * A1FS_FRAG_SIZE;
+	memcpy(dst, block_ptr(fs, tail_block), tail);
+	memset(dst + tail, 0, n * A1FS_FRAG_SIZE - tail);
+	memset(block_ptr(fs, tail_block), 0, A1FS_BLOCK_SIZE);
+	free_block(fs, tail_block);
+
+	if (new_extent_number > 0) {
+		extent->count--;
+		extent_block[new_extent_number - 1].start = frag_block;
+		extent_block[new_extent_number - 1].count = A1FS_FRAG_RUN(first, n);
+		inode->extent_number[last + 1] = new_extent_number;
+	} else {
+		extent->start = frag_block;
+		extent->count = A1FS_FRAG_RUN(first, n);
+	}
+}
+
+/**
+ * Helper for unlink and truncate
+ * Free all data blocks, fragment runs and extents of a file. The file is left
+ * with no extents; its size is not changed
+ */
+void free_extents(fs_ctx *fs, struct a1fs_inode *inode)
+{
+	struct a1fs_superblock *sb = (struct a1fs_superblock *)(fs->image);
+	struct a1fs_extent *extent_block = fs->layout.extents;
+	for (int index = 0; index < 24; index++) {
+		if (inode->extent_number[index] > 0){//valid extent
+			uint32_t extent_start = extent_block[inode->extent_number[index] - 1].start;
+			uint32_t extent_count = extent_block[inode->extent_number[index] - 1].count;
+			if (extent_start > 0 && (extent_count & A1FS_EXTENT_FRAG)) { // Tail in a shared block
+				struct a1fs_extent *run = &extent_block[inode->extent_number[index] - 1];
+				memset(fs->image + extent_pos(run), 0, extent_bytes(run));
+				if (frag_release(&fs->frags, extent_start, A1FS_FRAG_FIRST(extent_count), A1FS_FRAG_COUNT(extent_count))) {
+					free_block(fs, extent_start);
+				}
+			} else if (extent_start > 0){
+				release_blocks(fs, extent_start, extent_count);
+			}
+			extent_block[inode->extent_number[index] - 1].start = 0;
+			extent_block[inode->extent_number[index] - 1].count = 0;
+			inode->extent_number[index] = 0;
+			sb->reserved_extent_number--;
+		}
+	}
+}
+
+/**
+ * Helper for unlink
+ * Number of whole data blocks of a file; fragment runs are not counted
+ */
+unsigned int count_blocks(fs_ctx *fs, struct a1fs_inode *inode)
+{
+	struct a1fs_extent *extent_block = fs->layout.extents;
+	unsigned int blocks = 0;
+	for (int i = 0; i < 24 && !(inode->mode & A1FS_S_INLINE); i++) {
+		if (inode->extent_number[i] > 0 && !(extent_block[inode->extent_number[i] - 1].count & A1FS_EXTENT_FRAG)) {
+			blocks += extent_block[inode->extent_number[i] - 1].count;
+		}
+	}
+	return blocks;
+}
+
+/**
+ * Helper for the reclaimer
+ * Free up to budget blocks of the last inode on the orphan list, trimming its
+ * extents from the end. Once the inode has no blocks left, free it and take
+ * it off the list. Returns the number of blocks freed
+ */
+unsigned int reclaim_orphan(fs_ctx *fs, unsigned int budget)
+{
+	struct a1fs_superblock *sb = (struct a1fs_superblock *)(fs->image);
+	struct a1fs_extent *extent_block = fs->layout.extents;
+	if (sb->orphan_count == 0) {
+		return 0;
+	}
+	a1fs_ino_t ino = sb->orphans[sb->orphan_count - 1];
+	struct a1fs_inode *inode = get_inode(fs, ino);
+
+	unsigned int freed = 0;
+	int last;
+	while (freed < budget && !(inode->mode & A1FS_S_INLINE) && (last = last_extent(inode)) >= 0) {
+		struct a1fs_extent *extent = &extent_block[inode->extent_number[last] - 1];
+		if (extent->count & A1FS_EXTENT_FRAG) { // Tail in a shared block
+			memset(fs->image + extent_pos(extent), 0, extent_bytes(extent));
+			if (frag_release(&fs->frags, extent->start, A1FS_FRAG_FIRST(extent->count), A1FS_FRAG_COUNT(extent->count))) {
+				free_block(fs, extent->start);
+			}
+			extent->count = 0;
+			freed++;
+		}
+		if (freed < budget && extent->count > 0) {
+			a1fs_blk_t n = extent->count < budget - freed ? extent->count : budget - freed;
+			extent->count -= n;
+			release_blocks(fs, extent->start + extent->count, n);
+			freed += n;
+		}
+		if (extent->count == 0) { // Nothing left of the extent
+			extent->start = 0;
+			inode->extent_number[last] = 0;
+			sb->reserved_extent_number--;
+		}
+	}
+
+	if ((inode->mode & A1FS_S_INLINE) || last_extent(inode) < 0) {
+		free_inode(fs, ino);
+		memset(inode, 0, sizeof(struct a1fs_inode));
+		sb->orphan_count--;
+	}
+	return freed;
+}
+
+/**
+ * Helper for the defragmenter
+ * Find count free data blocks in a row within one allocation group, trying
+ * the given group first; a group whose bitmap was never written is free from
+ * its first block. Returns the bitmap index of the first block, or -1
+ */
+int64_t find_free_run(fs_ctx *fs, uint64_t count, unsigned int group)
+{
+	uint64_t nbits = fs->block_sum.nbits;
+	for (unsigned int i = 0; i < fs->group_count; i++) {
+		unsigned int g = (group + i) % fs->group_count;
+		uint64_t from = (uint64_t)g * A1FS_GROUP_BLOCKS;
+		uint64_t to = from + A1FS_GROUP_BLOCKS < nbits ? from + A1FS_GROUP_BLOCKS : nbits;
+		alloc_group *ag = &fs->groups[g];
+		int64_t start = -1;
+		if (ag->desc->free_blocks >= count) {
+			if (ag->desc->flags & A1FS_GROUP_BLOCK_UNINIT) {
+				start = from;
+			} else {
+				start = bitsum_find_run(&fs->block_sum, from + ag->desc->first_free_block, to, count);
+			}
+		}
+		if (start >= 0) {
+			return start;
+		}
+	}
+	return -1;
+}
+
+/**
+ * Helper for the defragmenter
+ * Merge the extents of a regular file that follow each other on disk, and if
+ * it still takes more than one, move its data blocks into a single free run,
+ * preferably in the group of its inode, and put its extents in order: the
+ * run first, then the fragment run of its tail if it has one. Files larger
+ * than a group are not moved.
+ * Returns the number of extents given back to the extent table
+ */
+int defrag_file(fs_ctx *fs, a1fs_ino_t ino)
+{
+	struct a1fs_superblock *sb = (struct a1fs_superblock *)(fs->image);
+	struct a1fs_extent *extent_block = fs->layout.extents;
+	struct a1fs_inode *inode = get_inode(fs, ino);
+	if (!S_ISREG(inode->mode) || (inode->mode & A1FS_S_INLINE) || inode->links == 0) {
+		return 0;
+	}
+
+	// Extents that already follow each other on disk only need merging
+	int freed = merge_extents(fs, inode);
+	int whole = 0;
+	uint64_t blocks = 0;
+	uint32_t tail = 0;
+	for (int i = 0; i < 24; i++) {
+		uint32_t n = inode->extent_number[i];
+		if (n == 0) {
+			continue;
+		}
+		if (extent_block[n - 1].count & A1FS_EXTENT_FRAG) {
+			tail = n;
+		} else {
+			whole++;
+			blocks += extent_block[n - 1].count;
+		}
+	}
+	if (whole < 2 || blocks > A1FS_GROUP_BLOCKS) {
+		return freed;
+	}
+	int64_t index = find_free_run(fs, blocks, inode_group(fs, ino));
+	if (index < 0) {
+		return freed;
+	}
+
+	a1fs_blk_t dst = index + fs->layout.data_start;
+	claim_range(fs, dst, blocks);
+	// Copy the extents in file order, keeping the first table entry for the run
+	a1fs_blk_t pos = dst;
+	uint32_t first = 0;
+	for (int i = 0; i < 24; i++) {
+		uint32_t n = inode->extent_number[i];
+		if (n == 0 || n == tail) {
+			continue;
+		}
+		struct a1fs_extent *extent = &extent_block[n - 1];
+		memcpy(block_ptr(fs, pos), block_ptr(fs, extent->start),
+		       (size_t)extent->count * A1FS_BLOCK_SIZE);
+		pos += extent->count;
+		release_blocks(fs, extent->start, extent->count);
+		if (first == 0) {
+			first = n;
+		} else {
+			extent->start = 0;
+			extent->count = 0;
+			sb->reserved_extent_number--;
+			freed++;
+		}
+		inode->extent_number[i] = 0;
+	}
+	extent_block[first - 1].start = dst;
+	extent_block[first - 1].count = blocks;
+	inode->extent_number[0] = first;
+	if (tail != 0) {
+		for (int i = 0; i < 24; i++) {
+			if (inode->extent_number[i] == tail) {
+				inode->extent_number[i] = 0;
+			}
+		}
+		inode->extent_number[1] = tail;
+	}
+	return freed;
+}
+
+/**
+ * Helper for the reclaimer
+ * Defragment the files among the next budget inodes, going on from where the
+ * last call stopped; groups without inodes in use are skipped as a whole, and
+ * so are files with open handles, whose blocks readers may still be using.
+ * Returns false once the end of the inode table is reached, so that the next
+ * pass starts over from the first inode
+ */
+bool defrag_some(fs_ctx *fs, unsigned int budget)
+{
+	struct a1fs_superblock *sb = (struct a1fs_superblock *)(fs->image);
+	unsigned char *inode_bitmap = fs->layout.inode_bitmap;
+	for (unsigned int i = 0; i < budget; i++) {
+		a1fs_ino_t ino = fs->defrag_next;
+		if (ino >= sb->inode_count) {
+			fs->defrag_next = 0;
+			return false;
+		}
+		unsigned int group = inode_group(fs, ino);
+		if (fs->groups[group].desc->flags & A1FS_GROUP_INODE_UNINIT) {
+			fs->defrag_next = (group + 1) * fs->group_inodes;
+			continue;
+		}
+		fs->defrag_next++;
+		// read_buf() hands out image offsets that are read after the lock is let go
+		if ((inode_bitmap[ino / 8] & (1 << (ino % 8))) && fs->file_opens[ino] == 0) {
+			defrag_file(fs, ino);
+		}
+	}
+	return true;
+}
+
+/**
+ * Background reclaimer thread
+ * Frees the blocks of orphaned inodes in batches of A1FS_RECLAIM_BATCH,
+ * releasing the lock between batches so that file system operations are
+ * only held up for one batch at a time. With --defrag, once no orphans are
+ * left it goes through the inode table A1FS_DEFRAG_BATCH inodes at a time,
+ * defragmenting files, and starts a new pass every A1FS_DEFRAG_INTERVAL
+ * seconds
+ */
+void *reclaim_main(void *arg)
+{
+	fs_ctx *fs = (fs_ctx *)arg;
+	struct a1fs_superblock *sb = (struct a1fs_superblock *)(fs->image);
+	pthread_mutex_lock(&fs->lock);
+	while (!fs->reclaim_stop) {
+		if (sb->orphan_count > 0) {
+			reclaim_orphan(fs, A1FS_RECLAIM_BATCH);
+		} else if (!fs->opts->defrag) {
+			pthread_cond_wait(&fs->reclaim_wake, &fs->lock);
+			continue;
+		} else if (!defrag_some(fs, A1FS_DEFRAG_BATCH)) {
+			struct timespec until;
+			clock_gettime(CLOCK_REALTIME, &until);
+			until.tv_sec += A1FS_DEFRAG_INTERVAL;
+			pthread_cond_timedwait(&fs->reclaim_wake, &fs->lock, &until);
+			continue;
+		}
+		pthread_mutex_unlock(&fs->lock);
+		sched_yield();
+		pthread_mutex_lock(&fs->lock);
+	}
+	pthread_mutex_unlock(&fs->lock);
+	return NULL;
+}
+
+/**
+ * Helper for create and the batch ioctl
+ * Create an empty regular file with the given name in a directory; the name
+ * doesn't have to be null-terminated and must not exist in the directory yet
+ * Returns the new inode number, or -ENOSPC/-ENOMEM
+ */
+int create_entry(fs_ctx *fs, a1fs_ino_t dir, const char *name, size_t len, mode_t mode)
+{
+	struct a1fs_inode *inode = get_inode(fs, dir);
+
+	/*Allocate the inode; the new file is empty and stored inline*/
+	int new_inode_number = allocate_inode(fs, inode_group(fs, dir));
+	if (new_inode_number < 0){
+		return -ENOSPC;
+	}
+
+	//Set the infomation
+	struct a1fs_dentry new_dentry;
+	memcpy(new_dentry.name, name, len);
+	new_dentry.name[len] = '\0';
+	new_dentry.ino = new_inode_number;
+	make_new_inode(fs, new_inode_number, mode, 0, 0);
+	int ret = update_parent(fs, inode, &new_dentry, dir);
+	if (ret < 0) {
+		free_inode(fs, new_inode_number);
+		return ret;
+	}
+	return new_inode_number;
+}
+
+/**
+ * Helper for unlink and the batch ioctl
+ * Remove the regular file with the given name from a directory and free its
+ * inode and data; hash is the name_hash() of the name
+ * Returns 0 on success, -ENOENT if there is no such entry
+ */
+int unlink_entry(fs_ctx *fs, a1fs_ino_t dir, const char *name, size_t len, uint32_t hash)
+{
+	dir_pos entry;
+	int found = dir_lookup(fs, dir, name, len, hash, &entry);
+	if (found < 0) {
+		return found;
+	}
+
+	// Access the component
+	struct a1fs_superblock *sb = (struct a1fs_superblock *)(fs->image);
+	uint32_t file_inode_number = found;
+
+	/*Clear dentry in parent directory*/
+	remove_dentry(fs, dir, entry);
+
+	/*Leave the blocks of a large file to the reclaimer*/
+	struct a1fs_inode *file_inode = get_inode(fs, file_inode_number);
+	if (fs->reclaimer_running && sb->orphan_count < A1FS_ORPHAN_MAX &&
+	    count_blocks(fs, file_inode) >= A1FS_ORPHAN_MIN_BLOCKS) {
+		file_inode->links = 0;
+		sb->orphans[sb->orphan_count++] = file_inode_number;
+		pthread_cond_signal(&fs->reclaim_wake);
+		return 0;
+	}
+
+	/*Clear bitmap*/
+	free_inode(fs, file_inode_number);
+	if (!(file_inode->mode & A1FS_S_INLINE)) {
+		free_extents(fs, file_inode);
+	}
+
+	/*Reset inode*/
+	struct a1fs_inode killer_inode;
+	killer_inode.links = 0; 
+	killer_inode.size = 0;
+	for (int kill = 0; kill < 24; kill++) {
+		killer_inode.extent_number[kill] = 0;
+	}
+	memcpy(fs->layout.inodes + file_inode_number, &killer_inode, sizeof(struct a1fs_inode));
+	return 0;
+}
+
+
+/**
+ * Helper for readahead_update
+ * Give the kernel advice on the pages that hold a file's data. Fragment tails
+ * don't start on a page boundary, which madvise() rejects, so each range is
+ * rounded out to whole pages
+ */
+void advise_file(fs_ctx *fs, struct a1fs_inode *inode, int advice) {
+	struct fuse_buf segs[24];
+	uintptr_t page = sysconf(_SC_PAGESIZE);
+	size_t n = map_extents(fs, inode, 0, inode->size, segs);
+	for (size_t i = 0; i < n; i++) {
+		uintptr_t start = (uintptr_t)fs->image + segs[i].pos;
+		uintptr_t end = start + segs[i].size;
+		start &= ~(page - 1);
+		end = (end + page - 1) & ~(page - 1);
+		if (madvise((void *)start, end - start, advice) < 0 && fs->opts->verbose) {
+			perror("madvise");
+		}
+	}
+}
+
+/**
+ * Helper for read_buf
+ * Record a read of [offset, offset + size) in the open file's access pattern
+ * and advise the kernel accordingly. A sequential stream gets the next window
+ * of its physical extents prefetched from the image, and the window doubles
+ * (up to A1FS_RA_MAX) for as long as the stream continues. A file that keeps
+ * being read at random gets MADV_RANDOM so that faults on its blocks don't
+ * drag in neighbouring pages.
+ */
+void readahead_update(fs_ctx *fs, a1fs_file *file, struct a1fs_inode *inode, off_t offset, size_t size) {
+	struct fuse_buf segs[24];
+	off_t end = offset + size;
+
+	if (offset != file->next) { // Not sequential: stop streaming
+		file->window = 0;
+		file->ra_end = 0;
+		if (++file->misses >= 2 && !file->random) {
+			advise_file(fs, inode, MADV_RANDOM);
+			file->random = true;
+		}
+		file->next = end;
+		return;
+	}
+
+	file->misses = 0;
+	if (file->random) { // Streaming again
+		advise_file(fs, inode, MADV_NORMAL);
+		file->random = false;
+	}
+
+	// Issue the next window once half of the current one has been consumed
+	if (end + (off_t)file->window / 2 >= file->ra_end) {
+		if (file->window == 0) {
+			file->window = A1FS_RA_MIN;
+		} else if (file->window < A1FS_RA_MAX) {
+			file->window *= 2;
+		}
+		off_t from = end > file->ra_end ? end : file->ra_end;
+		off_t to = end + (off_t)file->window;
+		if (to > (off_t)inode->size) {
+			to = inode->size;
+		}
+		if (from < to) {
+			size_t n = map_extents(fs, inode, from, to - from, segs);
+			for (size_t i = 0; i < n; i++) {
+				posix_fadvise(fs->fd, segs[i].pos, segs[i].size, POSIX_FADV_WILLNEED);
+			}
+		}
+		file->ra_end = end + file->window;
+	}
+	file->next = end;
+}
+
+
+/**=========================================================================A1FS System Call Function Below============================================================================*/
+
+/**
+ * Initialize the file system.
+ *
+ * Called when the file system is mounted. NOTE: we are not using the FUSE
+ * init() callback since it doesn't support returning errors. This function must
+ * be called explicitly before fuse_main().
+ *
+ * @param fs    file system context to initialize.
+ * @param opts  command line options.
+ * @return      true on success; false on failure.
+ */
+static bool a1fs_init(fs_ctx *fs, a1fs_opts *opts)
+{
+	// Nothing to initialize if only printing help or version
+	if (opts->help || opts->version) return true;
+
+	size_t size;
+	int fd;
+	void *image = map_file(opts->img_path, A1FS_BLOCK_SIZE, &size, &fd);
+	if (!image) return false;
+
+	return fs_ctx_init(fs, image, size, fd, opts);
+}
+
+/**
+ * Cleanup the file system.
+ *
+ * Called when the file system is unmounted. Must cleanup all the resources
+ * created in a1fs_init().
+ */
+static void a1fs_destroy(void *ctx)
+{
+	fs_ctx *fs = (fs_ctx*)ctx;
+	if (fs->reclaimer_running) { // Orphans left now are freed after the next mount
+		pthread_mutex_lock(&fs->lock);
+		fs->reclaim_stop = true;
+		pthread_cond_signal(&fs->reclaim_wake);
+		pthread_mutex_unlock(&fs->lock);
+		pthread_join(fs->reclaimer, NULL);
+		fs->reclaimer_running = false;
+	}
+	if (fs->image) {
+		fs_ctx_sync_counts(fs);
+		((struct a1fs_superblock *)fs->image)->clean = 1;
+		if (fs->opts->sync && (msync(fs->image, fs->size, MS_SYNC) < 0)) {
+			perror("msync");
+		}
+		munmap(fs->image, fs->size);
+		close(fs->fd);
+		fs_ctx_destroy(fs);
+	}
+}
+
+/**
+ * Negotiate connection parameters with the kernel.
+ *
+ * Called by FUSE once the connection is set up; a1fs_init() has already run.
+ * Turns on splice so that read_buf() and write_buf() can move pages between
+ * the image file and /dev/fuse without copying them through user space, and
+ * starts the background reclaimer (see reclaim_main()).
+ */
+static void *a1fs_conn_init(struct fuse_conn_info *conn)
+{
+	unsigned int splice = FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE |
+	                      FUSE_CAP_SPLICE_MOVE;
+	conn->want |= conn->capable & splice;
+
+	// Started here rather than in a1fs_init(), which runs before FUSE forks
+	// into the background; orphans left from the last mount are freed first
+	fs_ctx *fs = fuse_get_context()->private_data;
+	fs->reclaim_stop = false;
+	fs->reclaimer_running = pthread_create(&fs->reclaimer, NULL, reclaim_main, fs) == 0;
+	return fs;
+}
+
+/** Get file system context. */
+static fs_ctx *get_fs(void)
+{
+	return (fs_ctx*)fuse_get_context()->private_data;
+}
+
+
+/**
+ * Get file system statistics.
+ *
+ * Implements the statvfs() system call. See "man 2 statvfs" for details.
+ * The f_bfree and f_bavail fields should be set to the same value.
+ * The f_ffree and f_favail fields should be set to the same value.
+ * The f_fsid and f_flag fields are ignored.
+ *
+ * @param path  path to any file in the file system. Can be ignored.
+ * @param st    pointer to the struct statvfs that receives the result.
+ * @return      0 on success; -errno on error.
+ */
+static int a1fs_statfs(const char *path, struct statvfs *st)
+{
+	(void)path;// unused
+	fs_ctx *fs = get_fs();
+
+	memset(st, 0, sizeof(*st));
+	st->f_bsize   = A1FS_BLOCK_SIZE;
+	st->f_frsize  = A1FS_BLOCK_SIZE;
+	
+	struct a1fs_superblock *sb = (struct a1fs_superblock *)(fs->image);
+	if (sb->magic != A1FS_MAGIC){
 		return -1;
 	}
 	// Assign information
+	fs_ctx_sync_counts(fs);
 	st->f_files = sb->inode_count;
-	st->f_blocks = sb->size;
+	st->f_blocks = sb->size / A1FS_BLOCK_SIZE;
 	st->f_bfree = sb->free_data_block_count;
 	st->f_bavail = sb->free_data_block_count;
 	st->f_ffree = sb->free_inodes_count;
@@ -466,34 +1778,63 @@ static int a1fs_statfs(const char *path, struct statvfs *st)
  */
 static int a1fs_getattr(const char *path, struct stat *st)
 {
-	if (strlen(path) >= A1FS_PATH_MAX) return -ENAMETOOLONG;
 	fs_ctx *fs = get_fs();
 
 	memset(st, 0, sizeof(*st));
 
-	// Get a copy of the path
-	char path_cp[strlen(path) + 1];
-	strncpy(path_cp, path, strlen(path));
-	path_cp[strlen(path)] = '\0';
-
-	// Get the number of components
-	int number_of_components = count_components(path_cp);
-
-	// Get a list of components
-	char *components[number_of_components];
-	list_of_components(path_cp, components);
-	
-	// Set up the first inode for searching
-	// struct a1fs_inode *first_inode = (struct a1fs_inode *)(fs->image + A1FS_BLOCK_SIZE * 4);
-	
-	// Check
-	int found = check_new(fs, number_of_components, components);
+	// Find the inode; path and name lengths are checked during the walk
+	int found = path_walk(fs, path, NULL);
 	if (found < 0) { // component not found
 		return found;
-	} else { // component found
-		struct a1fs_inode *good = (struct a1fs_inode *)(fs->image + A1FS_BLOCK_SIZE * 4 + sizeof(a1fs_inode) * found);
-		assign_info(st, good);
-		return 0;
+	}
+	assign_info(st, get_inode(fs, found));
+	return 0;
+}
+
+/**
+ * Open a directory.
+ *
+ * Implements the opendir() system call. Compaction moves entries between
+ * blocks and would make a listing in progress skip or repeat them, so the
+ * directory is not compacted while it has open handles.
+ *
+ * Assumptions (already verified by FUSE using getattr() calls):
+ *   "path" exists and is a directory.
+ *
+ * @param path  path to the directory.
+ * @param fi    receives the directory's inode number in fh.
+ * @return      0 on success; -errno on error.
+ */
+static int a1fs_opendir(const char *path, struct fuse_file_info *fi)
+{
+	fs_ctx *fs = get_fs();
+	int ino = path_walk(fs, path, NULL);
+	if (ino < 0) {
+		return ino;
+	}
+	fs->dir_opens[ino]++;
+	fi->fh = ino;
+	return 0;
+}
+
+/**
+ * Release an open directory.
+ *
+ * Called when the last descriptor of a directory opened with opendir() is
+ * closed. Compaction that was held back while the directory was being listed
+ * (e.g. by "rm -r" removing its entries) runs once the last handle goes away.
+ *
+ * @param path  path to the directory. Unused.
+ * @param fi    directory's inode number in fh.
+ * @return      0.
+ */
+static int a1fs_releasedir(const char *path, struct fuse_file_info *fi)
+{
+	(void)path;// unused
+	fs_ctx *fs = get_fs();
+	a1fs_ino_t ino = fi->fh;
+	if (fs->dir_opens[ino] > 0 && --fs->dir_opens[ino] == 0) {
+		compact_dir(fs, ino, UINT_MAX);
 	}
 	return 0;
 }
@@ -504,63 +1845,73 @@ static int a1fs_getattr(const char *path, struct stat *st)
  * Implements the readdir() system call. Should call filler() for each directory
  * entry. See fuse.h in libfuse source code for details.
  *
+ * Entries are returned in on-disk order. The offset of an entry is one past
+ * its byte position in the directory (extents in order, then the position of
+ * the entry in its block), i.e. the position at which the next call resumes.
+ * Entries never move within a block while the directory is open.
+ * When filler() reports that the buffer is full, the listing stops and FUSE
+ * calls again with the offset of the last entry it accepted, so huge
+ * directories are never buffered as a whole. The attributes of each entry are
+ * filled in from its inode in the same pass.
+ *
  * Assumptions (already verified by FUSE using getattr() calls):
  *   "path" exists and is a directory.
  *
- * Errors:
- *   ENOMEM  not enough memory (e.g. a filler() call failed).
- *
  * @param path    path to the directory.
  * @param buf     buffer that receives the result.
  * @param filler  function that needs to be called for each directory entry.
- *                Pass 0 as offset (4th argument). 3rd argument can be NULL.
- * @param offset  unused.
+ * @param offset  offset of the first entry to return; 0 for the beginning.
  * @param fi      unused.
  * @return        0 on success; -errno on error.
  */
 static int a1fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
                         off_t offset, struct fuse_file_info *fi)
 {
-	(void)offset;// unused
 	(void)fi;// unused
 	
 	fs_ctx *fs = get_fs();
 
-	// Get a copy of path
-	char path_cp[strlen(path) + 1];
-	strncpy(path_cp, path, strlen(path));
-	path_cp[strlen(path)] = '\0';
-
-	// Get the number of components
-	int number_of_components = count_components(path_cp);
-	
-
-	// Get a list of components
-	char *components[number_of_components];
-	list_of_components(path_cp, components);
-
 	// Access the component
-	struct a1fs_extent *extent_block = (struct a1fs_extent *)(fs->image + A1FS_BLOCK_SIZE * 3);
-	struct a1fs_inode *first_inode = (struct a1fs_inode *)(fs->image + A1FS_BLOCK_SIZE * 4);
-	struct a1fs_inode *cur_inode = first_inode;
-	
-	// Iterate components
-	int found = check_new(fs, number_of_components, components);
+	struct a1fs_superblock *sb = (struct a1fs_superblock *)(fs->image);
+	struct a1fs_extent *extent_block = fs->layout.extents;
+
+	int found = path_walk(fs, path, NULL);
 	if (found < 0) { // component not found
 		return found;
 	}
-	cur_inode = (struct a1fs_inode *)(fs->image + A1FS_BLOCK_SIZE * 4 + found * sizeof(struct a1fs_inode));
+	struct a1fs_inode *cur_inode = get_inode(fs, found);
+
+	// A listing from the start (re)fills the lookup cache for this directory
+	if (offset == 0) {
+		dcache_reset(&fs->dcache, found);
+	}
+
+	off_t pos = 0; // Directory position of the current block
 	for (int i = 0; i < 24; i++) {
 		if (cur_inode->extent_number[i] > 0) { // current extent makes sense
 			uint32_t valid_extent_start= extent_block[cur_inode->extent_number[i] - 1].start;
 			uint32_t valid_extent_count = extent_block[cur_inode->extent_number[i] - 1].count;
-			for (unsigned int j = 0; j < valid_extent_count; j++) {
-				struct a1fs_dentry *cur_dentry = (struct a1fs_dentry *)(fs->image + A1FS_BLOCK_SIZE * (valid_extent_start + j));
-				for (unsigned int k = 0; k < A1FS_BLOCK_SIZE / sizeof(struct a1fs_dentry); k++) {
-					if (strcmp(cur_dentry[k].name, "") != 0) { // current dentry is meaningful
-						if (filler(buf, cur_dentry[k].name, NULL, 0) != 0) {
-							return -ENOMEM;
-						}
+			for (unsigned int j = 0; j < valid_extent_count; j++, pos += A1FS_BLOCK_SIZE) {
+				if (pos + A1FS_BLOCK_SIZE <= offset) { // whole block already returned
+					continue;
+				}
+				void *block = block_ptr(fs, valid_extent_start + j);
+				uint32_t cursor = 0;
+				dirblk_ent ent;
+				while (dirblk_next(block, sb->inode_count, &cursor, &ent)) {
+					off_t next = pos + ent.off + 1;
+					if (next <= offset) { // already returned
+						continue;
+					}
+					struct stat st;
+					memset(&st, 0, sizeof(st));
+					assign_info(&st, get_inode(fs, ent.ino));
+					if (filler(buf, ent.name, &st, next) != 0) { // buffer is full
+						return 0;
+					}
+					if (fs->dcache.dir == (a1fs_ino_t)found) {
+						dir_pos at = { valid_extent_start + j, ent.off };
+						dcache_add(&fs->dcache, at, ent.name, ent.len);
 					}
 				}
 			}	
@@ -596,84 +1947,56 @@ static int a1fs_mkdir(const char *path, mode_t mode)
 {
 	fs_ctx *fs = get_fs();
 
-	/*Get a copy of path*/
-	char path_cp[strlen(path) + 1];
-	strncpy(path_cp, path, strlen(path));
-	path_cp[strlen(path)] = '\0';
-
-	// Get the number of components
-	int number_of_components = count_components(path_cp);
-
-	// Get a list of components
-	char *components[number_of_components];
-	list_of_components(path_cp, components);
-
-	// Access the component
-	struct a1fs_superblock *sb = (struct a1fs_superblock *)(fs->image);
-	struct a1fs_extent *extent_block = (struct a1fs_extent *)(fs->image + A1FS_BLOCK_SIZE * 3);
-	struct a1fs_inode *first_inode = (struct a1fs_inode *)(fs->image + A1FS_BLOCK_SIZE * 4);
-	struct a1fs_inode *cur_inode = first_inode;
-	struct a1fs_dentry *subdirectories = (struct a1fs_dentry *)(fs->image + A1FS_BLOCK_SIZE * (4 + (sb->inode_blocks)));
-	uint32_t valid_extent_start = extent_block[cur_inode->extent_number[0] - 1].start;
-	uint32_t parent_inode_number = 0;
-	
-	for (int i = 0; i < number_of_components; i++) { // Iterate through all components
-		if (i == number_of_components - 1){
-			/*Find the name of the last component(new dir)*/
-			char name[A1FS_NAME_MAX];
-			name[0] = '\0';
-			strncat(name, components[number_of_components - 1], strlen (components[number_of_components - 1]));
-			
-			/*Make new dictionary entry in parent*/
-			struct a1fs_dentry new_dentry;
-			new_dentry.name[0] = '\0';
-			strcat(new_dentry.name, name);
-			int new_inode_number = allocate_inode(fs);
-			if (new_inode_number < 0) {
-				return -ENOSPC;
-			}
-			int new_block_number = allocate_block(fs);
-			if (new_block_number < 0) {
-				return -ENOSPC;
-			}
-			int new_extent_number = allocate_extent(fs);
-			if (new_extent_number < 0) {
-				return -ENOSPC;
-			}
+	// Find the parent directory and the name of the new one
+	path_iter last;
+	int parent_inode_number = path_walk(fs, path, &last);
+	if (parent_inode_number < 0) {
+		return parent_inode_number;
+	}
+	struct a1fs_inode *parent_inode = get_inode(fs, parent_inode_number);
 
-			/*check if the inode is allocated*/
-			new_dentry.ino = new_inode_number;
-			make_new_inode(fs, new_inode_number, mode, new_extent_number, 1);
-			make_new_extent(fs, new_extent_number, new_block_number);
-			make_new_dir_block(fs, new_block_number, new_inode_number);
-			update_parent(fs, cur_inode, &new_dentry, parent_inode_number);
-			return 0;
-		}
+	/*Make new dictionary entry in parent*/
+	struct a1fs_dentry new_dentry;
+	memcpy(new_dentry.name, last.name, last.len);
+	new_dentry.name[last.len] = '\0';
+	int new_inode_number = allocate_inode(fs, find_group_dir(fs, parent_inode_number));
+	if (new_inode_number < 0) {
+		return -ENOSPC;
+	}
+	int ret = -ENOSPC;
+	int64_t new_block_number = allocate_block(fs, inode_group(fs, new_inode_number));
+	if (new_block_number < 0) {
+		goto free_ino;
+	}
+	int new_extent_number = allocate_extent(fs);
+	if (new_extent_number < 0) {
+		goto free_blk;
+	}
 
-		for (int j = 0; j < 24; j++) { // Iterate through 24 extent numbers in the inode
-			if (cur_inode->extent_number[j] > 0) { // Valid extent number
-				// Valid extent number ==> valid extent
-				valid_extent_start = extent_block[cur_inode->extent_number[j] - 1].start;
-				// Valid extent's start ==> valid resered data block
-				subdirectories = (struct a1fs_dentry *)(fs->image + A1FS_BLOCK_SIZE * valid_extent_start);
-				int found = 0;
-				for (unsigned int k = 0; k < A1FS_BLOCK_SIZE / sizeof(struct a1fs_dentry); k++) { // Iterate through 16 dentries
-					if (subdirectories[k].ino < sb->inode_count && strcmp(subdirectories[k].name, components[i]) == 0) { // Component found
-						found = 1;
-						if (i < number_of_components - 1 ) { // pass the inode to the next component
-							parent_inode_number = subdirectories[k].ino;
-							cur_inode = (struct a1fs_inode *)(fs->image + A1FS_BLOCK_SIZE * 4 + subdirectories[k].ino * sizeof(struct a1fs_inode));
-						}
-						break;
-					}
-				}
-				if (found) { // component found
-					break;
-				}
-			}
-		}
+	/*check if the inode is allocated*/
+	new_dentry.ino = new_inode_number;
+	make_new_inode(fs, new_inode_number, mode, new_extent_number, 1);
+	make_new_extent(fs, new_extent_number, new_block_number);
+	make_new_dir_block(fs, new_block_number, new_inode_number, parent_inode_number);
+	ret = update_parent(fs, parent_inode, &new_dentry, parent_inode_number);
+	if (ret < 0) {
+		goto free_ext;
 	}
+	// Only counted in its group once it is linked in
+	add_group_dir(fs, new_inode_number);
 	return 0;
+
+	// Undo the allocations in reverse order
+free_ext:
+	fs->layout.extents[new_extent_number - 1].start = 0;
+	fs->layout.extents[new_extent_number - 1].count = 0;
+	((struct a1fs_superblock *)(fs->image))->reserved_extent_number--;
+free_blk:
+	release_blocks(fs, new_block_number, 1);
+free_ino:
+	get_inode(fs, new_inode_number)->mode = 0; // Not a directory of its group, see free_inode()
+	free_inode(fs, new_inode_number);
+	return ret;
 }
 
 /**
@@ -694,84 +2017,66 @@ static int a1fs_rmdir(const char *path)
 {
 	fs_ctx *fs = get_fs();
 
-	/*Get a copy of path*/
-	char path_cp[strlen(path) + 1];
-	strncpy(path_cp, path, strlen(path));
-	path_cp[strlen(path)] = '\0';
-
-	// Get the number of components
-	int number_of_components = count_components(path_cp);
-
-	// Get a list of components
-	char *components[number_of_components];
-	list_of_components(path_cp, components);
+	// Find the directory's entry in its parent
+	path_iter last;
+	int parent = path_walk(fs, path, &last);
+	if (parent < 0) {
+		return parent;
+	}
+	dir_pos entry;
+	int found = dir_lookup(fs, parent, last.name, last.len, last.hash, &entry);
+	if (found < 0) {
+		return found;
+	}
 
 	// Access the component
 	struct a1fs_superblock *sb = (struct a1fs_superblock *)(fs->image);
-	struct a1fs_extent *extent_block = (struct a1fs_extent *)(fs->image + A1FS_BLOCK_SIZE * 3);
-	struct a1fs_inode *first_inode = (struct a1fs_inode *)(fs->image + A1FS_BLOCK_SIZE * 4);
-	struct a1fs_inode *cur_inode = first_inode;
-	uint32_t inode_number;
-	unsigned int offset;
-	uint32_t block_number;
-	unsigned char *block_bitmap = fs->image  + A1FS_BLOCK_SIZE * 2;
-
-	/*touch the last inode*/
-	for (int i = 0; i < number_of_components; i++) { // Iterate through all components
-		for (int j = 0; j < 24; j++) { // Iterate through 24 extent numbers in the inode
-			if (cur_inode->extent_number[j] > 0) { // Valid extent number
-				// Valid extent number ==> valid extent
-				uint32_t valid_extent_start = extent_block[cur_inode->extent_number[j] - 1].start;
-				// Valid extent's start ==> valid resered data block
-				struct a1fs_dentry *subdirectories = (struct a1fs_dentry *)(fs->image + A1FS_BLOCK_SIZE * valid_extent_start);
-				for (unsigned int k = 2; k < A1FS_BLOCK_SIZE / sizeof(struct a1fs_dentry); k++) { // Iterate through 16 dentries
-					if (subdirectories[k].ino < sb->inode_count && strcmp(subdirectories[k].name, components[i]) == 0) { // Component found
-						block_number = valid_extent_start;
-						offset = k;
-						inode_number = subdirectories[k].ino;
-						cur_inode = (struct a1fs_inode *)(fs->image + A1FS_BLOCK_SIZE * 4 + subdirectories[k].ino * sizeof(struct a1fs_inode));
-						j = 24;
-						break;
-					}	
-				}
-			}
-		}
-	}
+	struct a1fs_extent *extent_block = fs->layout.extents;
+	uint32_t inode_number = found;
+	struct a1fs_inode *cur_inode = get_inode(fs, inode_number);
 
-	/*check if there's nothing left*/
+	/*check if there's nothing left but "." and ".."*/
 	for (int ii = 0; ii < 24; ii++) {
 		if (cur_inode->extent_number[ii] > 0) {
 			uint32_t valid_extent_start= extent_block[cur_inode->extent_number[ii] - 1].start;
 			uint32_t valid_extent_count = extent_block[cur_inode->extent_number[ii] - 1].count;
 			for (unsigned int jj = 0; jj < valid_extent_count; jj++) {
-				struct a1fs_dentry *cur_dentry = (struct a1fs_dentry *)(fs->image + A1FS_BLOCK_SIZE * (valid_extent_start + jj));
-				for (unsigned int kk = 2; kk < A1FS_BLOCK_SIZE / sizeof(struct a1fs_dentry); kk++) {
-					if (strcmp(cur_dentry[kk].name, "") != 0){
+				uint32_t cursor = 0;
+				dirblk_ent ent;
+				while (dirblk_next(block_ptr(fs, valid_extent_start + jj), sb->inode_count, &cursor, &ent)) {
+					if (strcmp(ent.name, ".") != 0 && strcmp(ent.name, "..") != 0) {
 						return -ENOTEMPTY;
 					}
 				}
-				//Reset data block
-				memset(fs->image + (valid_extent_start + jj) * A1FS_BLOCK_SIZE, 0, A1FS_BLOCK_SIZE);
-				reset_bitmap(block_bitmap, valid_extent_start + jj);
 			}
+		}
+	}
+	for (int ii = 0; ii < 24; ii++) {
+		if (cur_inode->extent_number[ii] > 0) {
+			uint32_t valid_extent_start= extent_block[cur_inode->extent_number[ii] - 1].start;
+			uint32_t valid_extent_count = extent_block[cur_inode->extent_number[ii] - 1].count;
+			//Reset data blocks
+			release_blocks(fs, valid_extent_start, valid_extent_count);
 			// Reset extent
 			struct a1fs_extent killer_extent;
 			killer_extent.start = 0; 
 			killer_extent.count = 0; 
-			memcpy(fs->image + 3 * A1FS_BLOCK_SIZE + (cur_inode->extent_number[ii] - 1) * sizeof(struct a1fs_extent), &killer_extent, sizeof(struct a1fs_extent));
+			memcpy(fs->layout.extents + (cur_inode->extent_number[ii] - 1), &killer_extent, sizeof(struct a1fs_extent));
 			sb->reserved_extent_number--;
 		}
 			
 	}
 	/*Clear dentry in parent directory*/
-	struct a1fs_dentry killer;
-	killer.ino = sb->inode_count + 1; 
-	killer.name[0] = '\0';
-	memcpy(fs->image + A1FS_BLOCK_SIZE * block_number + offset * sizeof(a1fs_dentry), &killer, sizeof(a1fs_dentry));
+	remove_dentry(fs, parent, entry);
 
 	/*Clear bitmap*/
-	unsigned char *inode_bitmap = fs->image + A1FS_BLOCK_SIZE;
-	reset_bitmap(inode_bitmap, inode_number);
+	free_inode(fs, inode_number);
+
+	/*Its blocks are free now; forget where its entries and holes were*/
+	if (fs->dcache.dir == inode_number) {
+		dcache_invalidate(&fs->dcache);
+	}
+	fs_ctx_drop_dir_slots(fs, inode_number);
 
 	/*Reset inode*/
 	struct a1fs_inode killer_inode;
@@ -780,200 +2085,125 @@ static int a1fs_rmdir(const char *path)
 	for (int kill = 0; kill < 24; kill++){
 		killer_inode.extent_number[kill] = 0;
 	}
-	memcpy(fs->image + A1FS_BLOCK_SIZE * 4 + inode_number * sizeof(struct a1fs_inode), &killer_inode, sizeof(struct a1fs_inode));
+	memcpy(fs->layout.inodes + inode_number, &killer_inode, sizeof(struct a1fs_inode));
 	return 0;
 }
 
 /**
- * Create a file.
+ * Open a file.
  *
- * Implements the open()/creat() system call.
+ * Implements the open() system call. Allocates the open file state that
+ * tracks the access pattern for readahead and writes; see a1fs_file.
  *
  * Assumptions (already verified by FUSE using getattr() calls):
- *   "path" doesn't exist.
- *   The parent directory of "path" exists and is a directory.
- *   "path" and its components are not too long.
+ *   "path" exists and is a file.
  *
  * Errors:
  *   ENOMEM  not enough memory (e.g. a malloc() call failed).
- *   ENOSPC  not enough free space in the file system.
  *
- * @param path  path to the file to create.
- * @param mode  file mode bits.
- * @param fi    unused.
+ * @param path  path to the file to open.
+ * @param fi    receives the open file state in fh.
  * @return      0 on success; -errno on error.
  */
-static int a1fs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+static int a1fs_open(const char *path, struct fuse_file_info *fi)
 {
-	(void)fi;// unused
-	assert(S_ISREG(mode));
-	fs_ctx *fs = get_fs();
-
-	/*Get a copy of path*/
-	char path_cp[strlen(path) + 1];
-	strncpy(path_cp, path, strlen(path));
-	path_cp[strlen(path)] = '\0';
-
-	// Get the number of components
-	int number_of_components = count_components(path_cp);
-
-	// Get a list of components
-	char *components[number_of_components];
-	list_of_components(path_cp, components);
-
-
-	uint32_t target_dir_inode = check_new(fs, number_of_components - 1, components);
-	struct a1fs_inode *inode = (struct a1fs_inode *)(fs->image + 4 * A1FS_BLOCK_SIZE + target_dir_inode * sizeof(struct a1fs_inode));
-
-	/*Allocate space for the new file*/
-	int new_block_number = allocate_block(fs);
-	if (new_block_number < 0){
-		return -ENOSPC;
-	}
-	int new_inode_number = allocate_inode(fs);
-	if (new_inode_number < 0){
-		return -ENOSPC;
+	int ino = path_walk(get_fs(), path, NULL);
+	if (ino < 0) {
+		return ino;
 	}
-	int new_extent_number = allocate_extent(fs);
-	if (new_extent_number < 0){
-		return -ENOSPC;
+	a1fs_file *file = calloc(1, sizeof(a1fs_file));
+	if (!file) {
+		return -ENOMEM;
 	}
+	file->ino = ino;
+	fi->fh = (uintptr_t)file;
+	get_fs()->file_opens[ino]++;
+	return 0;
+}
 
-	//Set the infomation
-	struct a1fs_dentry new_dentry;
-	new_dentry.name[0] = '\0';
-	strncat(new_dentry.name, components[number_of_components - 1], strlen(components[number_of_components - 1]));
-	new_dentry.ino = new_inode_number;
-	make_new_inode(fs, new_inode_number, mode, new_extent_number, 0);
-	make_new_extent(fs, new_extent_number, new_block_number);
-	update_parent(fs, inode, &new_dentry, target_dir_inode);
+/**
+ * Release an open file.
+ *
+ * Called when the last descriptor of a file opened with open() or create() is
+ * closed. If the file has been written to, packs its tail into fragments
+ * (see pack_tail()). Frees the open file state.
+ *
+ * @param path  path to the file. Unused.
+ * @param fi    open file state in fh.
+ * @return      0.
+ */
+static int a1fs_release(const char *path, struct fuse_file_info *fi)
+{
+	(void)path;// unused
+	a1fs_file *file = (a1fs_file *)(uintptr_t)fi->fh;
+	struct a1fs_inode *inode = get_inode(get_fs(), file->ino);
+	if (file->written && inode->links > 0) { // Not removed in the meantime
+		pack_tail(get_fs(), inode);
+	}
+	get_fs()->file_opens[file->ino]--;
+	free(file);
 	return 0;
 }
 
 /**
- * Remove a file.
+ * Create a file.
  *
- * Implements the unlink() system call.
+ * Implements the open()/creat() system call.
  *
  * Assumptions (already verified by FUSE using getattr() calls):
- *   "path" exists and is a file.
+ *   "path" doesn't exist.
+ *   The parent directory of "path" exists and is a directory.
+ *   "path" and its components are not too long.
  *
- * @param path  path to the file to remove.
+ * Errors:
+ *   ENOMEM  not enough memory (e.g. a malloc() call failed).
+ *   ENOSPC  not enough free space in the file system.
+ *
+ * @param path  path to the file to create.
+ * @param mode  file mode bits.
+ * @param fi    receives the open file state, as in open().
  * @return      0 on success; -errno on error.
  */
-static int a1fs_unlink(const char *path)
+static int a1fs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
 {
-	fs_ctx *fs = get_fs();
-
-	/*Get a copy of path*/
-	char path_cp[strlen(path) + 1];
-	strncpy(path_cp, path, strlen(path));
-	path_cp[strlen(path)] = '\0';
-
-	// Get the number of components
-	int number_of_components = count_components(path_cp);
-
-	// Get a list of components
-	char *components[number_of_components];
-	list_of_components(path_cp, components);
-
-	// Access the component
-	struct a1fs_superblock *sb = (struct a1fs_superblock *)(fs->image);
-	struct a1fs_extent *extent_block = (struct a1fs_extent *)(fs->image + A1FS_BLOCK_SIZE * 3);
-	struct a1fs_inode *first_inode = (struct a1fs_inode *)(fs->image + A1FS_BLOCK_SIZE * 4);
-	struct a1fs_inode *cur_inode = first_inode;
-	unsigned int offset;
-	uint32_t block_number;
-
-	/*touch the last inode*/
-	for (int i = 0; i < number_of_components - 1; i++) { // Iterate through all components
-		for (int j = 0; j < 24; j++) { // Iterate through 24 extent numbers in the inode
-			if (cur_inode->extent_number[j] > 0) { // Valid extent number
-				// Valid extent number ==> valid extent
-				uint32_t valid_extent_start = extent_block[cur_inode->extent_number[j] - 1].start;
-				// Valid extent's start ==> valid resered data block
-				struct a1fs_dentry *subdirectories = (struct a1fs_dentry *)(fs->image + A1FS_BLOCK_SIZE * valid_extent_start);
-				for (unsigned int k = 2; k < A1FS_BLOCK_SIZE / sizeof(struct a1fs_dentry); k++) { // Iterate through 16 dentries
-					if (subdirectories[k].ino < sb->inode_count && strcmp(subdirectories[k].name, components[i]) == 0) { // Component found
-						block_number = valid_extent_start;
-						offset = k;
-						cur_inode = (struct a1fs_inode *)(fs->image + A1FS_BLOCK_SIZE * 4 + subdirectories[k].ino * sizeof(struct a1fs_inode));
-						j = 24;
-						break;
-					}
-				}
-			}
-		}
-	}
-
-	int found = 0;
-	uint32_t file_inode_number;
-	
-	/*check the file's inode*/
-	for (int ii = 0; ii < 24; ii++) {
-		if (cur_inode->extent_number[ii] > 0) {
-			uint32_t valid_extent_start = extent_block[cur_inode->extent_number[ii] - 1].start;
-			uint32_t valid_extent_count = extent_block[cur_inode->extent_number[ii] - 1].count;
-			for (unsigned int jj = 0; jj < valid_extent_count; jj++) {
-				struct a1fs_dentry *cur_dentry = (struct a1fs_dentry *)(fs->image + A1FS_BLOCK_SIZE * (valid_extent_start + jj));
-				for (unsigned int kk = 2; kk < A1FS_BLOCK_SIZE / sizeof(struct a1fs_dentry); kk++) {
-					if (strcmp(cur_dentry[kk].name, components[number_of_components - 1]) == 0) { // component found
-						file_inode_number = cur_dentry[kk].ino;
-						offset = kk;
-						block_number = valid_extent_start;
-						found = 1;
-						break;
-						}
-					}
-				if (found) { // component found
-					break;
-				}
-			}
-		}
-		if (found) { // coponent found
-			break;
-		}
-	}
-	
-	/*Clear dentry in parent directory*/
-	struct a1fs_dentry killer;
-	killer.ino = sb->inode_count + 1; 
-	killer.name[0] = '\0';
-	memcpy(fs->image + A1FS_BLOCK_SIZE * block_number + offset * sizeof(a1fs_dentry), &killer, sizeof(a1fs_dentry));
+	assert(S_ISREG(mode));
+	fs_ctx *fs = get_fs();
 
-	/*Clear bitmap*/
-	unsigned char *inode_bitmap = fs->image + A1FS_BLOCK_SIZE;
-	reset_bitmap(inode_bitmap, file_inode_number);
-	unsigned char *block_bitmap = fs->image  + A1FS_BLOCK_SIZE * 2;
-	struct a1fs_inode *file_inode = (struct a1fs_inode *)(fs->image + A1FS_BLOCK_SIZE * 4 + sizeof(struct a1fs_inode) * file_inode_number);
-	for (int index = 0; index < 24; index++) {
-		if (file_inode->extent_number[index] > 0){//valid extent
-			uint32_t extent_start = extent_block[file_inode->extent_number[index] - 1].start;
-			uint32_t extent_count = extent_block[file_inode->extent_number[index] - 1].count;
-			if (extent_start > 0){
-				for (unsigned int count = 0; count < extent_count; count++) {
-					reset_bitmap(block_bitmap, extent_start + count);
-					memset(fs->image + (extent_start + count) * A1FS_BLOCK_SIZE, 0, A1FS_BLOCK_SIZE);
-				}
-			}
-			struct a1fs_extent killer_extent;
-			killer_extent.start = 0;
-			killer_extent.count = 0;
-			memcpy(fs->image + 3 * A1FS_BLOCK_SIZE + sizeof(struct a1fs_extent) * (file_inode->extent_number[index] - 1), &killer_extent, sizeof(struct a1fs_extent));
-		}
-		
+	// Find the parent directory and the name of the new file
+	path_iter last;
+	int target_dir_inode = path_walk(fs, path, &last);
+	if (target_dir_inode < 0) {
+		return target_dir_inode;
+	}
+	int ret = create_entry(fs, target_dir_inode, last.name, last.len, mode);
+	if (ret < 0) {
+		return ret;
 	}
+	return a1fs_open(path, fi);
+}
 
-	/*Reset inode*/
-	struct a1fs_inode killer_inode;
-	killer_inode.links = 0; 
-	killer_inode.size = 0;
-	for (int kill = 0; kill < 24; kill++) {
-		killer_inode.extent_number[kill] = 0;
+/**
+ * Remove a file.
+ *
+ * Implements the unlink() system call.
+ *
+ * Assumptions (already verified by FUSE using getattr() calls):
+ *   "path" exists and is a file.
+ *
+ * @param path  path to the file to remove.
+ * @return      0 on success; -errno on error.
+ */
+static int a1fs_unlink(const char *path)
+{
+	fs_ctx *fs = get_fs();
+
+	// Find the file's entry in its parent
+	path_iter last;
+	int parent = path_walk(fs, path, &last);
+	if (parent < 0) {
+		return parent;
 	}
-	memcpy(fs->image + A1FS_BLOCK_SIZE * 4 + file_inode_number * sizeof(struct a1fs_inode), &killer_inode, sizeof(struct a1fs_inode));
-	return 0;
-	
+	return unlink_entry(fs, parent, last.name, last.len, last.hash);
 }
 
 /**
@@ -997,123 +2227,52 @@ static int a1fs_rename(const char *from, const char *to)
 {
 	fs_ctx *fs = get_fs();
 
-	//Get a copy of path
-	char from_cp[strlen(from) + 1];
-	strncpy(from_cp, from, strlen(from));
-	from_cp[strlen(from)] = '\0';
-	char to_cp[strlen(to) + 1];
-	strncpy(to_cp, to, strlen(to));
-	to_cp[strlen(to)] = '\0';
-
-	// Get the number of components
-	int num_comp_from = count_components(from_cp);
-	int num_comp_to = count_components(to_cp);
-
-	// Get a list of components
-	char *from_components[num_comp_from];
-	char *to_components[num_comp_to];
-	list_of_components(from_cp, from_components);
-	list_of_components(to_cp, to_components);
+	// Find both parent directories and final components
+	path_iter from_last, to_last;
+	int from_parent = path_walk(fs, from, &from_last);
+	if (from_parent < 0) {
+		return from_parent;
+	}
+	int to_parent = path_walk(fs, to, &to_last);
+	if (to_parent < 0) {
+		return to_parent;
+	}
 
-	struct a1fs_superblock *sb = (struct a1fs_superblock *)(fs->image);
-	struct a1fs_extent *extent_block = (struct a1fs_extent *)(fs->image + A1FS_BLOCK_SIZE * 3);
-	// Get the inode number for the last component in "from"
-	// int from_ino = check_new(fs, num_comp_from, from_components);
-	// Get the inode number for the last component in "to"
-	int to_ino = check_new(fs, num_comp_to, to_components);
-	// Get the inode for "from"
-	// struct a1fs_inode *from_inode = (struct a1fs_inode *)(fs->image + A1FS_BLOCK_SIZE * 4 + from_ino * sizeof(struct a1fs_inode));
-	
-	//Get "from"'s parent inode
-	struct a1fs_inode *from_parent_inode;
-	if (num_comp_from - 1 > 0) { // parent is not root
-		int from_parent_inode_num = check_new(fs, num_comp_from - 1, from_components);
-		from_parent_inode = (struct a1fs_inode *)(fs->image + A1FS_BLOCK_SIZE * 4 + from_parent_inode_num * sizeof(struct a1fs_inode));
-	} else if (num_comp_from - 1 == 0) { // parent is root
-		from_parent_inode = (struct a1fs_inode *)(fs->image + A1FS_BLOCK_SIZE * 4);
-	}
-
-	// Get "to"'s parent inode
-	char to_parent_name[A1FS_NAME_MAX];
-	struct a1fs_inode *to_parent_inode;
-	if (num_comp_to - 1 > 0) { // parent is not root
-		strcpy(to_parent_name, to_components[num_comp_to - 2]);
-		to_parent_name[strlen(to_components[num_comp_to - 2])] = '\0';
-		int to_parent_inode_num = check_new(fs, num_comp_to - 1, to_components);
-		to_parent_inode = (struct a1fs_inode *)(fs->image + A1FS_BLOCK_SIZE * 4 + to_parent_inode_num * sizeof(struct a1fs_inode));
-	} else if (num_comp_to - 1 == 0) { // parent is root
-		to_parent_name[0] = '/';
-		to_parent_name[1] = '\0';
-		to_parent_inode = (struct a1fs_inode *)(fs->image + A1FS_BLOCK_SIZE * 4);
+	dir_pos from_entry;
+	int from_ino = dir_lookup(fs, from_parent, from_last.name, from_last.len, from_last.hash, &from_entry);
+	if (from_ino < 0) {
+		return from_ino;
 	}
+	// Get the entry for the last component in "to", if it exists
+	int to_ino = dir_lookup(fs, to_parent, to_last.name, to_last.len, to_last.hash, NULL);
 
 	struct a1fs_dentry transfer_dentry;
-	struct a1fs_dentry killer;
-	// Delete the dentry in "from"'s parent inode
-	for (int j = 0; j < 24; j++) { // Iterate through 24 extent numbers in the inode
-		if (from_parent_inode->extent_number[j] > 0) { // Valid extent number
-			// Valid extent number ==> valid extent
-			uint32_t valid_extent_start = extent_block[from_parent_inode->extent_number[j] - 1].start;
-			// Valid extent's start ==> valid resered data block
-			
-			struct a1fs_dentry *subdirectories = (struct a1fs_dentry *)(fs->image + A1FS_BLOCK_SIZE * valid_extent_start);
-			for (unsigned int k = 0; k < A1FS_BLOCK_SIZE / sizeof(struct a1fs_dentry); k++) { // Iterate through 16 dentries
-				if (subdirectories[k].ino < sb->inode_count && strcmp(subdirectories[k].name, from_components[num_comp_from - 1]) == 0) { // Component found
-					/*copy the target's dentry*/
-					transfer_dentry.ino = subdirectories[k].ino;
-					transfer_dentry.name[0] = '\0';
-					strcat(transfer_dentry.name, subdirectories[k].name);
-					/*reset the dentry on the previous position*/
-					killer.name[0] = '\0';
-					killer.ino = sb->inode_count + 1;
-					memcpy(fs->image + A1FS_BLOCK_SIZE * valid_extent_start + sizeof(struct a1fs_dentry) * k, &killer, sizeof(a1fs_dentry));
-				}
-			}	
-		}
-	}
-	
-	if (to_ino < (int)sb->inode_count && to_ino >= 0) { // If "to" exists
-		struct a1fs_inode *to_inode = (struct a1fs_inode *)(fs->image + A1FS_BLOCK_SIZE * 4 + to_ino * sizeof(struct a1fs_inode));
-		if ((to_inode->mode & S_IFDIR) != S_IFDIR) { // If "to" is not directory
+	transfer_dentry.ino = from_ino;
+	if (to_ino >= 0) { // If "to" exists, move "from" into it under its own name
+		if (!S_ISDIR(get_inode(fs, to_ino)->mode)) { // If "to" is not directory
 			return -ENOSPC;
 		}
-		// Find "to"'s dentry
-		for (int j = 0; j < 24; j++) { // Iterate through 24 extent numbers in the inode
-			if (to_inode->extent_number[j] > 0) { // Valid extent number
-			// Valid extent number ==> valid extent
-			uint32_t valid_extent_start = extent_block[to_inode->extent_number[j] - 1].start;
-			// Valid extent's start ==> valid resered data block
-			struct a1fs_dentry *subdirectories = (struct a1fs_dentry *)(fs->image + A1FS_BLOCK_SIZE * valid_extent_start);
-				for (unsigned int k = 0; k < A1FS_BLOCK_SIZE / sizeof(struct a1fs_dentry); k++) { // Iterate through 16 dentries
-					if (subdirectories[k].ino > sb->inode_count && strcmp(subdirectories[k].name, "") == 0) { // Component found
-						// Found "to"'s parent dentry
-						memcpy(fs->image + A1FS_BLOCK_SIZE * valid_extent_start + sizeof(struct a1fs_dentry) * k, &transfer_dentry, sizeof(struct a1fs_dentry));
-						return 0;
-					}
-				}	
-			}
-		}
-	} else if (to_ino < 0) { // If "to" does not exist
-		// Find "to"'s parent dentry
-		for (int j = 0; j < 24; j++) { // Iterate through 24 extent numbers in the inode
-			if (to_parent_inode->extent_number[j] <= sb->reserved_extent_number && to_parent_inode->extent_number[j] > 0) { // Valid extent number
-			// Valid extent number ==> valid extent
-			uint32_t valid_extent_start = extent_block[to_parent_inode->extent_number[j] - 1].start;
-			// Valid extent's start ==> valid resered data block
-			struct a1fs_dentry *subdirectories = (struct a1fs_dentry *)(fs->image + A1FS_BLOCK_SIZE * valid_extent_start);
-				for (unsigned int k = 0; k < A1FS_BLOCK_SIZE / sizeof(struct a1fs_dentry); k++) { // Iterate through 16 dentries
-					if (subdirectories[k].ino > sb->inode_count && strcmp(subdirectories[k].name, "") == 0) { // Component found
-						// Found "to"'s parent dentry
-						a1fs_dentry new_transfer_dentry;
-						new_transfer_dentry.ino = transfer_dentry.ino;
-						new_transfer_dentry.name[0] = '\0';
-						strcat(new_transfer_dentry.name, to_components[num_comp_to - 1]);
-						memcpy(fs->image + A1FS_BLOCK_SIZE * valid_extent_start + sizeof(struct a1fs_dentry) * k, &new_transfer_dentry, sizeof(struct a1fs_dentry));
-						return 0;
-					}
-				}	
-			}
-		}
+		to_parent = to_ino;
+		memcpy(transfer_dentry.name, from_last.name, from_last.len);
+		transfer_dentry.name[from_last.len] = '\0';
+	} else { // If "to" does not exist, take its name
+		memcpy(transfer_dentry.name, to_last.name, to_last.len);
+		transfer_dentry.name[to_last.len] = '\0';
+	}
+
+	// Add the new entry first so that nothing is lost if that fails
+	int ret = update_parent(fs, get_inode(fs, to_parent), &transfer_dentry, to_parent);
+	if (ret < 0) {
+		return ret;
+	}
+	/*reset the dentry on the previous position*/
+	remove_dentry(fs, from_parent, from_entry);
+
+	// A directory that changed parents has to point its ".." at the new one
+	dir_pos dotdot;
+	if (S_ISDIR(get_inode(fs, from_ino)->mode) && to_parent != from_parent &&
+	    dir_lookup(fs, from_ino, "..", 2, name_hash("..", 2), &dotdot) >= 0) {
+		dirblk_set_ino(block_ptr(fs, dotdot.block), dotdot.off, to_parent);
 	}
 	return 0;
 }
@@ -1137,383 +2296,559 @@ static int a1fs_utimens(const char *path, const struct timespec tv[2])
 {
 	fs_ctx *fs = get_fs();
 	
-	/*Get a copy of path*/
-	char path_cp[strlen(path) + 1];
-	strncpy(path_cp, path, strlen(path));
-	path_cp[strlen(path)] = '\0';
-
-	// Get the number of components
-	int number_of_components = count_components(path_cp);
-
-	// Get a list of components
-	char *components[number_of_components];
-	list_of_components(path_cp, components);
-
 	// Assign time
-	int path_ino = check_new(fs, number_of_components, components);
-	struct a1fs_inode *path_inode = (struct a1fs_inode *)(fs-> image + A1FS_BLOCK_SIZE * 4 + path_ino * sizeof(struct a1fs_inode));
+	int path_ino = path_walk(fs, path, NULL);
+	if (path_ino < 0) {
+		return path_ino;
+	}
+	struct a1fs_inode *path_inode = get_inode(fs, path_ino);
 	path_inode->mtime.tv_sec = tv[1].tv_sec;
 	path_inode->mtime.tv_nsec = tv[1].tv_nsec;
 	return 0;
 }
 
 /**
- * Change the size of a file.
- *
- * Implements the truncate() system call. Supports both extending and shrinking.
- * If the file is extended, future reads from the new uninitialized range must
- * return zero data.
- *
- * Assumptions (already verified by FUSE using getattr() calls):
- *   "path" exists and is a file.
- *
- * Errors:
- *   ENOMEM  not enough memory (e.g. a malloc() call failed).
- *   ENOSPC  not enough free space in the file system.
- *
- * @param path  path to the file to set the size.
- * @param size  new file size in bytes.
- * @return      0 on success; -errno on error.
+ * Helper for truncate and write_buf
+ * Move the data of an inline file into a data block of its own, after which
+ * it is an ordinary file with one extent
+ * Returns 0 on success, -ENOSPC if there is no free block or extent
  */
-static int a1fs_truncate(const char *path, off_t size)
+int spill_inline(fs_ctx *fs, struct a1fs_inode *inode)
 {
-	fs_ctx *fs = get_fs();
-
-	/*Get a copy of path*/
-	char path_cp[strlen(path) + 1];
-	strncpy(path_cp, path, strlen(path));
-	path_cp[strlen(path)] = '\0';
+	struct a1fs_superblock *sb = (struct a1fs_superblock *)(fs->image);
+	int new_extent_number = allocate_extent(fs);
+	if (new_extent_number < 0) {
+		return -ENOSPC;
+	}
+	int64_t new_block_number = allocate_block(fs, inode_group(fs, inode_number(fs, inode)));
+	if (new_block_number < 0) {
+		sb->reserved_extent_number--;
+		return -ENOSPC;
+	}
+	make_new_extent(fs, new_extent_number, new_block_number);
 
-	// Get the number of components
-	int number_of_components = count_components(path_cp);
+	unsigned char *block = block_ptr(fs, new_block_number);
+	memcpy(block, inode->inline_data, inode->size);
+	memset(block + inode->size, 0, A1FS_BLOCK_SIZE - inode->size);
+	memset(inode->inline_data, 0, A1FS_INLINE_MAX);
+	inode->extent_number[0] = new_extent_number;
+	inode->mode &= ~A1FS_S_INLINE;
+	return 0;
+}
 
-	// Get a list of components
-	char *components[number_of_components];
-	list_of_components(path_cp, components);
-	
-	// Find the inode of path file
-	int path_ino = check_new(fs, number_of_components, components);
-	struct a1fs_inode *path_inode = (struct a1fs_inode *)(fs-> image + A1FS_BLOCK_SIZE * 4 + path_ino * sizeof(struct a1fs_inode));
-	
+/**
+ * Helper for truncate and write_buf
+ * Change the size of the file with the given inode; see a1fs_truncate()
+ */
+int truncate_inode(fs_ctx *fs, struct a1fs_inode *path_inode, off_t size)
+{
+	if (size == 0 && !(path_inode->mode & A1FS_S_INLINE)) {
+		// An emptied file goes back to taking no blocks until it is written
+		free_extents(fs, path_inode);
+		path_inode->mode |= A1FS_S_INLINE;
+		path_inode->size = 0;
+		return 0;
+	}
+	if (path_inode->mode & A1FS_S_INLINE) {
+		if ((uint64_t)size <= A1FS_INLINE_MAX) { // Stays inline
+			if ((uint64_t)size < path_inode->size) {
+				memset(path_inode->inline_data + size, 0, path_inode->size - size);
+			}
+			path_inode->size = size;
+			return 0;
+		}
+		int ret = spill_inline(fs, path_inode);
+		if (ret < 0) {
+			return ret;
+		}
+	}
+	// The rest works on whole blocks
+	int ret = unpack_tail(fs, path_inode);
+	if (ret < 0) {
+		return ret;
+	}
 	struct a1fs_superblock *sb = (struct a1fs_superblock *)(fs->image);
-	unsigned char *block_bitmap = fs->image  + A1FS_BLOCK_SIZE * 2;
-	struct a1fs_extent *extent_block = (struct a1fs_extent *)(fs->image + A1FS_BLOCK_SIZE * 3);
-	// Get a list of meaningful extents in the inode
-	struct a1fs_extent extents_map[24];
+	struct a1fs_extent *extent_block = fs->layout.extents;
+	// Blocks the file has; extending never leaves fewer than its size needs
+	uint64_t have = 0;
 	for (int i = 0; i < 24; i++) {
-		if (path_inode->extent_number[i] > 0) { 
-			struct a1fs_extent valid_extent = extent_block[path_inode->extent_number[i] - 1];
-			extents_map[i] = valid_extent;
-		} else {
-			struct a1fs_extent invalid_extent;
-			invalid_extent.start = 0;
-			invalid_extent.count = 0;
-			extents_map[i] = invalid_extent;
+		if (path_inode->extent_number[i] > 0) {
+			have += extent_block[path_inode->extent_number[i] - 1].count;
 		}
 	}
-	
+	uint64_t want = ceiling_block(size);
+
 	// Extending
 	if ((unsigned long int)size > (unsigned long int)path_inode->size) {
-		int requested_block = ceiling_block(size - path_inode->size);
+		if (want <= have) {
+			path_inode->size = size;
+			return 0;
+		}
+		a1fs_blk_t requested_block = want - have;
+		fs_ctx_sync_counts(fs);
 		if ((uint64_t)requested_block > sb->free_data_block_count) { // blocks requested are too many
 			return -ENOMEM;
 		}
-		// Need empty spots for new extents
-		int num_empty_spot = 0;
-		bool found_empty_spot = false;
-		for (int i = 0; i < 24; i++) {
-			if (extents_map[i].start == 0 && extents_map[i].count == 0) { // Found an empty spot
-				found_empty_spot = true;
-				num_empty_spot++;
+		// Grow the last extent in place first; only what is left needs new extents
+		requested_block -= grow_last_extent(fs, path_inode, requested_block);
+		unsigned int group = inode_group(fs, inode_number(fs, path_inode));
+		while (requested_block > 0) {
+			// Each new extent takes a whole run of free blocks, claimed and zeroed at once
+			int slot = last_extent(path_inode) + 1;
+			if (slot == 24) {
+				return -ENOSPC;
 			}
- 		}
-		// None of the spot is empty
-		if (!found_empty_spot) { 
-			return -ENOSPC;
-		}
-		int zero_pos[A1FS_BLOCK_SIZE * 8];
-		find_zero_postions(fs, zero_pos);
-		// Create extents
-		for (int j = 0; j < 24; j++) { 
-			if (extents_map[j].start == 0 && extents_map[j].count == 0) { // found empty extent
-				int k = 0;
-				while (k < requested_block) { // Still requesting
-					// Create a extent
-					struct a1fs_extent new_extent;
-					new_extent.start = zero_pos[k] + 4 + sb->inode_blocks;
-					new_extent.count = 1;
-					//Change superblock
-					sb->reserved_extent_number++;
-					sb->free_data_block_count--;
-					// Fill data block with zero data
-					memset(fs->image + new_extent.start * A1FS_BLOCK_SIZE, 0, A1FS_BLOCK_SIZE);
-					// Flip bitmap
-					assign_bitmap(block_bitmap, zero_pos[k]);
-					// Reserve a slot in inode
-					extents_map[j] = new_extent;
-					int previous = zero_pos[k];
-					k++;
-					while (k < requested_block) { // Still requesting
-						if (zero_pos[k] == previous + 1) { // consecutive 0s should be in one extent
-							new_extent.count++;
-							//Change superblock
-							sb->free_data_block_count--;
-							// Fill data block with zero data
-							memset(fs->image + (zero_pos[k] + 4 + sb->inode_blocks) * A1FS_BLOCK_SIZE, 0, A1FS_BLOCK_SIZE);
-							// Flip bitmap
-							assign_bitmap(block_bitmap, zero_pos[k]);
-							previous = zero_pos[k];
-							k++;
-						} else { // non-consecutive 0s should not be in one extent
-							break;
-						}
-					}
-					memcpy(fs->image + A1FS_BLOCK_SIZE * 3 + (sb->reserved_extent_number - 1) * sizeof(struct a1fs_extent), &new_extent, sizeof(struct a1fs_extent));
-					// Add extent number to the inode
-					for (int index = 0; index < 24; index++) {
-						if (path_inode->extent_number[index] == 0){
-							path_inode->extent_number[index] = sb->reserved_extent_number;
-							break;
-						}
-					}
-				}
-				// Extend finished when every requested block is assigned to a extent
-				if (k == requested_block) {
-					path_inode->size = size;
-					return 0;
-				}
+			a1fs_blk_t count;
+			int64_t index = find_free_extent(fs, group, requested_block, &count);
+			if (index < 0) {
+				return -ENOSPC;
+			}
+			int new_extent_number = allocate_extent(fs);
+			if (new_extent_number < 0) {
+				return -ENOSPC;
 			}
+			a1fs_blk_t start = index + fs->layout.data_start;
+			zero_blocks(fs, start, count);
+			claim_range(fs, start, count);
+			extent_block[new_extent_number - 1].start = start;
+			extent_block[new_extent_number - 1].count = count;
+			path_inode->extent_number[slot] = new_extent_number;
+			requested_block -= count;
 		}
+		merge_extents(fs, path_inode);
+		path_inode->size = size;
+		return 0;
 	}
 	// Shrinking
 	if ((unsigned long int)size < (unsigned long int)path_inode->size) {
-		int expected_num_blocks = ceiling_block(size);
-		int cur_num_blocks = ceiling_block(path_inode->size);
-		int num_blocks_to_shrink = cur_num_blocks - expected_num_blocks;
-		unsigned int ending = path_inode->size % A1FS_BLOCK_SIZE;
-		if (num_blocks_to_shrink == 0 && (ending > (path_inode->size - size))) { // Ex: 8192 => 5000 is 2 - 2
-			// Fill positions with zeros
-			for (int x = 23; x >= 0; x--) {
-				if (extents_map[x].start != 0 && extents_map[x].count != 0) {
-					//clear file
-					memset(fs->image + A1FS_BLOCK_SIZE * (extents_map[x].start + extents_map[x].count - 1) + path_inode->size - size, 0, A1FS_BLOCK_SIZE - path_inode->size + size);
-					break;
-				}
+		// Zero the rest of the last block kept, so that it reads back as zeros if the file grows again
+		uint64_t pos = 0;
+		for (int i = 0; i < 24 && size % A1FS_BLOCK_SIZE != 0; i++) {
+			if (path_inode->extent_number[i] == 0) {
+				continue;
 			}
-			path_inode->size = size;
-			return 0;
-		} else { // Ex: 8192 => 3000 is 2 - 1 or 8193 => 7000 is 3 - 2
-			if (!num_blocks_to_shrink) {
-				num_blocks_to_shrink ++;
+			struct a1fs_extent *extent = &extent_block[path_inode->extent_number[i] - 1];
+			if (want - 1 < pos + extent->count) {
+				off_t block = extent->start + (want - 1 - pos);
+				memset((char *)block_ptr(fs, block) + size % A1FS_BLOCK_SIZE, 0,
+				       A1FS_BLOCK_SIZE - size % A1FS_BLOCK_SIZE);
+				break;
 			}
-			for (int i = 23; i >= 0; i--) {
-				if (extents_map[i].start != 0 && extents_map[i].count != 0) { // The last meaningful extent
-					while (extents_map[i].count > 0) {
-						// Set this data block to zero
-						memset(fs->image + A1FS_BLOCK_SIZE * (extents_map[i].start + extents_map[i].count - 1), 0, A1FS_BLOCK_SIZE);
-						// Change superblock
-						sb->free_data_block_count++;
-						// Reset bitmap
-						reset_bitmap(block_bitmap, extents_map[i].start + extents_map[i].count - 1);
-						// Decrement the count of this extent.count
-						extents_map[i].count--;
-						num_blocks_to_shrink--;
-						if (extents_map[i].count == 0) { // This extent is already empty
-							// Change superblock
-							sb->reserved_extent_number--;
-							// Make this extent empty
-							extents_map[i].start = 0;
-							path_inode->extent_number[i] = 0;
-						}
-						// Need to check is shrink finished after removing a block that should be removed
-						if (num_blocks_to_shrink == 0) {
-							path_inode->size = size;
-							return 0;
-						}
-					}
-				}
+			pos += extent->count;
+		}
+		// Trim whole ranges off the ends of the last extents
+		for (int i = last_extent(path_inode); i >= 0 && have > want; i--) {
+			if (path_inode->extent_number[i] == 0) {
+				continue;
+			}
+			struct a1fs_extent *extent = &extent_block[path_inode->extent_number[i] - 1];
+			a1fs_blk_t n = have - want < extent->count ? have - want : extent->count;
+			extent->count -= n;
+			release_blocks(fs, extent->start + extent->count, n);
+			have -= n;
+			if (extent->count == 0) { // Nothing left of the extent
+				extent->start = 0;
+				path_inode->extent_number[i] = 0;
+				sb->reserved_extent_number--;
 			}
 		}
+		path_inode->size = size;
 	}
 	return 0;
 }
 
+/**
+ * Change the size of a file.
+ *
+ * Implements the truncate() system call. Supports both extending and shrinking.
+ * If the file is extended, future reads from the new uninitialized range must
+ * return zero data.
+ *
+ * Assumptions (already verified by FUSE using getattr() calls):
+ *   "path" exists and is a file.
+ *
+ * Errors:
+ *   ENOMEM  not enough memory (e.g. a malloc() call failed).
+ *   ENOSPC  not enough free space in the file system.
+ *
+ * @param path  path to the file to set the size.
+ * @param size  new file size in bytes.
+ * @return      0 on success; -errno on error.
+ */
+static int a1fs_truncate(const char *path, off_t size)
+{
+	fs_ctx *fs = get_fs();
+
+	// Find the inode of path file
+	int path_ino = path_walk(fs, path, NULL);
+	if (path_ino < 0) {
+		return path_ino;
+	}
+	return truncate_inode(fs, get_inode(fs, path_ino), size);
+}
+
 
 /**
  * Read data from a file.
  *
- * Implements the pread() system call. Should return exactly the number of bytes
- * requested except on EOF (end of file) or error, otherwise the rest of the
- * data will be substituted with zeros. Reads from file ranges that have not
- * been written to must return zero data.
+ * Implements the pread() system call. Instead of copying into a FUSE buffer,
+ * returns a bufvec of fd+offset buffers that describe where the requested
+ * bytes live in the image file, so that FUSE can splice them to the kernel
+ * without a copy through user space. The data of a file stored inline is
+ * returned as a single memory buffer pointing into its inode. Should describe
+ * exactly the number of bytes requested except on EOF (end of file). Reads
+ * from file ranges that have not been written to must return zero data.
  *
  * Assumptions (already verified by FUSE using getattr() calls):
  *   "path" exists and is a file.
  *
+ * Errors:
+ *   ENOMEM  not enough memory (e.g. a malloc() call failed).
+ *
  * @param path    path to the file to read from.
- * @param buf     pointer to the buffer that receives the data.
- * @param size    buffer size - number of bytes requested.
+ * @param bufp    receives the allocated bufvec; FUSE frees it.
+ * @param size    number of bytes requested.
  * @param offset  offset from the beginning of the file to read from.
- * @param fi      unused.
- * @return        number of bytes read on success; 0 if offset is beyond EOF;
+ * @param fi      open file state; drives readahead, see readahead_update().
+ * @return        0 on success (an empty bufvec if offset is beyond EOF);
  *                -errno on error.
  */
-static int a1fs_read(const char *path, char *buf, size_t size, off_t offset,
-                     struct fuse_file_info *fi)
+static int a1fs_read_buf(const char *path, struct fuse_bufvec **bufp,
+                         size_t size, off_t offset, struct fuse_file_info *fi)
 {
-	(void)fi;// unused
 	fs_ctx *fs = get_fs();
 
-	char path_cp[strlen(path) + 1];
-	strncpy(path_cp, path, strlen(path));
-	path_cp[strlen(path)] = '\0';
-
-	// Get the number of components
-	int number_of_components = count_components(path_cp);
-
-	// Get a list of components
-	char *components[number_of_components];
-	list_of_components(path_cp, components);
-
-	int inode_number = check_new(fs, number_of_components, components);
-
-	/* Get the inode & extent block */
-	a1fs_inode *dest_inode = (struct a1fs_inode *)(fs->image + A1FS_BLOCK_SIZE * 4 + inode_number * sizeof(struct a1fs_inode));
-	a1fs_extent *extent_block = (a1fs_extent *)(fs->image + A1FS_BLOCK_SIZE * 3);
+	int inode_number = path_walk(fs, path, NULL);
+	if (inode_number < 0) {
+		return inode_number;
+	}
 
-	// calculate the offset
-	int offset_block = offset / A1FS_BLOCK_SIZE;
-	int remaining = offset % A1FS_BLOCK_SIZE;
+	/* Get the inode */
+	a1fs_inode *dest_inode = get_inode(fs, inode_number);
 
-	// get the starting point of read
-	int block_number[dest_inode->size / A1FS_BLOCK_SIZE + 1];
-	block_number[dest_inode->size / A1FS_BLOCK_SIZE] = 0;
-	int pos = 0;
-	for (int i = 0; i < 24; i++) {
-		if (dest_inode->extent_number[i] > 0) {
-			a1fs_extent extent = extent_block[dest_inode->extent_number[i] - 1];
-			if (extent.start != 0) {
-				for (unsigned int c = 0; c < extent.count; c++) {
-					block_number[pos] = extent.start + extent.count - 1;
-					pos++;
-				}
-			}	
-		}
+	struct fuse_bufvec *vec = alloc_extent_bufvec();
+	if (!vec) {
+		return -ENOMEM;
 	}
 
-	// copy the data to the buf
-	unsigned char *destination = (unsigned char *) fs->image + A1FS_BLOCK_SIZE * block_number[offset_block];
-	for (unsigned int j = 0; j < size; j++) {
-		buf[j] = destination[remaining];
-		remaining ++;
-		if (remaining == A1FS_BLOCK_SIZE) {
-			remaining = 0;
-			offset_block++;
-			destination = (unsigned char *) fs->image + A1FS_BLOCK_SIZE * block_number[offset_block];
+	// Nothing to read beyond EOF; leave the bufvec empty
+	if ((uint64_t)offset < dest_inode->size) {
+		if (offset + size > dest_inode->size) {
+			size = dest_inode->size - offset;
+		}
+		if (dest_inode->mode & A1FS_S_INLINE) { // Straight from the inode
+			vec->buf[0].mem = dest_inode->inline_data + offset;
+			vec->buf[0].size = size;
+			*bufp = vec;
+			return 0;
+		}
+		size_t count = map_extents(fs, dest_inode, offset, size, vec->buf);
+		if (count > 0) {
+			vec->count = count;
+		}
+		if (fi->fh) {
+			readahead_update(fs, (a1fs_file *)(uintptr_t)fi->fh, dest_inode, offset, size);
 		}
 	}
 
-	return size;
+	*bufp = vec;
+	return 0;
 }
 
 /**
  * Write data to a file.
  *
- * Implements the pwrite() system call. Should return exactly the number of
- * bytes requested except on error. If the offset is beyond EOF (end of file),
- * the file must be extended. If the write creates a "hole" of uninitialized
- * data, future reads from the "hole" must return zero data.
+ * Implements the pwrite() system call. The data is copied (spliced, when the
+ * kernel hands it over in a pipe) straight into the image file at the
+ * positions of the file's extents. A file stored inline is written in its
+ * inode for as long as it fits in A1FS_INLINE_MAX bytes, and moved to a data
+ * block by the first write that doesn't. Should return exactly the number of
+ * bytes requested except on error. If the offset is beyond EOF (end of file), the
+ * file must be extended. If the write creates a "hole" of uninitialized data,
+ * future reads from the "hole" must return zero data.
  *
  * Assumptions (already verified by FUSE using getattr() calls):
  *   "path" exists and is a file.
  *
+ * Errors:
+ *   ENOMEM  not enough memory (e.g. a malloc() call failed).
+ *   ENOSPC  not enough free space in the file system.
+ *
  * @param path    path to the file to write to.
- * @param buf     pointer to the buffer containing the data.
- * @param size    buffer size - number of bytes requested.
+ * @param buf     bufvec containing the data.
  * @param offset  offset from the beginning of the file to write to.
- * @param fi      unused.
+ * @param fi      open file state; records that the file was written to.
  * @return        number of bytes written on success; -errno on error.
  */
-static int a1fs_write(const char *path, const char *buf, size_t size,
-                      off_t offset, struct fuse_file_info *fi)
+static int a1fs_write_buf(const char *path, struct fuse_bufvec *buf,
+                          off_t offset, struct fuse_file_info *fi)
 {
-	(void)fi;// unused
 	fs_ctx *fs = get_fs();
+	size_t size = fuse_buf_size(buf);
+	if (fi->fh) {
+		((a1fs_file *)(uintptr_t)fi->fh)->written = true;
+	}
 
-	char path_cp[strlen(path) + 1];
-	strncpy(path_cp, path, strlen(path));
-	path_cp[strlen(path)] = '\0';
-
-	// Get the number of components
-	int number_of_components = count_components(path_cp);
-
-	// Get a list of components
-	char *components[number_of_components];
-	list_of_components(path_cp, components);
+	int inode_number = path_walk(fs, path, NULL);
+	if (inode_number < 0) {
+		return inode_number;
+	}
 
-	int inode_number = check_new(fs, number_of_components, components);
+	/*Get the inode*/
+	a1fs_inode *dest_inode = get_inode(fs, inode_number);
 
-	/*Get the inode & extent block*/
-	a1fs_inode *dest_inode = (struct a1fs_inode *)(fs->image + A1FS_BLOCK_SIZE * 4 + inode_number * sizeof(struct a1fs_inode));
-	a1fs_extent *extent_block = (a1fs_extent *)(fs->image + A1FS_BLOCK_SIZE * 3);
+	// Small files are written in place in the inode
+	if ((dest_inode->mode & A1FS_S_INLINE) && offset + size <= A1FS_INLINE_MAX) {
+		struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+		dst.buf[0].mem = dest_inode->inline_data + offset;
+		ssize_t ret = fuse_buf_copy(&dst, buf, 0);
+		if (ret < 0) {
+			return ret;
+		}
+		if (offset + ret > (off_t)dest_inode->size) {
+			dest_inode->size = offset + ret;
+		}
+		clock_gettime(CLOCK_REALTIME, &dest_inode->mtime);
+		return ret;
+	}
 
 	//check if it is necessary to extend
 	if (offset + size > dest_inode->size){
-		if (a1fs_truncate(path, offset + size) < 0){
-			return -ENOSPC;
+		int ret = truncate_inode(fs, dest_inode, offset + size);
+		if (ret < 0){
+			return ret;
 		}
 	}
 
-	// calculate the offset
-	int offset_block = offset / A1FS_BLOCK_SIZE;
-	int remaining = offset % A1FS_BLOCK_SIZE;
+	struct fuse_bufvec *dst = alloc_extent_bufvec();
+	if (!dst) {
+		return -ENOMEM;
+	}
+	size_t count = map_extents(fs, dest_inode, offset, size, dst->buf);
+	if (count > 0) {
+		dst->count = count;
+	}
 
-	// get the starting point of read
-	int block_number[dest_inode->size / A1FS_BLOCK_SIZE + 1];
-	block_number[dest_inode->size / A1FS_BLOCK_SIZE] = 0;
-	int pos = 0;
-	for (int i = 0; i < 24; i++){
-		if (dest_inode->extent_number[i] > 0){
-			a1fs_extent extent = extent_block[dest_inode->extent_number[i] - 1];
-			if (extent.start != 0){
-				for (unsigned int c = 0; c < extent.count; c++){
-					block_number[pos] = extent.start + extent.count - 1;
-					pos++;
-				}
-			}	
-		}	
+	// Move the data into the image; splice pages from the kernel if possible
+	ssize_t ret = fuse_buf_copy(dst, buf, FUSE_BUF_SPLICE_MOVE);
+	free(dst);
+	if (ret < 0) {
+		return ret;
+	}
+
+	clock_gettime(CLOCK_REALTIME, &dest_inode->mtime);
+	return ret;
+}
+
+/**
+ * Read data from a file into a buffer.
+ *
+ * Implements the pread() system call for the --copy mode, which serves data
+ * the way a1fs did before read_buf(): the bytes are copied out of the image
+ * into the FUSE buffer. Only there to compare throughput against read_buf().
+ *
+ * @param path    path to the file to read from.
+ * @param buf     pointer to the buffer that receives the data.
+ * @param size    buffer size (number of bytes requested).
+ * @param offset  offset from the beginning of the file to read from.
+ * @param fi      open file state, as for read_buf().
+ * @return        number of bytes read on success; 0 if offset is beyond EOF;
+ *                -errno on error.
+ */
+static int a1fs_read(const char *path, char *buf, size_t size, off_t offset,
+                     struct fuse_file_info *fi)
+{
+	struct fuse_bufvec *src;
+	int ret = a1fs_read_buf(path, &src, size, offset, fi);
+	if (ret < 0) {
+		return ret;
+	}
+	struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+	dst.buf[0].mem = buf;
+	ssize_t copied = fuse_buf_copy(&dst, src, 0);
+	free(src);
+	return copied;
+}
+
+/**
+ * Write data to a file from a buffer.
+ *
+ * Implements the pwrite() system call for the --copy mode; the counterpart of
+ * a1fs_read(). The data is copied from the FUSE buffer into the image.
+ *
+ * @param path    path to the file to write to.
+ * @param buf     pointer to the buffer containing the data.
+ * @param size    buffer size (number of bytes requested).
+ * @param offset  offset from the beginning of the file to write to.
+ * @param fi      open file state, as for write_buf().
+ * @return        number of bytes written on success; -errno on error.
+ */
+static int a1fs_write(const char *path, const char *buf, size_t size,
+                      off_t offset, struct fuse_file_info *fi)
+{
+	struct fuse_bufvec src = FUSE_BUFVEC_INIT(size);
+	src.buf[0].mem = (void *)buf;
+	return a1fs_write_buf(path, &src, offset, fi);
+}
+
+
+/**
+ * Perform a batch of creates or unlinks in a directory.
+ *
+ * Implements the A1FS_IOC_BATCH_CREATE and A1FS_IOC_BATCH_UNLINK ioctls (see
+ * batch.h) on an open directory. The directory is looked up once for the
+ * whole batch, and its free slot list stays warm from one record to the next,
+ * so each record costs one directory insert or removal instead of the FUSE
+ * round trips and path walks of a separate create() or unlink().
+ *
+ * Errors of individual records stop the batch and are reported in the batch
+ * itself: EEXIST/ENOENT, EINVAL or ENAMETOOLONG for a bad name, EISDIR for
+ * unlinking a directory, ENOSPC and ENOMEM as in create().
+ *
+ * Errors:
+ *   ENOTTY  unknown ioctl, or not issued on a directory.
+ *   EINVAL  malformed batch.
+ *
+ * @param path   path to the directory.
+ * @param cmd    ioctl command.
+ * @param arg    ioctl argument. Unused.
+ * @param fi     open directory state. Unused.
+ * @param flags  FUSE ioctl flags.
+ * @param data   the batch; updated with the number of records done.
+ * @return       0 on success; -errno on error.
+ */
+static int a1fs_ioctl(const char *path, int cmd, void *arg,
+                      struct fuse_file_info *fi, unsigned int flags, void *data)
+{
+	(void)arg;// unused
+	(void)fi;// unused
+	unsigned int command = cmd;
+	if (!(flags & FUSE_IOCTL_DIR) ||
+	    (command != A1FS_IOC_BATCH_CREATE && command != A1FS_IOC_BATCH_UNLINK)) {
+		return -ENOTTY;
+	}
+	fs_ctx *fs = get_fs();
+	int dir = path_walk(fs, path, NULL);
+	if (dir < 0) {
+		return dir;
 	}
 
-	// copy the data to the data block
-	unsigned char *destination = (unsigned char *) fs->image + A1FS_BLOCK_SIZE * block_number[offset_block];
-	for (unsigned int j = 0; j < size; j++){
-		destination[remaining] = buf[j];
-		remaining ++;
-		if (remaining == A1FS_BLOCK_SIZE){
-			remaining = 0;
-			offset_block++;
-			destination = (unsigned char *) fs->image + A1FS_BLOCK_SIZE * block_number[offset_block];
+	a1fs_batch *batch = data;
+	uint32_t count = batch->count;
+	size_t off = 0;
+	batch->count = 0;
+	batch->error = 0;
+	for (uint32_t i = 0; i < count; i++) {
+		if (off + A1FS_BATCH_REC_SIZE(0) > A1FS_BATCH_DATA ||
+		    off + A1FS_BATCH_REC_SIZE(batch->data[off + 2]) > A1FS_BATCH_DATA) {
+			return -EINVAL;
+		}
+		mode_t mode = batch->data[off] | batch->data[off + 1] << 8;
+		size_t len = batch->data[off + 2];
+		const char *name = (const char *)batch->data + off + 3;
+		off += A1FS_BATCH_REC_SIZE(len);
+
+		// Names come straight from the caller, not from a path FUSE has checked
+		int ret = 0;
+		if (len == 0 || memchr(name, '/', len) || memchr(name, '\0', len) ||
+		    (len == 1 && name[0] == '.') || (len == 2 && !memcmp(name, "..", 2))) {
+			ret = -EINVAL;
+		} else if (len >= A1FS_NAME_MAX) {
+			ret = -ENAMETOOLONG;
+		} else {
+			uint32_t hash = name_hash(name, len);
+			int found = dir_lookup(fs, dir, name, len, hash, NULL);
+			if (command == A1FS_IOC_BATCH_CREATE) {
+				ret = found >= 0 ? -EEXIST :
+				      create_entry(fs, dir, name, len, S_IFREG | (mode & 07777));
+			} else if (found >= 0 && S_ISDIR(get_inode(fs, found)->mode)) {
+				ret = -EISDIR;
+			} else {
+				ret = unlink_entry(fs, dir, name, len, hash);
+			}
 		}
+		if (ret < 0) {
+			batch->error = -ret;
+			break;
+		}
+		batch->count++;
 	}
+	if (batch->count > 0) {
+		clock_gettime(CLOCK_REALTIME, &get_inode(fs, dir)->mtime);
+	}
+	return 0;
+}
 
-	return size;
+/*
+ * File system operations run under fs->lock, so that they never see the
+ * reclaimer halfway through a batch. LOCKED(op, params, args) defines
+ * op_locked(), which calls op() with the lock held.
+ */
+#define LOCKED(op, params, args)                \
+static int op##_locked params                   \
+{                                               \
+	fs_ctx *fs = get_fs();                      \
+	pthread_mutex_lock(&fs->lock);              \
+	int ret = op args;                          \
+	pthread_mutex_unlock(&fs->lock);            \
+	return ret;                                 \
 }
 
+LOCKED(a1fs_statfs, (const char *path, struct statvfs *st), (path, st))
+LOCKED(a1fs_getattr, (const char *path, struct stat *st), (path, st))
+LOCKED(a1fs_opendir, (const char *path, struct fuse_file_info *fi), (path, fi))
+LOCKED(a1fs_readdir, (const char *path, void *buf, fuse_fill_dir_t filler,
+                      off_t offset, struct fuse_file_info *fi),
+       (path, buf, filler, offset, fi))
+LOCKED(a1fs_releasedir, (const char *path, struct fuse_file_info *fi), (path, fi))
+LOCKED(a1fs_mkdir, (const char *path, mode_t mode), (path, mode))
+LOCKED(a1fs_rmdir, (const char *path), (path))
+LOCKED(a1fs_open, (const char *path, struct fuse_file_info *fi), (path, fi))
+LOCKED(a1fs_release, (const char *path, struct fuse_file_info *fi), (path, fi))
+LOCKED(a1fs_create, (const char *path, mode_t mode, struct fuse_file_info *fi),
+       (path, mode, fi))
+LOCKED(a1fs_unlink, (const char *path), (path))
+LOCKED(a1fs_rename, (const char *from, const char *to), (from, to))
+LOCKED(a1fs_utimens, (const char *path, const struct timespec tv[2]), (path, tv))
+LOCKED(a1fs_truncate, (const char *path, off_t size), (path, size))
+LOCKED(a1fs_read_buf, (const char *path, struct fuse_bufvec **bufp,
+                       size_t size, off_t offset, struct fuse_file_info *fi),
+       (path, bufp, size, offset, fi))
+LOCKED(a1fs_write_buf, (const char *path, struct fuse_bufvec *buf,
+                        off_t offset, struct fuse_file_info *fi),
+       (path, buf, offset, fi))
+LOCKED(a1fs_read, (const char *path, char *buf, size_t size, off_t offset,
+                   struct fuse_file_info *fi),
+       (path, buf, size, offset, fi))
+LOCKED(a1fs_write, (const char *path, const char *buf, size_t size,
+                    off_t offset, struct fuse_file_info *fi),
+       (path, buf, size, offset, fi))
+LOCKED(a1fs_ioctl, (const char *path, int cmd, void *arg,
+                    struct fuse_file_info *fi, unsigned int flags, void *data),
+       (path, cmd, arg, fi, flags, data))
 
 static struct fuse_operations a1fs_ops = {
-	.destroy  = a1fs_destroy,
-	.statfs   = a1fs_statfs,
-	.getattr  = a1fs_getattr,
-	.readdir  = a1fs_readdir,
-	.mkdir    = a1fs_mkdir,
-	.rmdir    = a1fs_rmdir,
-	.create   = a1fs_create,
-	.unlink   = a1fs_unlink,
-	.rename   = a1fs_rename,
-	.utimens  = a1fs_utimens,
-	.truncate = a1fs_truncate,
-	.read     = a1fs_read,
-	.write    = a1fs_write,
+	.init       = a1fs_conn_init,
+	.destroy    = a1fs_destroy,
+	.statfs     = a1fs_statfs_locked,
+	.getattr    = a1fs_getattr_locked,
+	.opendir    = a1fs_opendir_locked,
+	.readdir    = a1fs_readdir_locked,
+	.releasedir = a1fs_releasedir_locked,
+	.mkdir      = a1fs_mkdir_locked,
+	.rmdir      = a1fs_rmdir_locked,
+	.open       = a1fs_open_locked,
+	.release    = a1fs_release_locked,
+	.create     = a1fs_create_locked,
+	.unlink     = a1fs_unlink_locked,
+	.rename     = a1fs_rename_locked,
+	.utimens    = a1fs_utimens_locked,
+	.truncate   = a1fs_truncate_locked,
+	.read_buf   = a1fs_read_buf_locked,
+	.write_buf  = a1fs_write_buf_locked,
+	.read       = a1fs_read_locked,
+	.write      = a1fs_write_locked,
+	.ioctl      = a1fs_ioctl_locked,
 };
 
 /*Search the empty blocks*/
@@ -1530,6 +2865,11 @@ int main(int argc, char *argv[])
 		fprintf(stderr, "Failed to mount the file system\n");
 		return 1;
 	}
+	// FUSE prefers read_buf/write_buf; without them it falls back to read/write
+	if (opts.copy) {
+		a1fs_ops.read_buf = NULL;
+		a1fs_ops.write_buf = NULL;
+	}
 
 	return fuse_main(args.argc, args.argv, &a1fs_ops, &fs);
 }
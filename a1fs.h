@@ -26,14 +26,24 @@
 
 
 /**
- * a1fs block size in bytes. You are not allowed to change this value.
+ * a1fs block size in bytes.
  *
  * The block size is the unit of space allocation. Each file (and directory)
  * must occupy an integral number of blocks. Each of the file systems metadata
  * partitions, e.g. superblock, inode/block bitmaps, inode table (but not an
  * individual inode) must also occupy an integral number of blocks.
+ *
+ * The block size is fixed when a1fs and mkfs.a1fs are built (4 KiB unless
+ * given on the compiler command line, see the Makefile), so that everything
+ * computed from it is a constant; a build only mounts images made with its
+ * own block size (see a1fs_superblock::block_size).
  */
+#ifndef A1FS_BLOCK_SIZE
 #define A1FS_BLOCK_SIZE 4096
+#endif
+
+static_assert(A1FS_BLOCK_SIZE == 4096 || A1FS_BLOCK_SIZE == 16384 || A1FS_BLOCK_SIZE == 65536,
+              "unsupported block size");
 
 /** Block number (block pointer) type. */
 typedef uint32_t a1fs_blk_t;
@@ -45,6 +55,9 @@ typedef uint32_t a1fs_ino_t;
 /** Magic value that can be used to identify an a1fs image. */
 #define A1FS_MAGIC 0xC5C369A1C5C369A1ul
 
+/** Largest number of inodes on the orphan list. */
+#define A1FS_ORPHAN_MAX 512
+
 /** a1fs superblock. */
 typedef struct a1fs_superblock {
 	/** Must match A1FS_MAGIC. */
@@ -67,6 +80,60 @@ typedef struct a1fs_superblock {
     uint64_t free_data_block_count;
 	/** Current number of reserved extents */
 	uint64_t reserved_extent_number;
+	/** The number of inodes on the orphan list */
+	uint64_t orphan_count;
+	/**
+	 * Orphan list - inodes of removed files whose blocks have not all been
+	 * freed yet. The blocks are freed in the background, and whatever is left
+	 * on the list at unmount or after a crash is freed after the next mount.
+	 */
+	a1fs_ino_t orphans[A1FS_ORPHAN_MAX];
+
+	/**
+	 * Layout of the image - where each metadata area starts and how many
+	 * blocks it takes, worked out by mkfs from the image size and the number
+	 * of inodes. All zeros in images made before the layout was recorded;
+	 * those have the original fixed layout (inode bitmap in block 1, block
+	 * bitmap in block 2, extent table in block 3, inode table from block 4).
+	 */
+	/** First block of the inode bitmap. */
+	uint64_t inode_bitmap_start;
+	/** Number of blocks of the inode bitmap. */
+	uint64_t inode_bitmap_blocks;
+	/** First block of the block bitmap. */
+	uint64_t block_bitmap_start;
+	/** Number of blocks of the block bitmap. */
+	uint64_t block_bitmap_blocks;
+	/** First block of the extent table. */
+	uint64_t extent_table_start;
+	/** Number of blocks of the extent table. */
+	uint64_t extent_table_blocks;
+	/** First block of the inode table. */
+	uint64_t inode_table_start;
+	/** First data block; bit i of the block bitmap is block data_start + i. */
+	uint64_t data_start;
+
+	/** First block of the group descriptor table; 0 if the image has none. */
+	uint64_t group_desc_start;
+	/** Number of blocks of the group descriptor table. */
+	uint64_t group_desc_blocks;
+	/** Number of block groups. */
+	uint64_t group_count;
+	/** Number of inodes per block group; a multiple of 64. */
+	uint64_t group_inodes;
+	/**
+	 * Nonzero if the file system was unmounted cleanly, so the group
+	 * descriptors agree with the bitmaps. Cleared while mounted; after a
+	 * crash the descriptors are rebuilt from the bitmaps on the next mount.
+	 */
+	uint64_t clean;
+	/** Block size in bytes; 0 in images made before it was recorded, which have 4 KiB blocks. */
+	uint64_t block_size;
+	/**
+	 * Number of blocks at the end of the extent table that mkfs left as they
+	 * were; each is zeroed when the extents before it are all in use.
+	 */
+	uint64_t extent_table_uninit;
 
 } a1fs_superblock;
 
@@ -74,6 +141,47 @@ typedef struct a1fs_superblock {
 static_assert(sizeof(a1fs_superblock) <= A1FS_BLOCK_SIZE,
               "superblock is too large");
 
+/** Data blocks per block group (8 MiB). */
+#define A1FS_GROUP_BLOCKS 2048
+
+/**
+ * Block group descriptor.
+ *
+ * The data blocks are split into groups of A1FS_GROUP_BLOCKS blocks, and the
+ * inode table into as many groups of a1fs_superblock::group_inodes inodes.
+ * Each group's descriptor keeps its free counts up to date as blocks and
+ * inodes are allocated and freed, so mounting and statfs() don't have to
+ * count the bits of the bitmaps.
+ */
+typedef struct a1fs_group_desc {
+	/** Number of free data blocks in the group. */
+	uint32_t free_blocks;
+	/** Number of free inodes in the group. */
+	uint32_t free_inodes;
+	/** Number of directories whose inodes are in the group. */
+	uint32_t dirs;
+	/** No data block of the group before this one (counted from the group's first) is free. */
+	uint32_t first_free_block;
+	/** No inode of the group before this one (counted from the group's first) is free. */
+	uint32_t first_free_inode;
+	/** A1FS_GROUP_*_UNINIT flags. */
+	uint32_t flags;
+
+} a1fs_group_desc;
+
+/**
+ * The group's bits of the block bitmap have not been written since mkfs and
+ * may hold anything; all of its blocks are free. They are zeroed when a block
+ * is first allocated in the group.
+ */
+#define A1FS_GROUP_BLOCK_UNINIT 0x1
+/**
+ * The group's bits of the inode bitmap and its part of the inode table have
+ * not been written since mkfs; all of its inodes are free. They are zeroed
+ * when an inode is first allocated in the group.
+ */
+#define A1FS_GROUP_INODE_UNINIT 0x2
+
 
 
 
@@ -86,6 +194,26 @@ typedef struct a1fs_extent {
 
 } a1fs_extent;
 
+/** Size of a fragment, the unit in which blocks shared by file tails are split. */
+#define A1FS_FRAG_SIZE (A1FS_BLOCK_SIZE / 8)
+/** Number of fragments in a block. */
+#define A1FS_FRAGS_PER_BLOCK (A1FS_BLOCK_SIZE / A1FS_FRAG_SIZE)
+
+/**
+ * Flag in a1fs_extent::count of a fragment run - consecutive fragments of the
+ * block at start that hold the tail of a file, while the other fragments of
+ * the block may belong to other files. The low 8 bits of count are then the
+ * number of fragments, and the next 8 bits the index of the first one. Only
+ * the last extent of a file can be a fragment run.
+ */
+#define A1FS_EXTENT_FRAG 0x80000000u
+/** Number of fragments of a fragment run. */
+#define A1FS_FRAG_COUNT(count) ((count) & 0xff)
+/** Index of the first fragment of a fragment run. */
+#define A1FS_FRAG_FIRST(count) (((count) >> 8) & 0xff)
+/** count of a fragment run of n fragments starting at fragment first. */
+#define A1FS_FRAG_RUN(first, n) (A1FS_EXTENT_FRAG | (uint32_t)(first) << 8 | (uint32_t)(n))
+
 
 /** a1fs inode. */
 typedef struct a1fs_inode {
@@ -107,7 +235,12 @@ typedef struct a1fs_inode {
 	// The upper part is 32 in size
 	//TODO
 
-    uint32_t extent_number[24];
+	union {
+		/** Extents of the file: extent table index + 1, or 0 if unused. */
+		uint32_t extent_number[24];
+		/** Contents of a small file stored in the inode; see A1FS_S_INLINE. */
+		unsigned char inline_data[96];
+	};
 
 } a1fs_inode;
 
@@ -115,6 +248,17 @@ typedef struct a1fs_inode {
 static_assert(sizeof(a1fs_inode) == 128, "invalid inode size");
 static_assert(A1FS_BLOCK_SIZE % sizeof(a1fs_inode) == 0, "invalid inode size");
 
+/**
+ * Mode bit of a regular file whose data is stored in inline_data instead of
+ * data blocks. Never reported to the kernel. Files are created inline and
+ * move to a data block once they grow past A1FS_INLINE_MAX bytes; the bytes
+ * of inline_data past the file size are always zero.
+ */
+#define A1FS_S_INLINE 0x80000000u
+
+/** Largest file that can be stored inline. */
+#define A1FS_INLINE_MAX sizeof(((a1fs_inode *)0)->inline_data)
+
 
 /** Maximum file name (path component) length. Includes the null terminator. */
 #define A1FS_NAME_MAX 252
@@ -132,3 +276,55 @@ typedef struct a1fs_dentry {
 } a1fs_dentry;
 
 static_assert(sizeof(a1fs_dentry) == 256, "invalid dentry size");
+
+
+/** Magic value at the start of every block of a packed directory. */
+#define A1FS_DIRBLK_MAGIC 0xA1D1B10Cu
+
+/**
+ * Header of a packed directory block.
+ *
+ * Directories are stored in one of two formats, told apart by the first word
+ * of each block. Blocks of the original format are arrays of fixed size
+ * a1fs_dentry, whose first word is an inode number (or inode_count + 1 for a
+ * free slot) and so never equals A1FS_DIRBLK_MAGIC. Blocks of the packed
+ * format start with this header, followed by variable length a1fs_dirent
+ * records that tile the rest of the block. All blocks of a directory are in
+ * the same format as its first block.
+ */
+typedef struct a1fs_dirblk {
+	/** Must match A1FS_DIRBLK_MAGIC. */
+	uint32_t magic;
+	/** Unused; keeps the records 8-byte aligned. */
+	uint32_t reserved;
+
+} a1fs_dirblk;
+
+/**
+ * Variable length directory entry of a packed directory block.
+ *
+ * A record owns rec_len bytes; whatever follows its name is slack that a new
+ * record can be carved from. A record with name_len 0 is free.
+ */
+typedef struct a1fs_dirent {
+	/** Inode number. */
+	a1fs_ino_t ino;
+	/** Length of the record in bytes, a multiple of 8. */
+	uint16_t rec_len;
+	/** Length of the name, not counting the null terminator; 0 if free. */
+	uint8_t name_len;
+	/** Unused. */
+	uint8_t reserved;
+	/** FNV-1a hash of the name, checked before the name is compared. */
+	uint32_t hash;
+	/** File name. A null-terminated string of name_len characters. */
+	char name[];
+
+} a1fs_dirent;
+
+static_assert(sizeof(a1fs_dirent) == 12, "invalid dirent size");
+static_assert(A1FS_NAME_MAX - 1 <= UINT8_MAX, "name_len is too small");
+static_assert(A1FS_BLOCK_SIZE - sizeof(a1fs_dirblk) <= UINT16_MAX, "rec_len is too small for a whole block");
+
+/** Space taken by a packed record with a name of given length. */
+#define A1FS_DIRENT_SIZE(len) ((sizeof(a1fs_dirent) + (len) + 1 + 7) & ~(size_t)7)
@@ -0,0 +1,941 @@
+/*
+ * This code is provided solely for the personal and private use of students
+ * taking the CSC369H course at the University of Toronto. Copying for purposes
+ * other than this use is expressly prohibited. All forms of distribution of
+ * this code, including but not limited to public repositories on GitHub,
+ * GitLab, Bitbucket, or any other online platform, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Alexey Khrabrov, Karen Reid
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2019 Karen Reid
+ */
+
+/**
+ * CSC369 Assignment 1 - a1fs consistency checker.
+ *
+ * The image is checked in two phases, each split over worker threads that
+ * take the inode table in chunks. The first phase reads every inode in use
+ * and every directory block once, and records which directory refers to each
+ * inode. The second phase visits the inodes that turned out to be reachable
+ * from the root (or on the orphan list) and marks the extents and blocks they
+ * use. The bitmaps, the group descriptors and the free counters are then
+ * compared with what was found, and rewritten from it with -y.
+ */
+
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "a1fs.h"
+#include "dirblk.h"
+#include "map.h"
+
+
+/** Exit status: no problems found. */
+#define FSCK_OK 0
+/** Exit status: problems were found and all of them repaired. */
+#define FSCK_REPAIRED 1
+/** Exit status: problems were left as they were. */
+#define FSCK_ERRORS 4
+/** Exit status: the image could not be checked. */
+#define FSCK_FAILED 8
+
+/** Inodes handed to a worker thread at a time. */
+#define FSCK_CHUNK 1024
+
+/** Problems of each kind printed unless -v is given. */
+#define FSCK_REPORT_MAX 20
+
+/** No directory refers to the inode. */
+#define NO_PARENT UINT32_MAX
+
+
+/** Command line options. */
+typedef struct fsck_opts {
+	/** File system image file path. */
+	const char *img_path;
+	/** Print help and exit. */
+	bool help;
+	/** Repair the problems found; otherwise the image is not written. */
+	bool repair;
+	/** Verbose output: report every problem, not just the first few. */
+	bool verbose;
+	/** Number of worker threads; 0 for one per CPU. */
+	unsigned int threads;
+
+} fsck_opts;
+
+static const char *help_str = "\
+Usage: %s options image\n\
+\n\
+Check an a1fs image for consistency and optionally repair it. The image\n\
+must not be mounted. Exits with 0 if no problems were found, 1 if all of\n\
+them were repaired, 4 if some were left and 8 if the image can't be checked.\n\
+\n\
+Options:\n\
+    -n      check only, don't write to the image (default)\n\
+    -y      repair the problems found\n\
+    -j num  number of worker threads; one per CPU by default\n\
+    -h      print help and exit\n\
+    -v      verbose output; report every problem\n\
+";
+
+static void print_help(FILE *f, const char *progname)
+{
+	fprintf(f, help_str, progname);
+}
+
+
+static bool parse_args(int argc, char *argv[], fsck_opts *opts)
+{
+	char o;
+	while ((o = getopt(argc, argv, "nyj:hv")) != -1) {
+		switch (o) {
+			case 'n': opts->repair  = false; break;
+			case 'y': opts->repair  = true; break;
+			case 'j': opts->threads = strtoul(optarg, NULL, 10); break;
+
+			case 'h': opts->help    = true; return true;// skip other arguments
+			case 'v': opts->verbose = true; break;
+
+			case '?': return false;
+			default : assert(false);
+		}
+	}
+
+	if (optind >= argc) {
+		fprintf(stderr, "Missing image path\n");
+		return false;
+	}
+	opts->img_path = argv[optind];
+	return true;
+}
+
+
+/** Kinds of problems that are repaired after the scan. */
+typedef enum fix_kind {
+	/** Directory entry for an inode that is not in use; removed. */
+	FIX_ENTRY,
+	/** Extent slot of an inode that points outside the image; cleared. */
+	FIX_EXTENT,
+	/** File size past the end of the file's blocks; cut down to them. */
+	FIX_SIZE,
+
+} fix_kind;
+
+/** A problem to repair. */
+typedef struct fsck_fix {
+	fix_kind kind;
+	/** Inode of the directory or file. */
+	a1fs_ino_t ino;
+	/** FIX_ENTRY: block of the entry; FIX_EXTENT: extent slot; FIX_SIZE: new size. */
+	uint64_t where;
+	/** FIX_ENTRY: byte offset of the entry in the block. */
+	uint32_t off;
+
+} fsck_fix;
+
+/** A fragment run, checked against the others once all are known. */
+typedef struct fsck_frag {
+	/** Block of the run (relative to the first data block). */
+	uint64_t block;
+	/** Fragments of the block in the run. */
+	uint8_t mask;
+	/** Inode of the file. */
+	a1fs_ino_t ino;
+
+} fsck_frag;
+
+/** Reachability of an inode from the root directory. */
+enum {
+	REACH_UNKNOWN,
+	REACH_VISITING,
+	REACH_YES,
+	REACH_NO,
+};
+
+/** State of the check. */
+typedef struct fsck_ctx {
+	const fsck_opts *opts;
+	void *image;
+	size_t size;
+	a1fs_superblock *sb;
+
+	/** The metadata areas, as in fs_ctx::layout. */
+	unsigned char *inode_bitmap;
+	unsigned char *block_bitmap;
+	a1fs_extent *extents;
+	uint64_t extent_count;
+	a1fs_inode *inodes;
+	uint64_t data_start;
+	/** Group descriptors; NULL if the image has none. */
+	a1fs_group_desc *descs;
+	uint64_t group_count;
+	uint64_t group_inodes;
+
+	/** Per inode: the lowest numbered directory with an entry for it. */
+	uint32_t *parent;
+	/** Per inode: the number of entries for it. */
+	uint32_t *refs;
+	/** Per inode: REACH_* */
+	uint8_t *reach;
+	/** Inodes that should be marked in use. */
+	uint64_t *inode_map;
+	/** Data blocks in use by reachable files. */
+	uint64_t *block_map;
+	/** Extent table entries in use by reachable files. */
+	uint64_t *extent_map;
+	/** Per group: the number of reachable directories. */
+	uint32_t *dirs;
+
+	/** Next chunk of the inode table for a worker. */
+	uint64_t next_chunk;
+	/** Phase the workers are in (1 or 2). */
+	int phase;
+
+	/** Guards everything below. */
+	pthread_mutex_t lock;
+	fsck_fix *fixes;
+	size_t fix_count;
+	size_t fix_capacity;
+	fsck_frag *frags;
+	size_t frag_count;
+	size_t frag_capacity;
+	/** Problems found that -y repairs, and ones it doesn't. */
+	uint64_t fixable;
+	uint64_t unfixable;
+	/** Problems printed so far. */
+	uint64_t printed;
+
+} fsck_ctx;
+
+
+/** Whether bit i of a bitmap made of 64-bit words is set. */
+static inline bool test_bit(const uint64_t *map, uint64_t i)
+{
+	return map[i / 64] >> (i % 64) & 1;
+}
+
+/** Set bit i of a bitmap shared by the workers; returns whether it was set before. */
+static inline bool set_bit(uint64_t *map, uint64_t i)
+{
+	uint64_t mask = 1ull << (i % 64);
+	return __atomic_fetch_or(&map[i / 64], mask, __ATOMIC_RELAXED) & mask;
+}
+
+/** Whether bit i of an on-disk bitmap is set. */
+static inline bool disk_bit(const unsigned char *bitmap, uint64_t i)
+{
+	return bitmap[i / 8] >> (i % 8) & 1;
+}
+
+/** Descriptor flags of the group of inode i (0 if there are no descriptors). */
+static inline uint32_t inode_flags(const fsck_ctx *ck, uint64_t i)
+{
+	return ck->descs ? ck->descs[i / ck->group_inodes].flags : 0;
+}
+
+
+/** Print a problem, unless enough of them have been printed already. */
+static void report(fsck_ctx *ck, bool fixable, const char *fmt, ...)
+{
+	pthread_mutex_lock(&ck->lock);
+	if (fixable) {
+		ck->fixable++;
+	} else {
+		ck->unfixable++;
+	}
+	if (ck->opts->verbose || ck->printed < FSCK_REPORT_MAX) {
+		va_list args;
+		va_start(args, fmt);
+		vprintf(fmt, args);
+		va_end(args);
+		printf(fixable && ck->opts->repair ? " - repaired\n" : "\n");
+	} else if (ck->printed == FSCK_REPORT_MAX) {
+		printf("... (use -v to list every problem)\n");
+	}
+	ck->printed++;
+	pthread_mutex_unlock(&ck->lock);
+}
+
+/** Record a problem to repair after the scan. */
+static void add_fix(fsck_ctx *ck, fix_kind kind, a1fs_ino_t ino, uint64_t where, uint32_t off)
+{
+	pthread_mutex_lock(&ck->lock);
+	if (ck->fix_count == ck->fix_capacity) {
+		size_t capacity = ck->fix_capacity ? ck->fix_capacity * 2 : 64;
+		fsck_fix *fixes = realloc(ck->fixes, capacity * sizeof(fsck_fix));
+		if (fixes == NULL) { // The problem is still reported, just not repaired
+			pthread_mutex_unlock(&ck->lock);
+			return;
+		}
+		ck->fixes = fixes;
+		ck->fix_capacity = capacity;
+	}
+	ck->fixes[ck->fix_count++] = (fsck_fix){kind, ino, where, off};
+	pthread_mutex_unlock(&ck->lock);
+}
+
+/** Record a fragment run; returns false if memory runs out. */
+static bool add_frag(fsck_ctx *ck, uint64_t block, uint8_t mask, a1fs_ino_t ino)
+{
+	pthread_mutex_lock(&ck->lock);
+	if (ck->frag_count == ck->frag_capacity) {
+		size_t capacity = ck->frag_capacity ? ck->frag_capacity * 2 : 256;
+		fsck_frag *frags = realloc(ck->frags, capacity * sizeof(fsck_frag));
+		if (frags == NULL) {
+			pthread_mutex_unlock(&ck->lock);
+			return false;
+		}
+		ck->frags = frags;
+		ck->frag_capacity = capacity;
+	}
+	ck->frags[ck->frag_count++] = (fsck_frag){block, mask, ino};
+	pthread_mutex_unlock(&ck->lock);
+	return true;
+}
+
+
+/**
+ * Resolve the metadata areas the way a1fs does (see init_layout() in
+ * fs_ctx.c), including the original fixed layout of older images.
+ */
+static bool fsck_layout(fsck_ctx *ck)
+{
+	a1fs_superblock *sb = ck->sb;
+	uint64_t inode_bitmap_start = 1, block_bitmap_start = 2, block_bitmap_blocks = 1;
+	uint64_t inode_bitmap_blocks = 1, extent_table_start = 3, extent_table_blocks = 1;
+	uint64_t inode_table_start = 4, data_start = 4 + sb->inode_blocks, extent_table_uninit = 0;
+	if (sb->inode_bitmap_start != 0) {
+		inode_bitmap_start = sb->inode_bitmap_start;
+		inode_bitmap_blocks = sb->inode_bitmap_blocks;
+		block_bitmap_start = sb->block_bitmap_start;
+		block_bitmap_blocks = sb->block_bitmap_blocks;
+		extent_table_start = sb->extent_table_start;
+		extent_table_blocks = sb->extent_table_blocks;
+		extent_table_uninit = sb->extent_table_uninit;
+		inode_table_start = sb->inode_table_start;
+		data_start = sb->data_start;
+	}
+	uint64_t bits = (uint64_t)A1FS_BLOCK_SIZE * 8;
+	uint64_t image_blocks = ck->size / A1FS_BLOCK_SIZE;
+	if (sb->inode_count > inode_bitmap_blocks * bits || sb->data_block_count > block_bitmap_blocks * bits ||
+	    extent_table_uninit >= extent_table_blocks || sb->inode_count * sizeof(a1fs_inode) > sb->inode_blocks * A1FS_BLOCK_SIZE ||
+	    inode_table_start + sb->inode_blocks > image_blocks || data_start + sb->data_block_count > image_blocks) {
+		fprintf(stderr, "The superblock describes areas that don't fit in the image\n");
+		return false;
+	}
+	if (sb->inode_count < 2 || sb->data_block_count < 2 || data_start + sb->data_block_count > UINT32_MAX) {
+		fprintf(stderr, "The superblock has invalid counts\n");
+		return false;
+	}
+
+	ck->inode_bitmap = (unsigned char *)ck->image + A1FS_BLOCK_SIZE * inode_bitmap_start;
+	ck->block_bitmap = (unsigned char *)ck->image + A1FS_BLOCK_SIZE * block_bitmap_start;
+	ck->extents = (a1fs_extent *)((char *)ck->image + A1FS_BLOCK_SIZE * extent_table_start);
+	ck->extent_count = (extent_table_blocks - extent_table_uninit) * (A1FS_BLOCK_SIZE / sizeof(a1fs_extent));
+	ck->inodes = (a1fs_inode *)((char *)ck->image + A1FS_BLOCK_SIZE * inode_table_start);
+	ck->data_start = data_start;
+
+	if (sb->group_desc_start != 0) {
+		ck->group_count = sb->group_count;
+		ck->group_inodes = sb->group_inodes;
+		if (ck->group_count == 0 || ck->group_inodes == 0 || ck->group_inodes % 64 != 0 ||
+		    ck->group_count * A1FS_GROUP_BLOCKS < sb->data_block_count ||
+		    ck->group_count * ck->group_inodes < sb->inode_count ||
+		    ck->group_count * sizeof(a1fs_group_desc) > sb->group_desc_blocks * A1FS_BLOCK_SIZE ||
+		    sb->group_desc_start + sb->group_desc_blocks > image_blocks) {
+			fprintf(stderr, "The superblock describes invalid block groups\n");
+			return false;
+		}
+		ck->descs = (a1fs_group_desc *)((char *)ck->image + A1FS_BLOCK_SIZE * sb->group_desc_start);
+	}
+	return true;
+}
+
+/** Allocate the maps filled in by the scan. */
+static bool fsck_alloc(fsck_ctx *ck)
+{
+	uint64_t inodes = ck->sb->inode_count;
+	ck->parent = malloc(inodes * sizeof(uint32_t));
+	ck->refs = calloc(inodes, sizeof(uint32_t));
+	ck->reach = calloc(inodes, sizeof(uint8_t));
+	ck->inode_map = calloc((inodes + 63) / 64, sizeof(uint64_t));
+	ck->block_map = calloc((ck->sb->data_block_count + 63) / 64, sizeof(uint64_t));
+	ck->extent_map = calloc((ck->extent_count + 63) / 64, sizeof(uint64_t));
+	ck->dirs = calloc(ck->group_count ? ck->group_count : 1, sizeof(uint32_t));
+	if (!ck->parent || !ck->refs || !ck->reach || !ck->inode_map || !ck->block_map || !ck->extent_map || !ck->dirs) {
+		fprintf(stderr, "Out of memory\n");
+		return false;
+	}
+	for (uint64_t i = 0; i < inodes; i++) {
+		ck->parent[i] = NO_PARENT;
+	}
+	return true;
+}
+
+static void fsck_free(fsck_ctx *ck)
+{
+	free(ck->parent);
+	free(ck->refs);
+	free(ck->reach);
+	free(ck->inode_map);
+	free(ck->block_map);
+	free(ck->extent_map);
+	free(ck->dirs);
+	free(ck->fixes);
+	free(ck->frags);
+	pthread_mutex_destroy(&ck->lock);
+}
+
+
+/**
+ * Whether an inode holds a file or directory: its bit is set in a group that
+ * has been initialized, and it has a file type a1fs creates. Inode 1 is
+ * reserved and never holds one.
+ */
+static bool in_use(const fsck_ctx *ck, uint64_t ino)
+{
+	if (ino >= ck->sb->inode_count || ino == 1) return false;
+	if ((inode_flags(ck, ino) & A1FS_GROUP_INODE_UNINIT) || !disk_bit(ck->inode_bitmap, ino)) return false;
+	mode_t mode = ck->inodes[ino].mode & ~A1FS_S_INLINE;
+	if (S_ISDIR(mode)) return !(ck->inodes[ino].mode & A1FS_S_INLINE);
+	return S_ISREG(mode);
+}
+
+/** Whether an extent table entry is a valid extent or fragment run. */
+static bool extent_ok(const fsck_ctx *ck, const a1fs_extent *extent)
+{
+	uint64_t end = ck->data_start + ck->sb->data_block_count;
+	if (extent->start < ck->data_start || extent->start >= end) return false;
+	if (extent->count & A1FS_EXTENT_FRAG) {
+		unsigned int first = A1FS_FRAG_FIRST(extent->count), n = A1FS_FRAG_COUNT(extent->count);
+		return (extent->count & ~A1FS_FRAG_RUN(0xff, 0xff)) == 0 && n > 0 && first + n <= A1FS_FRAGS_PER_BLOCK;
+	}
+	return extent->count > 0 && extent->start + (uint64_t)extent->count <= end;
+}
+
+/** Extent table entry of an extent slot of an inode; NULL if it's out of the table or invalid. */
+static const a1fs_extent *slot_extent(const fsck_ctx *ck, const a1fs_inode *inode, int slot)
+{
+	uint32_t n = inode->extent_number[slot];
+	if (n == 0 || n - 1 >= ck->extent_count) return NULL;
+	return extent_ok(ck, &ck->extents[n - 1]) ? &ck->extents[n - 1] : NULL;
+}
+
+
+/** Phase 1: read the entries of a directory. */
+static void scan_dir(fsck_ctx *ck, a1fs_ino_t dir)
+{
+	const a1fs_inode *inode = &ck->inodes[dir];
+	uint32_t inode_count = ck->sb->inode_count;
+	for (int slot = 0; slot < 24; slot++) {
+		const a1fs_extent *extent = slot_extent(ck, inode, slot);
+		if (extent == NULL || (extent->count & A1FS_EXTENT_FRAG)) continue; // Reported in phase 2
+		for (uint32_t b = 0; b < extent->count; b++) {
+			a1fs_blk_t block = extent->start + b;
+			const void *data = (const char *)ck->image + (uint64_t)A1FS_BLOCK_SIZE * block;
+			uint32_t cursor = 0;
+			dirblk_ent ent;
+			while (dirblk_next(data, inode_count, &cursor, &ent)) {
+				if (strcmp(ent.name, ".") == 0 || strcmp(ent.name, "..") == 0) {
+					continue; // a1fs doesn't follow them
+				}
+				if (!in_use(ck, ent.ino)) {
+					report(ck, true, "directory %" PRIu32 ": entry \"%s\" is for inode %" PRIu32 ", which is not in use",
+					       dir, ent.name, ent.ino);
+					add_fix(ck, FIX_ENTRY, dir, block, ent.off);
+					continue;
+				}
+				__atomic_fetch_add(&ck->refs[ent.ino], 1, __ATOMIC_RELAXED);
+				uint32_t cur = __atomic_load_n(&ck->parent[ent.ino], __ATOMIC_RELAXED);
+				while (dir < cur && !__atomic_compare_exchange_n(&ck->parent[ent.ino], &cur, dir, true,
+				                                                 __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+			}
+		}
+	}
+}
+
+/** Phase 2: mark the extents and blocks of a reachable file or directory. */
+static void mark_inode(fsck_ctx *ck, a1fs_ino_t ino)
+{
+	a1fs_inode *inode = &ck->inodes[ino];
+	set_bit(ck->inode_map, ino);
+	if (S_ISDIR(inode->mode) && ck->group_count) {
+		__atomic_fetch_add(&ck->dirs[ino / ck->group_inodes], 1, __ATOMIC_RELAXED);
+	}
+	if (inode->mode & A1FS_S_INLINE) {
+		if (inode->size > A1FS_INLINE_MAX) {
+			report(ck, true, "inode %" PRIu32 ": inline file of %" PRIu64 " bytes", ino, inode->size);
+			add_fix(ck, FIX_SIZE, ino, A1FS_INLINE_MAX, 0);
+		}
+		return;
+	}
+
+	uint64_t capacity = 0;
+	for (int slot = 0; slot < 24; slot++) {
+		uint32_t n = inode->extent_number[slot];
+		if (n == 0) continue;
+		const a1fs_extent *extent = slot_extent(ck, inode, slot);
+		if (extent == NULL) {
+			report(ck, true, "inode %" PRIu32 ": extent %" PRIu32 " is out of the image", ino, n);
+			add_fix(ck, FIX_EXTENT, ino, slot, 0);
+			continue;
+		}
+		if (set_bit(ck->extent_map, n - 1)) {
+			report(ck, false, "inode %" PRIu32 ": extent %" PRIu32 " is also used by another file", ino, n);
+			continue;
+		}
+		uint64_t first = extent->start - ck->data_start;
+		if (extent->count & A1FS_EXTENT_FRAG) { // Checked against the other runs at the end
+			unsigned int n_frags = A1FS_FRAG_COUNT(extent->count);
+			uint8_t mask = ((1u << n_frags) - 1) << A1FS_FRAG_FIRST(extent->count);
+			if (!add_frag(ck, first, mask, ino)) {
+				report(ck, false, "inode %" PRIu32 ": out of memory for fragment runs", ino);
+			}
+			capacity += (uint64_t)n_frags * A1FS_FRAG_SIZE;
+			continue;
+		}
+		uint64_t shared = 0;
+		for (uint64_t b = first; b < first + extent->count; b++) {
+			if (set_bit(ck->block_map, b)) shared++;
+		}
+		if (shared) {
+			report(ck, false, "inode %" PRIu32 ": %" PRIu64 " blocks of extent %" PRIu32 " are also used by another file",
+			       ino, shared, n);
+		}
+		capacity += (uint64_t)extent->count * A1FS_BLOCK_SIZE;
+	}
+	if (S_ISREG(inode->mode) && inode->size > capacity) {
+		report(ck, true, "inode %" PRIu32 ": size %" PRIu64 " is past the end of its %" PRIu64 " bytes of blocks",
+		       ino, inode->size, capacity);
+		add_fix(ck, FIX_SIZE, ino, capacity, 0);
+	}
+}
+
+/** Worker thread: take chunks of the inode table until none are left. */
+static void *fsck_worker(void *arg)
+{
+	fsck_ctx *ck = arg;
+	uint64_t inodes = ck->sb->inode_count;
+	for (;;) {
+		uint64_t first = __atomic_fetch_add(&ck->next_chunk, FSCK_CHUNK, __ATOMIC_RELAXED);
+		if (first >= inodes) break;
+		uint64_t end = first + FSCK_CHUNK < inodes ? first + FSCK_CHUNK : inodes;
+		for (uint64_t ino = first; ino < end; ino++) {
+			if (ck->phase == 1) {
+				if (in_use(ck, ino) && S_ISDIR(ck->inodes[ino].mode)) scan_dir(ck, ino);
+			} else if (ck->reach[ino] == REACH_YES) {
+				mark_inode(ck, ino);
+			}
+		}
+	}
+	return NULL;
+}
+
+/** Run a phase on the worker threads. */
+static void run_phase(fsck_ctx *ck, int phase, unsigned int threads)
+{
+	ck->phase = phase;
+	ck->next_chunk = 0;
+	pthread_t tids[threads];
+	unsigned int started = 0;
+	for (; started < threads; started++) {
+		if (pthread_create(&tids[started], NULL, fsck_worker, ck) != 0) break;
+	}
+	if (started == 0) { // Do it all on this thread
+		fsck_worker(ck);
+	}
+	for (unsigned int i = 0; i < started; i++) {
+		pthread_join(tids[i], NULL);
+	}
+}
+
+
+/**
+ * Work out which inodes are reachable from the root directory by following
+ * the parent of each up to the root. Directory loops cut off from the root
+ * are unreachable. Inodes on the orphan list are kept as well; a1fs frees
+ * them after the next mount.
+ */
+static void find_reachable(fsck_ctx *ck)
+{
+	uint64_t inodes = ck->sb->inode_count;
+	uint32_t *path = malloc(inodes * sizeof(uint32_t));
+	ck->reach[0] = REACH_YES;
+	for (uint64_t i = 1; i < inodes; i++) {
+		if (ck->reach[i] != REACH_UNKNOWN) continue;
+		if (!in_use(ck, i)) {
+			ck->reach[i] = REACH_NO;
+			continue;
+		}
+		// Walk up until an inode whose fate is known
+		size_t len = 0;
+		uint32_t cur = i;
+		while (cur != NO_PARENT && ck->reach[cur] == REACH_UNKNOWN) {
+			ck->reach[cur] = REACH_VISITING;
+			if (path) path[len++] = cur;
+			cur = ck->parent[cur];
+		}
+		uint8_t result = (cur != NO_PARENT && ck->reach[cur] == REACH_YES) ? REACH_YES : REACH_NO;
+		if (path) {
+			for (size_t k = 0; k < len; k++) ck->reach[path[k]] = result;
+		} else { // No memory for the path; walk it again
+			for (cur = i; cur != NO_PARENT && ck->reach[cur] == REACH_VISITING; cur = ck->parent[cur]) {
+				ck->reach[cur] = result;
+			}
+		}
+	}
+	free(path);
+
+	for (uint64_t i = 1; i < inodes; i++) {
+		if (ck->reach[i] == REACH_YES && ck->refs[i] > 1) {
+			report(ck, false, "inode %" PRIu64 " has %" PRIu32 " directory entries", i, ck->refs[i]);
+		}
+	}
+	a1fs_superblock *sb = ck->sb;
+	for (uint64_t k = 0; k < sb->orphan_count && k < A1FS_ORPHAN_MAX; k++) {
+		a1fs_ino_t ino = sb->orphans[k];
+		if (in_use(ck, ino) && ino != 0 && ck->reach[ino] == REACH_NO) {
+			ck->reach[ino] = REACH_YES;
+		}
+	}
+}
+
+/** Check the orphan list; bad entries are dropped with -y. */
+static void check_orphans(fsck_ctx *ck)
+{
+	a1fs_superblock *sb = ck->sb;
+	if (sb->orphan_count > A1FS_ORPHAN_MAX) {
+		report(ck, true, "orphan list has %" PRIu64 " inodes", sb->orphan_count);
+		if (ck->opts->repair) sb->orphan_count = A1FS_ORPHAN_MAX;
+	}
+	uint64_t kept = 0;
+	for (uint64_t k = 0; k < sb->orphan_count; k++) {
+		a1fs_ino_t ino = sb->orphans[k];
+		if (!in_use(ck, ino) || ino == 0 || ck->refs[ino] > 0) {
+			report(ck, true, "orphan list: inode %" PRIu32 " is %s", ino,
+			       in_use(ck, ino) && ino != 0 ? "still linked" : "not in use");
+			continue;
+		}
+		if (ck->opts->repair) sb->orphans[kept] = ino;
+		kept++;
+	}
+	if (ck->opts->repair) sb->orphan_count = kept;
+}
+
+/** Check the fragment runs against each other and against whole blocks. */
+static int cmp_frag(const void *a, const void *b)
+{
+	const fsck_frag *x = a, *y = b;
+	return x->block < y->block ? -1 : x->block > y->block;
+}
+
+static void check_frags(fsck_ctx *ck)
+{
+	qsort(ck->frags, ck->frag_count, sizeof(fsck_frag), cmp_frag);
+	for (size_t i = 0; i < ck->frag_count;) {
+		uint64_t block = ck->frags[i].block;
+		if (test_bit(ck->block_map, block)) {
+			report(ck, false, "inode %" PRIu32 ": block %" PRIu64 " of its tail is also used by another file",
+			       ck->frags[i].ino, block + ck->data_start);
+		}
+		uint8_t used = 0;
+		for (; i < ck->frag_count && ck->frags[i].block == block; i++) {
+			if (used & ck->frags[i].mask) {
+				report(ck, false, "inode %" PRIu32 ": fragments of its tail in block %" PRIu64 " are also used by another file",
+				       ck->frags[i].ino, block + ck->data_start);
+			}
+			used |= ck->frags[i].mask;
+		}
+		set_bit(ck->block_map, block);
+	}
+}
+
+
+/** Apply the repairs recorded during the scan. */
+static void apply_fixes(fsck_ctx *ck)
+{
+	for (size_t i = 0; i < ck->fix_count; i++) {
+		const fsck_fix *fix = &ck->fixes[i];
+		a1fs_inode *inode = &ck->inodes[fix->ino];
+		if (ck->reach[fix->ino] != REACH_YES) continue; // Being freed anyway
+		switch (fix->kind) {
+			case FIX_ENTRY: {
+				void *block = (char *)ck->image + (uint64_t)A1FS_BLOCK_SIZE * fix->where;
+				size_t bytes = dirblk_remove(block, ck->sb->inode_count, fix->off);
+				inode->size = inode->size > bytes ? inode->size - bytes : 0;
+				break;
+			}
+			case FIX_EXTENT:
+				inode->extent_number[fix->where] = 0;
+				break;
+			case FIX_SIZE:
+				inode->size = fix->where;
+				break;
+		}
+	}
+}
+
+/** Mask of the bits of word w of a bitmap that are below end. */
+static inline uint64_t word_mask(uint64_t w, uint64_t end)
+{
+	return end - w * 64 >= 64 ? ~0ull : (1ull << (end - w * 64)) - 1;
+}
+
+/** Number of set bits of a bitmap in [first, end); first is a multiple of 64. */
+static uint64_t count_set(const uint64_t *map, uint64_t first, uint64_t end)
+{
+	uint64_t n = 0;
+	for (uint64_t w = first / 64; w * 64 < end; w++) {
+		n += __builtin_popcountll(map[w] & word_mask(w, end));
+	}
+	return n;
+}
+
+/**
+ * Compare a bitmap with what the scan found, and rewrite it with -y. Groups
+ * that were never initialized are expected to have nothing in use; if the
+ * scan found something there, the whole group's part is written. Groups are
+ * compared a word at a time (their sizes are multiples of 64).
+ *
+ * @return  number of bits that differ.
+ */
+static uint64_t check_bitmap(fsck_ctx *ck, unsigned char *bitmap, const uint64_t *expected, uint64_t nbits,
+                             uint64_t group_bits, uint32_t uninit, const char *what)
+{
+	if (!ck->descs) group_bits = nbits;
+	uint64_t leaked = 0, missing = 0;
+	for (uint64_t first = 0; first < nbits; first += group_bits) {
+		uint64_t end = nbits - first < group_bits ? nbits : first + group_bits;
+		bool skip = ck->descs && (ck->descs[first / group_bits].flags & uninit);
+		for (uint64_t w = first / 64; w * 64 < end; w++) {
+			uint64_t disk = 0;
+			if (!skip) memcpy(&disk, bitmap + w * 8, (end - w * 64 + 7) / 8 < 8 ? (end - w * 64 + 7) / 8 : 8);
+			disk &= word_mask(w, end);
+			uint64_t want = expected[w] & word_mask(w, end);
+			if (disk == want) continue;
+			leaked += __builtin_popcountll(disk & ~want);
+			missing += __builtin_popcountll(want & ~disk);
+			for (uint64_t diff = disk ^ want; diff && ck->opts->verbose; diff &= diff - 1) {
+				uint64_t i = w * 64 + __builtin_ctzll(diff);
+				printf("%s %" PRIu64 " is marked %s\n", what, i,
+				       disk_bit(bitmap, i) && !skip ? "in use but is unreachable" : "free but is in use");
+			}
+		}
+	}
+	if (leaked) report(ck, true, "%" PRIu64 " %ss are marked in use but are unreachable", leaked, what);
+	if (missing) report(ck, true, "%" PRIu64 " %ss are marked free but are in use", missing, what);
+
+	if (ck->opts->repair && (leaked || missing)) {
+		for (uint64_t first = 0; first < nbits; first += group_bits) {
+			uint64_t end = nbits - first < group_bits ? nbits : first + group_bits;
+			a1fs_group_desc *desc = ck->descs ? &ck->descs[first / group_bits] : NULL;
+			if (desc && (desc->flags & uninit) && count_set(expected, first, end) == 0) continue;
+			memcpy(bitmap + first / 8, (const unsigned char *)expected + first / 8, (end - first + 7) / 8);
+			if (desc) desc->flags &= ~uninit;
+		}
+	}
+	return leaked + missing;
+}
+
+/** Compare a number stored in the image with the right one, and fix it with -y. */
+static void check_count(fsck_ctx *ck, void *field, size_t size, uint64_t want, const char *fmt, ...)
+{
+	uint64_t have = size == sizeof(uint32_t) ? *(uint32_t *)field : *(uint64_t *)field;
+	if (have == want) return;
+	char what[128];
+	va_list args;
+	va_start(args, fmt);
+	vsnprintf(what, sizeof(what), fmt, args);
+	va_end(args);
+	report(ck, true, "%s is %" PRIu64 " instead of %" PRIu64, what, have, want);
+	if (!ck->opts->repair) return;
+	if (size == sizeof(uint32_t)) {
+		*(uint32_t *)field = want;
+	} else {
+		*(uint64_t *)field = want;
+	}
+}
+
+/** First clear bit of a bitmap in [first, end), as an offset from first; end - first if none. */
+static uint64_t first_clear(const uint64_t *map, uint64_t first, uint64_t end)
+{
+	for (uint64_t w = first / 64; w * 64 < end; w++) {
+		uint64_t clear = ~map[w] & word_mask(w, end);
+		if (clear) return w * 64 + __builtin_ctzll(clear) - first;
+	}
+	return end - first;
+}
+
+/** Check the extent table, the bitmaps, the group descriptors and the counters. */
+static void check_summary(fsck_ctx *ck)
+{
+	a1fs_superblock *sb = ck->sb;
+	uint64_t used_extents = 0;
+	for (uint64_t i = 0; i < ck->extent_count; i++) {
+		if (test_bit(ck->extent_map, i)) {
+			used_extents++;
+		} else if (ck->extents[i].start != 0) {
+			report(ck, true, "extent %" PRIu64 " is not used by any file", i + 1);
+			if (ck->opts->repair) ck->extents[i] = (a1fs_extent){0, 0};
+		}
+	}
+	check_count(ck, &sb->reserved_extent_number, sizeof(uint64_t), used_extents, "number of extents in use");
+
+	// Reserved: inode 1 and data block 1 (see mkfs)
+	set_bit(ck->inode_map, 1);
+	set_bit(ck->block_map, 1);
+	check_bitmap(ck, ck->inode_bitmap, ck->inode_map, sb->inode_count, ck->group_inodes, A1FS_GROUP_INODE_UNINIT, "inode");
+	check_bitmap(ck, ck->block_bitmap, ck->block_map, sb->data_block_count, A1FS_GROUP_BLOCKS, A1FS_GROUP_BLOCK_UNINIT, "block");
+
+	uint64_t free_blocks = 0, free_inodes = 0;
+	for (uint64_t g = 0; g < (ck->descs ? ck->group_count : 0); g++) {
+		a1fs_group_desc *desc = &ck->descs[g];
+		uint64_t fb = g * A1FS_GROUP_BLOCKS, eb = fb + A1FS_GROUP_BLOCKS;
+		uint64_t fi = g * ck->group_inodes, ei = fi + ck->group_inodes;
+		if (eb > sb->data_block_count) eb = fb < sb->data_block_count ? sb->data_block_count : fb;
+		if (ei > sb->inode_count) ei = fi < sb->inode_count ? sb->inode_count : fi;
+		uint64_t blocks = (eb - fb) - count_set(ck->block_map, fb, eb);
+		uint64_t inodes = (ei - fi) - count_set(ck->inode_map, fi, ei);
+		free_blocks += blocks;
+		free_inodes += inodes;
+		check_count(ck, &desc->free_blocks, sizeof(uint32_t), blocks, "group %" PRIu64 ": free blocks", g);
+		check_count(ck, &desc->free_inodes, sizeof(uint32_t), inodes, "group %" PRIu64 ": free inodes", g);
+		check_count(ck, &desc->dirs, sizeof(uint32_t), ck->dirs[g], "group %" PRIu64 ": directories", g);
+		// The hints only need to be at or before the first free bit
+		uint64_t block_hint = first_clear(ck->block_map, fb, eb);
+		uint64_t inode_hint = first_clear(ck->inode_map, fi, ei);
+		if (desc->first_free_block > block_hint) {
+			check_count(ck, &desc->first_free_block, sizeof(uint32_t), block_hint, "group %" PRIu64 ": first free block", g);
+		}
+		if (desc->first_free_inode > inode_hint) {
+			check_count(ck, &desc->first_free_inode, sizeof(uint32_t), inode_hint, "group %" PRIu64 ": first free inode", g);
+		}
+	}
+	if (!ck->descs) {
+		free_blocks = sb->data_block_count - count_set(ck->block_map, 0, sb->data_block_count);
+		free_inodes = sb->inode_count - count_set(ck->inode_map, 0, sb->inode_count);
+	}
+	// a1fs only brings these up to date from the descriptors at unmount
+	if (sb->clean || !ck->descs) {
+		check_count(ck, &sb->free_data_block_count, sizeof(uint64_t), free_blocks, "free block count");
+		check_count(ck, &sb->free_inodes_count, sizeof(uint64_t), free_inodes, "free inode count");
+	} else if (ck->opts->repair) {
+		sb->free_data_block_count = free_blocks;
+		sb->free_inodes_count = free_inodes;
+	}
+}
+
+
+/**
+ * Check the image.
+ *
+ * @return  exit status, one of FSCK_*.
+ */
+static int fsck(void *image, size_t size, const fsck_opts *opts)
+{
+	fsck_ctx ck = {0};
+	ck.opts = opts;
+	ck.image = image;
+	ck.size = size;
+	ck.sb = (a1fs_superblock *)image;
+	pthread_mutex_init(&ck.lock, NULL);
+
+	a1fs_superblock *sb = ck.sb;
+	int ret = FSCK_FAILED;
+	if (sb->magic != A1FS_MAGIC) {
+		fprintf(stderr, "The image doesn't contain a1fs\n");
+		goto end;
+	}
+	uint64_t block_size = sb->block_size ? sb->block_size : 4096;
+	if (block_size != A1FS_BLOCK_SIZE) {
+		fprintf(stderr, "The image has %" PRIu64 "-byte blocks; this a1fsck is built for %d-byte blocks\n",
+		        block_size, A1FS_BLOCK_SIZE);
+		goto end;
+	}
+	if (!fsck_layout(&ck) || !fsck_alloc(&ck)) goto end;
+	if (!in_use(&ck, 0) || !S_ISDIR(ck.inodes[0].mode)) {
+		fprintf(stderr, "The root directory is missing\n");
+		goto end;
+	}
+	if (!sb->clean && sb->group_desc_start != 0) {
+		printf("The file system was not unmounted cleanly\n");
+	}
+
+	unsigned int threads = opts->threads;
+	if (threads == 0) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = cpus > 0 ? cpus : 1;
+	}
+	if (threads > 64) threads = 64;
+	// The inode table is read front to back, a chunk per worker at a time
+	madvise(ck.inodes, sb->inode_blocks * A1FS_BLOCK_SIZE, MADV_SEQUENTIAL);
+
+	run_phase(&ck, 1, threads);
+	find_reachable(&ck);
+	check_orphans(&ck);
+	run_phase(&ck, 2, threads);
+	check_frags(&ck);
+	if (opts->repair) apply_fixes(&ck);
+	check_summary(&ck);
+
+	if (opts->repair) sb->clean = 1;
+	uint64_t used_inodes = count_set(ck.inode_map, 0, sb->inode_count);
+	uint64_t used_blocks = count_set(ck.block_map, 0, sb->data_block_count);
+	printf("%s: %" PRIu64 "/%" PRIu64 " inodes, %" PRIu64 "/%" PRIu64 " blocks, %" PRIu64 " problems",
+	       opts->img_path, used_inodes, (uint64_t)sb->inode_count, used_blocks, (uint64_t)sb->data_block_count,
+	       ck.fixable + ck.unfixable);
+	if (ck.fixable + ck.unfixable == 0) {
+		printf("\n");
+		ret = FSCK_OK;
+	} else if (opts->repair) {
+		printf(" (%" PRIu64 " repaired)\n", ck.fixable);
+		ret = ck.unfixable ? FSCK_ERRORS : FSCK_REPAIRED;
+	} else {
+		printf(" (%" PRIu64 " can be repaired with -y)\n", ck.fixable);
+		ret = FSCK_ERRORS;
+	}
+
+end:
+	fsck_free(&ck);
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	fsck_opts opts = {0};// defaults are all 0
+	if (!parse_args(argc, argv, &opts)) {
+		// Invalid arguments, print help to stderr
+		print_help(stderr, argv[0]);
+		return FSCK_FAILED;
+	}
+
+	if (opts.help) {
+		// Help requested, print it to stdout
+		print_help(stdout, argv[0]);
+		return FSCK_OK;
+	}
+
+	// Map image file into memory
+	size_t size;
+	void *image = map_file(opts.img_path, A1FS_BLOCK_SIZE, &size, NULL);
+	if (image == NULL) return FSCK_FAILED;
+
+	int ret = fsck(image, size, &opts);
+	if (opts.repair && ret != FSCK_FAILED && msync(image, size, MS_SYNC) < 0) {
+		perror("msync");
+		ret = FSCK_FAILED;
+	}
+	munmap(image, size);
+	return ret;
+}
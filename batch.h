@@ -0,0 +1,88 @@
+/*
+ * This code is provided solely for the personal and private use of students
+ * taking the CSC369H course at the University of Toronto. Copying for purposes
+ * other than this use is expressly prohibited. All forms of distribution of
+ * this code, including but not limited to public repositories on GitHub,
+ * GitLab, Bitbucket, or any other online platform, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Alexey Khrabrov, Karen Reid
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2019 Karen Reid
+ */
+
+
+/**
+ * CSC369 Assignment 1 - Batch create/unlink ioctl interface.
+ *
+ * Shared by the a1fs driver and the programs that issue the ioctls.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/ioctl.h>
+
+
+/**
+ * Size of the record area of a batch. The whole structure must stay below
+ * 16 KiB, the largest size an ioctl command number can encode.
+ */
+#define A1FS_BATCH_DATA 16368
+
+/**
+ * Argument of the batch ioctls, issued on an open directory.
+ *
+ * The record area holds "count" packed records, each a 2-byte file mode
+ * (little-endian; ignored by unlink), a 1-byte name length and the name
+ * itself, not null-terminated. Records are processed in order until one
+ * fails; on return "count" is the number of records that succeeded and
+ * "error" is the positive errno of the one that failed, or 0.
+ */
+typedef struct a1fs_batch {
+	/** Number of records; on return, number of records done. */
+	uint32_t count;
+	/** On return, errno of the failed record, or 0. */
+	int32_t error;
+	/** Packed records. */
+	unsigned char data[A1FS_BATCH_DATA];
+
+} a1fs_batch;
+
+/** Create regular files with the given names and modes in the directory. */
+#define A1FS_IOC_BATCH_CREATE _IOWR('a', 1, a1fs_batch)
+/** Remove the regular files with the given names from the directory. */
+#define A1FS_IOC_BATCH_UNLINK _IOWR('a', 2, a1fs_batch)
+
+/** Size of a record holding a name of the given length. */
+#define A1FS_BATCH_REC_SIZE(len) (3 + (len))
+
+
+/**
+ * Append a record to a batch.
+ *
+ * @param batch  pointer to the batch.
+ * @param used   bytes of the record area in use; advanced past the record.
+ * @param name   name of the file; null-terminated.
+ * @param mode   mode of the file (for create).
+ * @return       true on success; false if the record does not fit.
+ */
+static inline bool a1fs_batch_add(a1fs_batch *batch, size_t *used, const char *name, uint16_t mode)
+{
+	size_t len = strlen(name);
+	if (len > UINT8_MAX || *used + A1FS_BATCH_REC_SIZE(len) > A1FS_BATCH_DATA) {
+		return false;
+	}
+	unsigned char *rec = batch->data + *used;
+	rec[0] = mode & 0xff;
+	rec[1] = mode >> 8;
+	rec[2] = len;
+	memcpy(rec + 3, name, len);
+	*used += A1FS_BATCH_REC_SIZE(len);
+	batch->count++;
+	return true;
+}
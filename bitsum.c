@@ -0,0 +1,335 @@
+/*
+ * This code is provided solely for the personal and private use of students
+ * taking the CSC369H course at the University of Toronto. Copying for purposes
+ * other than this use is expressly prohibited. All forms of distribution of
+ * this code, including but not limited to public repositories on GitHub,
+ * GitLab, Bitbucket, or any other online platform, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Alexey Khrabrov, Karen Reid
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2019 Karen Reid
+ */
+
+
+/**
+ * CSC369 Assignment 1 - Free space summary implementation.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "bitsum.h"
+
+
+/** Number of 64-bit words that hold n bits. */
+#define WORDS(n) (((n) + 63) / 64)
+
+/** Load a summary word; it may be changed by other threads at any time. */
+static inline uint64_t load(const uint64_t *word)
+{
+	return __atomic_load_n(word, __ATOMIC_SEQ_CST);
+}
+
+/** Word i of the bitmap; bits past the end of the bitmap read as in use. */
+static uint64_t load_word(const bitsum *bs, uint64_t i)
+{
+	const unsigned char *p = bs->bitmap + i * 8;
+	uint64_t word = 0;
+	if ((i + 1) * 64 <= bs->nbits) {
+		for (unsigned int b = 0; b < 8; b++) {
+			word |= (uint64_t)p[b] << (8 * b);
+		}
+		return word;
+	}
+	uint64_t bits = bs->nbits - i * 64;
+	for (unsigned int b = 0; b < (bits + 7) / 8; b++) {
+		word |= (uint64_t)p[b] << (8 * b);
+	}
+	return word | ~0ull << bits;
+}
+
+/** Number of bits in a summary level. */
+static uint64_t level_bits(const bitsum *bs, unsigned int lvl)
+{
+	uint64_t bits = WORDS(bs->nbits);
+	for (unsigned int l = 0; l < lvl; l++) {
+		bits = WORDS(bits);
+	}
+	return bits;
+}
+
+/** Whether what bit i of a summary level stands for has a free bit. */
+static bool below_has_free(const bitsum *bs, unsigned int lvl, uint64_t i)
+{
+	if (lvl == 0) {
+		return ~load_word(bs, i) != 0;
+	}
+	return load(&bs->level[lvl - 1][i]) != 0;
+}
+
+/** Longest run of free bits in a region. */
+static uint32_t region_longest(const bitsum *bs, uint64_t r)
+{
+	uint64_t first = r * (BITSUM_REGION_BITS / 64);
+	uint64_t end = first + BITSUM_REGION_BITS / 64;
+	if (end > WORDS(bs->nbits)) {
+		end = WORDS(bs->nbits);
+	}
+	uint32_t best = 0, cur = 0;
+	for (uint64_t w = first; w < end; w++) {
+		uint64_t used = load_word(bs, w);
+		if (used == 0) {
+			cur += 64;
+			continue;
+		}
+		for (unsigned int b = 0; b < 64; b++) {
+			if (used >> b & 1) {
+				if (cur > best) best = cur;
+				cur = 0;
+			} else {
+				cur++;
+			}
+		}
+	}
+	return cur > best ? cur : best;
+}
+
+/** First bit of the run of free bits that ends a region (its end if none). */
+static uint64_t region_tail(const bitsum *bs, uint64_t r)
+{
+	uint64_t start = r * BITSUM_REGION_BITS;
+	uint64_t end = start + BITSUM_REGION_BITS;
+	if (end > bs->nbits) {
+		end = bs->nbits;
+	}
+	for (uint64_t w = WORDS(end); w-- > start / 64;) {
+		uint64_t used = load_word(bs, w);
+		if ((w + 1) * 64 > end) { // Ignore bits past the end of the region
+			used &= (1ull << (end - w * 64)) - 1;
+		}
+		if (used) {
+			return w * 64 + 64 - __builtin_clzll(used);
+		}
+	}
+	return start;
+}
+
+/** First used bit in [from, limit); limit if there is none. */
+static uint64_t run_end(const bitsum *bs, uint64_t from, uint64_t limit)
+{
+	while (from < limit) {
+		uint64_t used = load_word(bs, from / 64) & ~0ull << (from % 64);
+		if (used) {
+			uint64_t bit = from / 64 * 64 + __builtin_ctzll(used);
+			return bit < limit ? bit : limit;
+		}
+		from = (from / 64 + 1) * 64;
+	}
+	return limit;
+}
+
+/** First set bit at or after bit i of a summary level; -1 if there is none. */
+static int64_t next_set(const bitsum *bs, unsigned int lvl, uint64_t i)
+{
+	uint64_t nbits = level_bits(bs, lvl);
+	while (i < nbits) {
+		uint64_t w = i / 64;
+		uint64_t bits = load(&bs->level[lvl][w]) & ~0ull << (i % 64);
+		if (bits) {
+			return w * 64 + __builtin_ctzll(bits);
+		}
+		if (lvl + 1 == bs->levels) {
+			return -1;
+		}
+		// Skip to the next word the level above says is not 0
+		int64_t up = next_set(bs, lvl + 1, w + 1);
+		if (up < 0) {
+			return -1;
+		}
+		i = (uint64_t)up * 64;
+	}
+	return -1;
+}
+
+/** Bring the summary of bitmap word i up to date, up to the top level. */
+static void update_word(bitsum *bs, uint64_t i)
+{
+	for (unsigned int lvl = 0; lvl < bs->levels; lvl++) {
+		uint64_t *word = &bs->level[lvl][i / 64];
+		uint64_t mask = 1ull << (i % 64);
+		if (below_has_free(bs, lvl, i)) {
+			if (__atomic_fetch_or(word, mask, __ATOMIC_SEQ_CST) != 0) {
+				return; // The levels above already have the word
+			}
+		} else {
+			uint64_t now = __atomic_and_fetch(word, ~mask, __ATOMIC_SEQ_CST);
+			// A bit below may have been freed since it was checked
+			if (below_has_free(bs, lvl, i)) {
+				__atomic_fetch_or(word, mask, __ATOMIC_SEQ_CST);
+				return;
+			}
+			if (now != 0) {
+				return;
+			}
+		}
+		i /= 64;
+	}
+}
+
+
+/** Allocate the levels (and free run lengths) of a summary with no free bits. */
+static bool alloc_levels(bitsum *bs, const unsigned char *bitmap, uint64_t nbits, bool runs)
+{
+	memset(bs, 0, sizeof(*bs));
+	bs->bitmap = bitmap;
+	bs->nbits = nbits;
+
+	uint64_t bits = WORDS(nbits);
+	do {
+		if (bs->levels == BITSUM_MAX_LEVELS) goto fail;
+		bs->level[bs->levels] = calloc(WORDS(bits) ? WORDS(bits) : 1, sizeof(uint64_t));
+		if (bs->level[bs->levels] == NULL) goto fail;
+		bs->levels++;
+		bits = WORDS(bits);
+	} while (bits > 1);
+
+	if (runs) {
+		uint64_t regions = (nbits + BITSUM_REGION_BITS - 1) / BITSUM_REGION_BITS;
+		bs->longest = calloc(regions ? regions : 1, sizeof(uint32_t));
+		if (bs->longest == NULL) goto fail;
+	}
+	return true;
+
+fail:
+	bitsum_destroy(bs);
+	return false;
+}
+
+bool bitsum_init(bitsum *bs, const unsigned char *bitmap, uint64_t nbits, bool runs)
+{
+	if (!alloc_levels(bs, bitmap, nbits, runs)) return false;
+
+	for (uint64_t i = 0; i < WORDS(nbits); i++) {
+		if (~load_word(bs, i) != 0) {
+			bs->level[0][i / 64] |= 1ull << (i % 64);
+		}
+	}
+	for (unsigned int lvl = 1; lvl < bs->levels; lvl++) {
+		for (uint64_t i = 0; i < level_bits(bs, lvl); i++) {
+			if (bs->level[lvl - 1][i] != 0) {
+				bs->level[lvl][i / 64] |= 1ull << (i % 64);
+			}
+		}
+	}
+
+	if (runs) {
+		uint64_t regions = (nbits + BITSUM_REGION_BITS - 1) / BITSUM_REGION_BITS;
+		for (uint64_t r = 0; r < regions; r++) {
+			bs->longest[r] = region_longest(bs, r);
+		}
+	}
+	return true;
+}
+
+bool bitsum_init_full(bitsum *bs, const unsigned char *bitmap, uint64_t nbits, bool runs)
+{
+	return alloc_levels(bs, bitmap, nbits, runs);
+}
+
+void bitsum_set_free(bitsum *bs, uint64_t first, uint64_t count)
+{
+	if (count == 0) return;
+	uint64_t last = first + count - 1;
+	for (uint64_t w = first / 64; w <= last / 64; w++) {
+		uint64_t i = w;
+		for (unsigned int lvl = 0; lvl < bs->levels; lvl++) {
+			uint64_t mask = 1ull << (i % 64);
+			if (__atomic_fetch_or(&bs->level[lvl][i / 64], mask, __ATOMIC_SEQ_CST) != 0) {
+				break; // The levels above already have it
+			}
+			i /= 64;
+		}
+	}
+	if (bs->longest) {
+		for (uint64_t r = first / BITSUM_REGION_BITS; r <= last / BITSUM_REGION_BITS; r++) {
+			uint64_t start = r * BITSUM_REGION_BITS;
+			uint64_t end = start + BITSUM_REGION_BITS < bs->nbits ? start + BITSUM_REGION_BITS : bs->nbits;
+			if (first <= start && last + 1 >= end) {
+				bs->longest[r] = end - start;
+			} else {
+				bs->longest[r] = region_longest(bs, r);
+			}
+		}
+	}
+}
+
+void bitsum_destroy(bitsum *bs)
+{
+	for (unsigned int lvl = 0; lvl < bs->levels; lvl++) {
+		free(bs->level[lvl]);
+		bs->level[lvl] = NULL;
+	}
+	bs->levels = 0;
+	free(bs->longest);
+	bs->longest = NULL;
+}
+
+void bitsum_update(bitsum *bs, uint64_t first, uint64_t count)
+{
+	if (count == 0) return;
+	uint64_t last = first + count - 1;
+	for (uint64_t w = first / 64; w <= last / 64; w++) {
+		update_word(bs, w);
+	}
+	if (bs->longest) {
+		for (uint64_t r = first / BITSUM_REGION_BITS; r <= last / BITSUM_REGION_BITS; r++) {
+			bs->longest[r] = region_longest(bs, r);
+		}
+	}
+}
+
+int64_t bitsum_find(const bitsum *bs, uint64_t from, uint64_t to)
+{
+	if (to > bs->nbits) to = bs->nbits;
+	while (from < to) {
+		uint64_t w = from / 64;
+		uint64_t free = ~load_word(bs, w) & ~0ull << (from % 64);
+		if (free) {
+			uint64_t bit = w * 64 + __builtin_ctzll(free);
+			return bit < to ? (int64_t)bit : -1;
+		}
+		int64_t next = next_set(bs, 0, w + 1);
+		if (next < 0) return -1;
+		from = (uint64_t)next * 64;
+	}
+	return -1;
+}
+
+int64_t bitsum_next(const bitsum *bs, uint64_t from)
+{
+	if (from >= bs->nbits) return -1;
+	int64_t w = next_set(bs, 0, from / 64);
+	if (w < 0) return -1;
+	return (uint64_t)w == from / 64 ? (int64_t)from : w * 64;
+}
+
+int64_t bitsum_find_run(const bitsum *bs, uint64_t from, uint64_t to, uint64_t n)
+{
+	if (to > bs->nbits) to = bs->nbits;
+	while (from < to) {
+		uint64_t r = from / BITSUM_REGION_BITS;
+		if (bs->longest[r] < n) { // Only the free tail of the region can start the run
+			uint64_t tail = region_tail(bs, r);
+			if (tail > from) from = tail;
+			if (from >= to) break;
+		}
+		int64_t start = bitsum_find(bs, from, to);
+		if (start < 0) return -1;
+		uint64_t end = run_end(bs, start, start + n < to ? start + n : to);
+		if (end - start >= n) return start;
+		from = end;
+	}
+	return -1;
+}
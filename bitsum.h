@@ -0,0 +1,148 @@
+/*
+ * This code is provided solely for the personal and private use of students
+ * taking the CSC369H course at the University of Toronto. Copying for purposes
+ * other than this use is expressly prohibited. All forms of distribution of
+ * this code, including but not limited to public repositories on GitHub,
+ * GitLab, Bitbucket, or any other online platform, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Alexey Khrabrov, Karen Reid
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2019 Karen Reid
+ */
+
+
+/**
+ * CSC369 Assignment 1 - Free space summary header file.
+ *
+ * A hierarchical summary of an allocation bitmap (a set bit is an item in
+ * use) that finds free bits without scanning the bitmap. Bit i of level 0 is
+ * set if 64-bit word i of the bitmap has a free bit, and bit i of each higher
+ * level is set if word i of the level below is not 0; the top level is a
+ * single word. Finding the first free bit after a position therefore takes
+ * one word per level however full the bitmap is.
+ *
+ * The summary lives in memory only and is built when the file system is
+ * mounted. Its levels are updated with atomic operations, so callers only
+ * need to serialize changes to the same bitmap word.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+/** Largest number of summary levels (enough for 2^36 bits). */
+#define BITSUM_MAX_LEVELS 6
+
+/** Bits per region for which the longest free run is kept. */
+#define BITSUM_REGION_BITS 2048
+
+/** Summary of an allocation bitmap. */
+typedef struct bitsum {
+	/** The bitmap; bit i is bit i % 8 of byte i / 8. */
+	const unsigned char *bitmap;
+	/** Number of bits in the bitmap. */
+	uint64_t nbits;
+	/** Number of summary levels. */
+	unsigned int levels;
+	/** Summary levels, from the one right above the bitmap up. */
+	uint64_t *level[BITSUM_MAX_LEVELS];
+	/**
+	 * Longest run of free bits within each region of BITSUM_REGION_BITS
+	 * bits; NULL if not kept. Changes within one region must be serialized.
+	 */
+	uint32_t *longest;
+
+} bitsum;
+
+
+/**
+ * Build the summary of a bitmap.
+ *
+ * @param bs      pointer to the summary to initialize.
+ * @param bitmap  the bitmap.
+ * @param nbits   number of bits in the bitmap.
+ * @param runs    whether to keep the longest free run of each region.
+ * @return        true on success; false if memory runs out.
+ */
+bool bitsum_init(bitsum *bs, const unsigned char *bitmap, uint64_t nbits, bool runs);
+
+/**
+ * Set up the summary of a bitmap as if every bit were in use, without
+ * reading the bitmap. The ranges that do have free bits are then added with
+ * bitsum_set_free() or bitsum_update(), so that only those parts of the
+ * bitmap are read.
+ *
+ * @param bs      pointer to the summary to initialize.
+ * @param bitmap  the bitmap.
+ * @param nbits   number of bits in the bitmap.
+ * @param runs    whether to keep the longest free run of each region.
+ * @return        true on success; false if memory runs out.
+ */
+bool bitsum_init_full(bitsum *bs, const unsigned char *bitmap, uint64_t nbits, bool runs);
+
+/**
+ * Record that a range of bits is free, without reading the bitmap, e.g.
+ * because the range is known to be unused. The range must not share a
+ * bitmap word with bits that are in use.
+ *
+ * @param bs     pointer to the summary.
+ * @param first  first bit of the range.
+ * @param count  number of bits in the range.
+ */
+void bitsum_set_free(bitsum *bs, uint64_t first, uint64_t count);
+
+/** Release all memory held by the summary. */
+void bitsum_destroy(bitsum *bs);
+
+/**
+ * Bring the summary up to date after bits of the bitmap have changed.
+ *
+ * @param bs     pointer to the summary.
+ * @param first  first bit that changed.
+ * @param count  number of bits that changed, starting at first.
+ */
+void bitsum_update(bitsum *bs, uint64_t first, uint64_t count);
+
+/**
+ * Find the first free bit in a range.
+ *
+ * Only the bitmap words that hold bits of the range are read, so the caller
+ * only needs to hold whatever protects those words.
+ *
+ * @param bs    pointer to the summary.
+ * @param from  first bit of the range.
+ * @param to    end of the range (exclusive).
+ * @return      the free bit; -1 if there is none.
+ */
+int64_t bitsum_find(const bitsum *bs, uint64_t from, uint64_t to);
+
+/**
+ * Find where the summary says the next free bit may be, without reading
+ * the bitmap.
+ *
+ * @param bs    pointer to the summary.
+ * @param from  bit to start at.
+ * @return      first bit of the first bitmap word at or after the one holding
+ *              from that has a free bit, or from itself if its word has one;
+ *              -1 if there is none.
+ */
+int64_t bitsum_next(const bitsum *bs, uint64_t from);
+
+/**
+ * Find the first run of free bits of at least the given length in a range.
+ *
+ * Regions whose longest run is too short are skipped, apart from their free
+ * tail, which may continue into the next region. Requires runs to be kept.
+ *
+ * @param bs    pointer to the summary.
+ * @param from  first bit of the range.
+ * @param to    end of the range (exclusive).
+ * @param n     length of the run.
+ * @return      the first bit of the run; -1 if there is none.
+ */
+int64_t bitsum_find_run(const bitsum *bs, uint64_t from, uint64_t to, uint64_t n);
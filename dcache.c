@@ -0,0 +1,130 @@
+/*
+ * This code is provided solely for the personal and private use of students
+ * taking the CSC369H course at the University of Toronto. Copying for purposes
+ * other than this use is expressly prohibited. All forms of distribution of
+ * this code, including but not limited to public repositories on GitHub,
+ * GitLab, Bitbucket, or any other online platform, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Alexey Khrabrov, Karen Reid
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2019 Karen Reid
+ */
+
+/**
+ * CSC369 Assignment 1 - Directory listing cache implementation.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "dcache.h"
+
+
+void dcache_init(dcache *dc)
+{
+	memset(dc, 0, sizeof(*dc));
+}
+
+void dcache_destroy(dcache *dc)
+{
+	free(dc->table);
+	dcache_init(dc);
+}
+
+void dcache_invalidate(dcache *dc)
+{
+	if (dc->count > 0) {
+		memset(dc->table, 0, dc->capacity * sizeof(dcache_entry));
+	}
+	dc->count = 0;
+	dc->valid = false;
+}
+
+void dcache_reset(dcache *dc, a1fs_ino_t dir)
+{
+	dcache_invalidate(dc);
+	dc->dir = dir;
+	dc->valid = true;
+}
+
+// Insert into a table that is known to have a free slot
+static void insert(dcache_entry *table, size_t capacity, dcache_entry e)
+{
+	size_t i = e.hash & (capacity - 1);
+	while (table[i].name != NULL) {
+		i = (i + 1) & (capacity - 1);
+	}
+	table[i] = e;
+}
+
+void dcache_add(dcache *dc, dir_pos pos, const char *name, size_t len)
+{
+	if (!dc->valid) return;
+
+	// Keep the load factor at or below 1/2
+	if ((dc->count + 1) * 2 > dc->capacity) {
+		size_t capacity = dc->capacity ? dc->capacity * 2 : 64;
+		dcache_entry *table = calloc(capacity, sizeof(dcache_entry));
+		if (table == NULL) {
+			dcache_invalidate(dc);
+			return;
+		}
+		for (size_t i = 0; i < dc->capacity; i++) {
+			if (dc->table[i].name != NULL) insert(table, capacity, dc->table[i]);
+		}
+		free(dc->table);
+		dc->table = table;
+		dc->capacity = capacity;
+	}
+
+	dcache_entry e = { name_hash(name, len), len, name, pos };
+	insert(dc->table, dc->capacity, e);
+	dc->count++;
+}
+
+void dcache_remove(dcache *dc, a1fs_ino_t dir, dir_pos pos, uint32_t hash)
+{
+	if (!dc->valid || dc->dir != dir || dc->count == 0) return;
+
+	size_t mask = dc->capacity - 1;
+	size_t i = hash & mask;
+	while (dc->table[i].name != NULL &&
+	       (dc->table[i].pos.block != pos.block || dc->table[i].pos.off != pos.off))
+	{
+		i = (i + 1) & mask;
+	}
+	if (dc->table[i].name == NULL) return;
+	dc->table[i].name = NULL;
+	dc->count--;
+
+	// Shift back the entries of the run that can no longer be reached
+	for (size_t j = (i + 1) & mask; dc->table[j].name != NULL; j = (j + 1) & mask) {
+		size_t home = dc->table[j].hash & mask;
+		// Movable unless home lies cyclically in (i, j]
+		bool stays = i <= j ? (i < home && home <= j) : (i < home || home <= j);
+		if (!stays) {
+			dc->table[i] = dc->table[j];
+			dc->table[j].name = NULL;
+			i = j;
+		}
+	}
+}
+
+bool dcache_lookup(dcache *dc, a1fs_ino_t dir, const char *name, size_t len,
+                   uint32_t hash, dir_pos *pos)
+{
+	if (!dc->valid || dc->dir != dir || dc->count == 0) return false;
+
+	for (size_t i = hash & (dc->capacity - 1); dc->table[i].name != NULL;
+	     i = (i + 1) & (dc->capacity - 1))
+	{
+		const dcache_entry *e = &dc->table[i];
+		if (e->hash == hash && e->len == len && memcmp(e->name, name, len) == 0) {
+			*pos = e->pos;
+			return true;
+		}
+	}
+	return false;
+}
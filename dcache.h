@@ -0,0 +1,120 @@
+/*
+ * This code is provided solely for the personal and private use of students
+ * taking the CSC369H course at the University of Toronto. Copying for purposes
+ * other than this use is expressly prohibited. All forms of distribution of
+ * this code, including but not limited to public repositories on GitHub,
+ * GitLab, Bitbucket, or any other online platform, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Alexey Khrabrov, Karen Reid
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2019 Karen Reid
+ */
+
+/**
+ * CSC369 Assignment 1 - Directory listing cache header file.
+ *
+ * Remembers where the entries of the most recently listed directory live in
+ * the image, so that the lookups the kernel issues for every name returned by
+ * readdir() (e.g. for "ls -l") don't have to rescan the whole directory.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "a1fs.h"
+#include "dirblk.h"
+
+
+/** Cached directory entry. */
+typedef struct dcache_entry {
+	/** Hash of the entry name; see name_hash(). */
+	uint32_t hash;
+	/** Length of the entry name. */
+	uint32_t len;
+	/** Name of the entry in the memory-mapped image. NULL if the slot is unused. */
+	const char *name;
+	/** Location of the entry. */
+	dir_pos pos;
+
+} dcache_entry;
+
+/** Directory listing cache - an open addressing hash table of one directory. */
+typedef struct dcache {
+	/** Inode number of the cached directory. */
+	a1fs_ino_t dir;
+	/** Whether dir is valid, i.e. whether anything is being cached. */
+	bool valid;
+	/** Number of cached entries. */
+	size_t count;
+	/** Number of slots in the table; 0 or a power of 2. */
+	size_t capacity;
+	/** Hash table slots. */
+	dcache_entry *table;
+
+} dcache;
+
+
+/** Initialize an empty cache. */
+void dcache_init(dcache *dc);
+
+/** Release all memory held by the cache. */
+void dcache_destroy(dcache *dc);
+
+/**
+ * Drop all cached entries and start caching directory dir.
+ *
+ * @param dc   pointer to the cache.
+ * @param dir  inode number of the directory that is about to be listed.
+ */
+void dcache_reset(dcache *dc, a1fs_ino_t dir);
+
+/** Drop all cached entries; nothing is cached until the next dcache_reset(). */
+void dcache_invalidate(dcache *dc);
+
+/**
+ * Add an entry of the cached directory.
+ *
+ * If memory runs out, the cache is invalidated, which is always safe.
+ *
+ * @param dc    pointer to the cache.
+ * @param pos   location of the entry.
+ * @param name  name of the entry in the memory-mapped image.
+ * @param len   length of the name.
+ */
+void dcache_add(dcache *dc, dir_pos pos, const char *name, size_t len);
+
+/**
+ * Forget an entry that is about to be removed from its directory.
+ *
+ * Cached entries are trusted to be live, so every removal of an entry of the
+ * cached directory must go through here (or invalidate the whole cache, e.g.
+ * when entries are moved).
+ *
+ * @param dc    pointer to the cache.
+ * @param dir   inode number of the directory the entry is in.
+ * @param pos   location of the entry.
+ * @param hash  name_hash() of its name.
+ */
+void dcache_remove(dcache *dc, a1fs_ino_t dir, dir_pos pos, uint32_t hash);
+
+/**
+ * Look up a name in the cached directory.
+ *
+ * A false result doesn't mean that the name doesn't exist, only that it's not
+ * cached; the caller must then scan the directory.
+ *
+ * @param dc    pointer to the cache.
+ * @param dir   inode number of the directory to look in.
+ * @param name  name to look up; need not be null-terminated.
+ * @param len   length of the name.
+ * @param hash  name_hash() of the name.
+ * @param pos   receives the location of the entry.
+ * @return      true if the entry was found in the cache.
+ */
+bool dcache_lookup(dcache *dc, a1fs_ino_t dir, const char *name, size_t len,
+                   uint32_t hash, dir_pos *pos);
@@ -0,0 +1,209 @@
+/*
+ * This code is provided solely for the personal and private use of students
+ * taking the CSC369H course at the University of Toronto. Copying for purposes
+ * other than this use is expressly prohibited. All forms of distribution of
+ * this code, including but not limited to public repositories on GitHub,
+ * GitLab, Bitbucket, or any other online platform, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Alexey Khrabrov, Karen Reid
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2019 Karen Reid
+ */
+
+
+/**
+ * CSC369 Assignment 1 - Directory block format implementation.
+ */
+
+#include <string.h>
+
+#include "dirblk.h"
+#include "dscan.h"
+
+
+// Record at a byte offset of a packed block
+static inline a1fs_dirent *record(const void *block, uint32_t off)
+{
+	return (a1fs_dirent *)((unsigned char *)block + off);
+}
+
+// Whether the record at off is followed by another one. Stops at a corrupt
+// rec_len instead of looping forever or running off the block.
+static inline bool valid(const void *block, uint32_t off)
+{
+	return off + A1FS_DIRENT_SIZE(0) <= A1FS_BLOCK_SIZE &&
+	       record(block, off)->rec_len >= A1FS_DIRENT_SIZE(0) &&
+	       off + record(block, off)->rec_len <= A1FS_BLOCK_SIZE;
+}
+
+// Bytes of the record at off that a new record could be carved from
+static inline size_t slack(const a1fs_dirent *r)
+{
+	return r->name_len ? r->rec_len - A1FS_DIRENT_SIZE(r->name_len) : r->rec_len;
+}
+
+
+void dirblk_init(void *block)
+{
+	a1fs_dirblk *hdr = block;
+	hdr->magic = A1FS_DIRBLK_MAGIC;
+	hdr->reserved = 0;
+
+	a1fs_dirent *r = record(block, sizeof(a1fs_dirblk));
+	r->ino = 0;
+	// The largest record there can be; a1fs.h checks that it fits in rec_len
+	r->rec_len = A1FS_BLOCK_SIZE - sizeof(a1fs_dirblk);
+	r->name_len = 0;
+	r->reserved = 0;
+	r->hash = 0;
+	r->name[0] = '\0';
+}
+
+int dirblk_find(const void *block, uint32_t inode_count, const char *name,
+                size_t len, uint32_t hash)
+{
+	if (!dirblk_packed(block)) {
+		int k = dscan_find(block, inode_count, name, len);
+		return k < 0 ? -1 : k * (int)sizeof(a1fs_dentry);
+	}
+
+	for (uint32_t off = sizeof(a1fs_dirblk); valid(block, off);
+	     off += record(block, off)->rec_len)
+	{
+		const a1fs_dirent *r = record(block, off);
+		if (r->hash == hash && r->name_len == len &&
+		    memcmp(r->name, name, len) == 0)
+		{
+			return off;
+		}
+	}
+	return -1;
+}
+
+bool dirblk_next(const void *block, uint32_t inode_count, uint32_t *cursor,
+                 dirblk_ent *ent)
+{
+	if (!dirblk_packed(block)) {
+		const a1fs_dentry *dentries = block;
+		for (uint32_t k = *cursor / sizeof(a1fs_dentry); k < DSCAN_SLOTS; k++) {
+			if (dentries[k].ino < inode_count && dentries[k].name[0] != '\0') {
+				ent->ino = dentries[k].ino;
+				ent->name = dentries[k].name;
+				ent->len = strnlen(dentries[k].name, A1FS_NAME_MAX);
+				ent->off = k * sizeof(a1fs_dentry);
+				*cursor = ent->off + sizeof(a1fs_dentry);
+				return true;
+			}
+		}
+		*cursor = A1FS_BLOCK_SIZE;
+		return false;
+	}
+
+	uint32_t off = *cursor < sizeof(a1fs_dirblk) ? sizeof(a1fs_dirblk) : *cursor;
+	for (; valid(block, off); off += record(block, off)->rec_len) {
+		const a1fs_dirent *r = record(block, off);
+		if (r->name_len != 0) {
+			ent->ino = r->ino;
+			ent->name = r->name;
+			ent->len = r->name_len;
+			ent->off = off;
+			*cursor = off + r->rec_len;
+			return true;
+		}
+	}
+	*cursor = A1FS_BLOCK_SIZE;
+	return false;
+}
+
+size_t dirblk_room(const void *block, uint32_t inode_count)
+{
+	if (!dirblk_packed(block)) {
+		return dscan_free(block, inode_count) < 0 ? 0 : A1FS_NAME_MAX - 1;
+	}
+
+	size_t best = 0;
+	for (uint32_t off = sizeof(a1fs_dirblk); valid(block, off);
+	     off += record(block, off)->rec_len)
+	{
+		size_t s = slack(record(block, off));
+		if (s > best) best = s;
+	}
+	// A1FS_DIRENT_SIZE(len) <= best, and the slack is a multiple of 8
+	if (best < A1FS_DIRENT_SIZE(1)) return 0;
+	size_t len = best - sizeof(a1fs_dirent) - 1;
+	return len < A1FS_NAME_MAX - 1 ? len : A1FS_NAME_MAX - 1;
+}
+
+int dirblk_insert(void *block, uint32_t inode_count, a1fs_ino_t ino,
+                  const char *name, size_t len)
+{
+	if (!dirblk_packed(block)) {
+		a1fs_dentry *dentries = block;
+		int k = dscan_free(dentries, inode_count);
+		if (k < 0) return -1;
+		dentries[k].ino = ino;
+		memcpy(dentries[k].name, name, len);
+		dentries[k].name[len] = '\0';
+		return sizeof(a1fs_dentry);
+	}
+
+	size_t need = A1FS_DIRENT_SIZE(len);
+	for (uint32_t off = sizeof(a1fs_dirblk); valid(block, off);
+	     off += record(block, off)->rec_len)
+	{
+		a1fs_dirent *r = record(block, off);
+		if (slack(r) < need) continue;
+		if (r->name_len != 0) { // Carve the new record from the slack
+			size_t used = A1FS_DIRENT_SIZE(r->name_len);
+			a1fs_dirent *n = record(block, off + used);
+			n->rec_len = r->rec_len - used;
+			r->rec_len = used;
+			r = n;
+		}
+		r->ino = ino;
+		r->name_len = len;
+		r->reserved = 0;
+		r->hash = name_hash(name, len);
+		memcpy(r->name, name, len);
+		r->name[len] = '\0';
+		return need;
+	}
+	return -1;
+}
+
+size_t dirblk_remove(void *block, uint32_t inode_count, uint32_t off)
+{
+	if (!dirblk_packed(block)) {
+		a1fs_dentry *d = (a1fs_dentry *)((unsigned char *)block + off);
+		d->ino = inode_count + 1;
+		d->name[0] = '\0';
+		return sizeof(a1fs_dentry);
+	}
+
+	a1fs_dirent *r = record(block, off);
+	size_t size = A1FS_DIRENT_SIZE(r->name_len);
+	r->name_len = 0;
+	r->name[0] = '\0';
+
+	// Give the space to the previous record; the first one just becomes free
+	for (uint32_t prev = sizeof(a1fs_dirblk); valid(block, prev);
+	     prev += record(block, prev)->rec_len)
+	{
+		if (prev + record(block, prev)->rec_len == off) {
+			record(block, prev)->rec_len += r->rec_len;
+			break;
+		}
+	}
+	return size;
+}
+
+void dirblk_set_ino(void *block, uint32_t off, a1fs_ino_t ino)
+{
+	if (!dirblk_packed(block)) {
+		((a1fs_dentry *)((unsigned char *)block + off))->ino = ino;
+		return;
+	}
+	record(block, off)->ino = ino;
+}
@@ -0,0 +1,145 @@
+/*
+ * This code is provided solely for the personal and private use of students
+ * taking the CSC369H course at the University of Toronto. Copying for purposes
+ * other than this use is expressly prohibited. All forms of distribution of
+ * this code, including but not limited to public repositories on GitHub,
+ * GitLab, Bitbucket, or any other online platform, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Alexey Khrabrov, Karen Reid
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2019 Karen Reid
+ */
+
+
+/**
+ * CSC369 Assignment 1 - Directory block format header file.
+ *
+ * Operations on a single directory block that work on both block formats,
+ * the original array of fixed size a1fs_dentry and the packed format of
+ * variable length a1fs_dirent records (see a1fs_dirblk). The rest of the
+ * file system goes through these and doesn't care which format a directory
+ * is in.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "a1fs.h"
+
+
+/** Location of a directory entry in the image. */
+typedef struct dir_pos {
+	/** Block that holds the entry. */
+	a1fs_blk_t block;
+	/** Byte offset of the entry (dentry or record) in the block. */
+	uint32_t off;
+
+} dir_pos;
+
+/** Live entry returned by dirblk_next(). */
+typedef struct dirblk_ent {
+	/** Inode number. */
+	a1fs_ino_t ino;
+	/** Null-terminated name, in the block. */
+	const char *name;
+	/** Length of the name. */
+	size_t len;
+	/** Byte offset of the entry in the block. */
+	uint32_t off;
+
+} dirblk_ent;
+
+
+/** Compute the hash of a file name of given length (FNV-1a). */
+static inline uint32_t name_hash(const char *name, size_t len)
+{
+	uint32_t h = 2166136261u;
+	for (size_t i = 0; i < len; i++) {
+		h = (h ^ (unsigned char)name[i]) * 16777619u;
+	}
+	return h;
+}
+
+/** Whether a directory block is in the packed format. */
+static inline bool dirblk_packed(const void *block)
+{
+	return ((const a1fs_dirblk *)block)->magic == A1FS_DIRBLK_MAGIC;
+}
+
+/** Initialize an empty block of the packed format. */
+void dirblk_init(void *block);
+
+/**
+ * Find a live entry with the given name in a directory block.
+ *
+ * @param block        pointer to the block.
+ * @param inode_count  number of inodes in the file system.
+ * @param name         name to look for; need not be null-terminated.
+ * @param len          length of the name; less than A1FS_NAME_MAX.
+ * @param hash         name_hash() of the name.
+ * @return             byte offset of the entry; -1 if not found.
+ */
+int dirblk_find(const void *block, uint32_t inode_count, const char *name,
+                size_t len, uint32_t hash);
+
+/**
+ * Get the next live entry of a directory block.
+ *
+ * @param block        pointer to the block.
+ * @param inode_count  number of inodes in the file system.
+ * @param cursor       position to continue from; 0 for the first entry.
+ *                     Advanced past the returned entry.
+ * @param ent          receives the entry.
+ * @return             true if an entry was returned; false at the end.
+ */
+bool dirblk_next(const void *block, uint32_t inode_count, uint32_t *cursor,
+                 dirblk_ent *ent);
+
+/**
+ * Get the longest name that a new entry of a directory block can have.
+ *
+ * @param block        pointer to the block.
+ * @param inode_count  number of inodes in the file system.
+ * @return             name length; 0 if the block is full.
+ */
+size_t dirblk_room(const void *block, uint32_t inode_count);
+
+/**
+ * Add an entry to a directory block.
+ *
+ * @param block        pointer to the block.
+ * @param inode_count  number of inodes in the file system.
+ * @param ino          inode number of the entry.
+ * @param name         name of the entry; need not be null-terminated.
+ * @param len          length of the name; less than A1FS_NAME_MAX.
+ * @return             number of bytes the entry takes (what the directory size
+ *                     grows by); -1 if it doesn't fit, see dirblk_room().
+ */
+int dirblk_insert(void *block, uint32_t inode_count, a1fs_ino_t ino,
+                  const char *name, size_t len);
+
+/**
+ * Remove an entry from a directory block.
+ *
+ * Other entries of the block stay where they are.
+ *
+ * @param block        pointer to the block.
+ * @param inode_count  number of inodes in the file system.
+ * @param off          byte offset of the live entry.
+ * @return             number of bytes the entry took.
+ */
+size_t dirblk_remove(void *block, uint32_t inode_count, uint32_t off);
+
+/**
+ * Point an entry of a directory block at another inode.
+ *
+ * @param block  pointer to the block.
+ * @param off    byte offset of the live entry.
+ * @param ino    new inode number of the entry.
+ */
+void dirblk_set_ino(void *block, uint32_t off, a1fs_ino_t ino);
@@ -0,0 +1,237 @@
+/*
+ * This code is provided solely for the personal and private use of students
+ * taking the CSC369H course at the University of Toronto. Copying for purposes
+ * other than this use is expressly prohibited. All forms of distribution of
+ * this code, including but not limited to public repositories on GitHub,
+ * GitLab, Bitbucket, or any other online platform, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Alexey Khrabrov, Karen Reid
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2019 Karen Reid
+ */
+
+/**
+ * CSC369 Assignment 1 - Directory block scanning implementation.
+ */
+
+#include <stdbool.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define DSCAN_X86 1
+#endif
+
+#include "dscan.h"
+
+
+/** Number of dentries the kernels look at in one call. */
+#define DSCAN_GROUP 16
+
+static_assert(DSCAN_SLOTS % DSCAN_GROUP == 0,
+              "a directory block must hold whole groups of dentries");
+static_assert(sizeof(a1fs_dentry) % sizeof(uint32_t) == 0,
+              "dentry size must be a multiple of the ino size");
+
+/** Distance between the ino fields of two slots, in 32-bit words. */
+#define DSCAN_STRIDE ((int)(sizeof(a1fs_dentry) / sizeof(uint32_t)))
+
+
+/** Check if a live candidate's name matches beyond the vector prefix. */
+static inline bool name_tail_equal(const a1fs_dentry *d, const char *name,
+                                   size_t len, size_t prefix)
+{
+	// The prefix covered len + 1 bytes, i.e. the whole name and terminator
+	if (len < prefix) return true;
+	return memcmp(d->name + prefix, name + prefix, len - prefix) == 0 &&
+	       d->name[len] == '\0';
+}
+
+/** Mask of the first n bits (n <= 32). */
+static inline uint32_t low_bits(size_t n)
+{
+	return n >= 32 ? 0xFFFFFFFFu : (1u << n) - 1;
+}
+
+
+static int find_scalar(const a1fs_dentry *block, uint32_t inode_count,
+                       const char *name, size_t len)
+{
+	for (unsigned int k = 0; k < DSCAN_GROUP; k++) {
+		if (block[k].ino < inode_count && block[k].name[0] == name[0] &&
+		    memcmp(block[k].name, name, len) == 0 && block[k].name[len] == '\0')
+		{
+			return k;
+		}
+	}
+	return -1;
+}
+
+static int free_scalar(const a1fs_dentry *block, uint32_t inode_count)
+{
+	for (unsigned int k = 0; k < DSCAN_GROUP; k++) {
+		if (block[k].ino >= inode_count) return k;
+	}
+	return -1;
+}
+
+
+#ifdef DSCAN_X86
+
+// SSE2 has no unsigned compare; flip the sign bit so signed compare works
+#define SIGN_BIAS ((int)0x80000000u)
+
+/** Bit k is set if slot k is live (SSE2). */
+static inline uint32_t live_mask_sse2(const a1fs_dentry *block,
+                                      uint32_t inode_count)
+{
+	const __m128i bias = _mm_set1_epi32(SIGN_BIAS);
+	const __m128i limit = _mm_xor_si128(_mm_set1_epi32((int)inode_count), bias);
+	uint32_t mask = 0;
+	for (unsigned int g = 0; g < DSCAN_GROUP; g += 4) {
+		__m128i ino = _mm_set_epi32((int)block[g + 3].ino, (int)block[g + 2].ino,
+		                            (int)block[g + 1].ino, (int)block[g].ino);
+		__m128i live = _mm_cmplt_epi32(_mm_xor_si128(ino, bias), limit);
+		mask |= (uint32_t)_mm_movemask_ps(_mm_castsi128_ps(live)) << g;
+	}
+	return mask;
+}
+
+static int find_sse2(const a1fs_dentry *block, uint32_t inode_count,
+                     const char *name, size_t len)
+{
+	uint32_t live = live_mask_sse2(block, inode_count);
+	if (live == 0) return -1;
+
+	// Name bytes to compare in the vector prefix, including the terminator
+	char key[16] = {0};
+	size_t prefix = len + 1 < sizeof(key) ? len + 1 : sizeof(key);
+	memcpy(key, name, prefix < len ? prefix : len);
+	const __m128i vkey = _mm_loadu_si128((const __m128i *)key);
+	const uint32_t need = low_bits(prefix);
+
+	while (live != 0) {
+		int k = __builtin_ctz(live);
+		live &= live - 1;
+		__m128i v = _mm_loadu_si128((const __m128i *)block[k].name);
+		uint32_t eq = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, vkey));
+		if ((eq & need) == need && name_tail_equal(&block[k], name, len, prefix)) {
+			return k;
+		}
+	}
+	return -1;
+}
+
+static int free_sse2(const a1fs_dentry *block, uint32_t inode_count)
+{
+	uint32_t used = live_mask_sse2(block, inode_count);
+	uint32_t avail = ~used & low_bits(DSCAN_GROUP);
+	return avail ? __builtin_ctz(avail) : -1;
+}
+
+
+/** Bit k is set if slot k is live (AVX2). */
+__attribute__((target("avx2")))
+static inline uint32_t live_mask_avx2(const a1fs_dentry *block,
+                                      uint32_t inode_count)
+{
+	const __m256i idx = _mm256_setr_epi32(0, DSCAN_STRIDE, 2 * DSCAN_STRIDE,
+	                                      3 * DSCAN_STRIDE, 4 * DSCAN_STRIDE,
+	                                      5 * DSCAN_STRIDE, 6 * DSCAN_STRIDE,
+	                                      7 * DSCAN_STRIDE);
+	const __m256i bias = _mm256_set1_epi32(SIGN_BIAS);
+	const __m256i limit = _mm256_xor_si256(_mm256_set1_epi32((int)inode_count), bias);
+	const int *base = (const int *)block;
+
+	__m256i lo = _mm256_i32gather_epi32(base, idx, 4);
+	__m256i hi = _mm256_i32gather_epi32(base + 8 * DSCAN_STRIDE, idx, 4);
+	__m256i live_lo = _mm256_cmpgt_epi32(limit, _mm256_xor_si256(lo, bias));
+	__m256i live_hi = _mm256_cmpgt_epi32(limit, _mm256_xor_si256(hi, bias));
+	return (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(live_lo)) |
+	       (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(live_hi)) << 8;
+}
+
+__attribute__((target("avx2")))
+static int find_avx2(const a1fs_dentry *block, uint32_t inode_count,
+                     const char *name, size_t len)
+{
+	uint32_t live = live_mask_avx2(block, inode_count);
+	if (live == 0) return -1;
+
+	// Name bytes to compare in the vector prefix, including the terminator
+	char key[32] = {0};
+	size_t prefix = len + 1 < sizeof(key) ? len + 1 : sizeof(key);
+	memcpy(key, name, prefix < len ? prefix : len);
+	const __m256i vkey = _mm256_loadu_si256((const __m256i *)key);
+	const uint32_t need = low_bits(prefix);
+
+	while (live != 0) {
+		int k = __builtin_ctz(live);
+		live &= live - 1;
+		__m256i v = _mm256_loadu_si256((const __m256i *)block[k].name);
+		uint32_t eq = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, vkey));
+		if ((eq & need) == need && name_tail_equal(&block[k], name, len, prefix)) {
+			return k;
+		}
+	}
+	return -1;
+}
+
+__attribute__((target("avx2")))
+static int free_avx2(const a1fs_dentry *block, uint32_t inode_count)
+{
+	uint32_t used = live_mask_avx2(block, inode_count);
+	uint32_t avail = ~used & low_bits(DSCAN_GROUP);
+	return avail ? __builtin_ctz(avail) : -1;
+}
+
+#endif// DSCAN_X86
+
+
+typedef int (*find_fn)(const a1fs_dentry *, uint32_t, const char *, size_t);
+typedef int (*free_fn)(const a1fs_dentry *, uint32_t);
+
+static find_fn find_impl;
+static free_fn free_impl;
+
+// Pick the kernels for this CPU on first use
+static void dispatch(void)
+{
+	find_impl = find_scalar;
+	free_impl = free_scalar;
+#ifdef DSCAN_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		find_impl = find_avx2;
+		free_impl = free_avx2;
+	} else if (__builtin_cpu_supports("sse2")) {
+		find_impl = find_sse2;
+		free_impl = free_sse2;
+	}
+#endif
+}
+
+// The number of groups is a constant of the build, so these loops are
+// unrolled for the block size
+int dscan_find(const a1fs_dentry *block, uint32_t inode_count,
+               const char *name, size_t len)
+{
+	if (find_impl == NULL) dispatch();
+	for (unsigned int g = 0; g < DSCAN_SLOTS; g += DSCAN_GROUP) {
+		int k = find_impl(block + g, inode_count, name, len);
+		if (k >= 0) return g + k;
+	}
+	return -1;
+}
+
+int dscan_free(const a1fs_dentry *block, uint32_t inode_count)
+{
+	if (free_impl == NULL) dispatch();
+	for (unsigned int g = 0; g < DSCAN_SLOTS; g += DSCAN_GROUP) {
+		int k = free_impl(block + g, inode_count);
+		if (k >= 0) return g + k;
+	}
+	return -1;
+}
@@ -0,0 +1,60 @@
+/*
+ * This code is provided solely for the personal and private use of students
+ * taking the CSC369H course at the University of Toronto. Copying for purposes
+ * other than this use is expressly prohibited. All forms of distribution of
+ * this code, including but not limited to public repositories on GitHub,
+ * GitLab, Bitbucket, or any other online platform, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Alexey Khrabrov, Karen Reid
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2019 Karen Reid
+ */
+
+/**
+ * CSC369 Assignment 1 - Directory block scanning header file.
+ *
+ * Kernels that search one block of fixed size dentries, i.e. a directory block
+ * of the original format (see a1fs_dirblk), 16 slots at a time (all of a
+ * 4 KiB block). On x86 the ino fields of the 16 slots are gathered into
+ * vector registers to find live (or free) slots at once, and the first 16
+ * (SSE2) or 32 (AVX2) bytes of the candidate names are compared in parallel
+ * before any full comparison. The best kernel for the CPU
+ * is picked at run time; other platforms use the scalar code.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "a1fs.h"
+
+
+/** Number of dentries in a directory block. */
+#define DSCAN_SLOTS (A1FS_BLOCK_SIZE / sizeof(a1fs_dentry))
+
+/**
+ * Find a live entry with the given name in a directory block.
+ *
+ * A slot is live if its ino is less than inode_count.
+ *
+ * @param block        pointer to the DSCAN_SLOTS dentries of the block.
+ * @param inode_count  number of inodes in the file system.
+ * @param name         name to look for; need not be null-terminated.
+ * @param len          length of the name; less than A1FS_NAME_MAX.
+ * @return             slot index of the entry; -1 if not found.
+ */
+int dscan_find(const a1fs_dentry *block, uint32_t inode_count,
+               const char *name, size_t len);
+
+/**
+ * Find a free slot in a directory block.
+ *
+ * @param block        pointer to the DSCAN_SLOTS dentries of the block.
+ * @param inode_count  number of inodes in the file system.
+ * @return             index of the first slot that is not live; -1 if the
+ *                     block is full.
+ */
+int dscan_free(const a1fs_dentry *block, uint32_t inode_count);
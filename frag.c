@@ -0,0 +1,225 @@
+/*
+ * This code is provided solely for the personal and private use of students
+ * taking the CSC369H course at the University of Toronto. Copying for purposes
+ * other than this use is expressly prohibited. All forms of distribution of
+ * this code, including but not limited to public repositories on GitHub,
+ * GitLab, Bitbucket, or any other online platform, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Alexey Khrabrov, Karen Reid
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2019 Karen Reid
+ */
+
+
+/**
+ * CSC369 Assignment 1 - Fragment map implementation.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "frag.h"
+
+
+// Mask of n fragments starting at first
+static inline uint8_t run_mask(unsigned int first, unsigned int n)
+{
+	return (uint8_t)(((1u << n) - 1) << first);
+}
+
+// Length of the longest run of free fragments in a block
+static unsigned int longest_run(uint8_t used)
+{
+	unsigned int longest = 0, run = 0;
+	for (unsigned int i = 0; i < A1FS_FRAGS_PER_BLOCK; i++) {
+		run = (used & (1u << i)) ? 0 : run + 1;
+		if (run > longest) longest = run;
+	}
+	return longest;
+}
+
+// Home slot of a block number in a table of size slots
+static inline size_t home_slot(a1fs_blk_t block, size_t size)
+{
+	return (uint32_t)(block * 2654435761u) & (size - 1);
+}
+
+// Slot of the table that holds the given block, or of the unused slot
+// where it would go
+static size_t find_slot(const frag_map *fm, a1fs_blk_t block)
+{
+	size_t mask = fm->table_size - 1;
+	size_t i = home_slot(block, fm->table_size);
+	while (fm->table[i] != 0 && fm->blocks[fm->table[i] - 1].block != block) {
+		i = (i + 1) & mask;
+	}
+	return i;
+}
+
+// Put a block on the free list for its longest free run; full blocks are on none
+static void list_add(frag_map *fm, uint32_t index)
+{
+	frag_block *fb = &fm->blocks[index];
+	fb->longest = longest_run(fb->used);
+	fb->prev = fb->next = FRAG_NONE;
+	if (fb->longest == 0) return;
+	fb->next = fm->free_lists[fb->longest];
+	if (fb->next != FRAG_NONE) fm->blocks[fb->next].prev = index;
+	fm->free_lists[fb->longest] = index;
+}
+
+static void list_remove(frag_map *fm, uint32_t index)
+{
+	frag_block *fb = &fm->blocks[index];
+	if (fb->longest == 0) return;
+	if (fb->prev != FRAG_NONE) {
+		fm->blocks[fb->prev].next = fb->next;
+	} else {
+		fm->free_lists[fb->longest] = fb->next;
+	}
+	if (fb->next != FRAG_NONE) fm->blocks[fb->next].prev = fb->prev;
+}
+
+// Make room for one more block in the array and the table, keeping the load
+// factor of the table at or below 1/2
+static bool grow(frag_map *fm)
+{
+	if (fm->count == fm->capacity) {
+		size_t capacity = fm->capacity ? fm->capacity * 2 : 16;
+		frag_block *blocks = realloc(fm->blocks, capacity * sizeof(frag_block));
+		if (blocks == NULL) return false;
+		fm->blocks = blocks;
+		fm->capacity = capacity;
+	}
+	if ((fm->count + 1) * 2 > fm->table_size) {
+		size_t size = fm->table_size ? fm->table_size * 2 : 32;
+		uint32_t *table = calloc(size, sizeof(uint32_t));
+		if (table == NULL) return false;
+		free(fm->table);
+		fm->table = table;
+		fm->table_size = size;
+		for (size_t k = 0; k < fm->count; k++) {
+			fm->table[find_slot(fm, fm->blocks[k].block)] = k + 1;
+		}
+	}
+	return true;
+}
+
+// Take a block that has no fragments in use any more out of the map; the
+// last block of the array moves into its place
+static void remove_block(frag_map *fm, size_t slot)
+{
+	uint32_t index = fm->table[slot] - 1;
+	size_t mask = fm->table_size - 1;
+	list_remove(fm, index);
+	fm->table[slot] = 0;
+
+	// Shift back the entries of the run that can no longer be reached
+	size_t i = slot;
+	for (size_t j = (i + 1) & mask; fm->table[j] != 0; j = (j + 1) & mask) {
+		size_t home = home_slot(fm->blocks[fm->table[j] - 1].block, fm->table_size);
+		// Movable unless home lies cyclically in (i, j]
+		bool stays = i <= j ? (i < home && home <= j) : (i < home || home <= j);
+		if (!stays) {
+			fm->table[i] = fm->table[j];
+			fm->table[j] = 0;
+			i = j;
+		}
+	}
+
+	uint32_t last = fm->count - 1;
+	if (index != last) {
+		list_remove(fm, last);
+		fm->blocks[index] = fm->blocks[last];
+		fm->table[find_slot(fm, fm->blocks[index].block)] = index + 1;
+		list_add(fm, index);
+	}
+	fm->count--;
+}
+
+bool frag_map_init(frag_map *fm, const a1fs_extent *extents, size_t count)
+{
+	memset(fm, 0, sizeof(*fm));
+	for (unsigned int i = 0; i < A1FS_FRAGS_PER_BLOCK; i++) {
+		fm->free_lists[i] = FRAG_NONE;
+	}
+	for (size_t i = 0; i < count; i++) {
+		if (extents[i].start != 0 && (extents[i].count & A1FS_EXTENT_FRAG)) {
+			if (frag_take(fm, extents[i].start, A1FS_FRAG_FIRST(extents[i].count),
+			              A1FS_FRAG_COUNT(extents[i].count)) < 0)
+			{
+				frag_map_destroy(fm);
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+void frag_map_destroy(frag_map *fm)
+{
+	free(fm->blocks);
+	free(fm->table);
+	memset(fm, 0, sizeof(*fm));
+}
+
+int frag_alloc(frag_map *fm, unsigned int n, a1fs_blk_t *block)
+{
+	for (unsigned int len = n; len < A1FS_FRAGS_PER_BLOCK; len++) {
+		uint32_t index = fm->free_lists[len];
+		if (index == FRAG_NONE) continue;
+
+		frag_block *fb = &fm->blocks[index];
+		for (unsigned int first = 0; first + n <= A1FS_FRAGS_PER_BLOCK; first++) {
+			if ((fb->used & run_mask(first, n)) == 0) {
+				list_remove(fm, index);
+				fb->used |= run_mask(first, n);
+				list_add(fm, index);
+				*block = fb->block;
+				return first;
+			}
+		}
+	}
+	return -1;
+}
+
+int frag_take(frag_map *fm, a1fs_blk_t block, unsigned int first, unsigned int n)
+{
+	if (fm->table_size > 0) {
+		size_t slot = find_slot(fm, block);
+		if (fm->table[slot] != 0) {
+			uint32_t index = fm->table[slot] - 1;
+			list_remove(fm, index);
+			fm->blocks[index].used |= run_mask(first, n);
+			list_add(fm, index);
+			return 0;
+		}
+	}
+	if (!grow(fm)) return -1;
+	uint32_t index = fm->count++;
+	fm->blocks[index].block = block;
+	fm->blocks[index].used = run_mask(first, n);
+	fm->table[find_slot(fm, block)] = index + 1;
+	list_add(fm, index);
+	return 0;
+}
+
+bool frag_release(frag_map *fm, a1fs_blk_t block, unsigned int first, unsigned int n)
+{
+	if (fm->table_size == 0) return false;
+	size_t slot = find_slot(fm, block);
+	if (fm->table[slot] == 0) return false;
+
+	uint32_t index = fm->table[slot] - 1;
+	list_remove(fm, index);
+	fm->blocks[index].used &= ~run_mask(first, n);
+	if (fm->blocks[index].used != 0) {
+		list_add(fm, index);
+		return false;
+	}
+	fm->blocks[index].longest = 0; // Off the lists
+	remove_block(fm, slot);
+	return true;
+}
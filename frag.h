@@ -0,0 +1,129 @@
+/*
+ * This code is provided solely for the personal and private use of students
+ * taking the CSC369H course at the University of Toronto. Copying for purposes
+ * other than this use is expressly prohibited. All forms of distribution of
+ * this code, including but not limited to public repositories on GitHub,
+ * GitLab, Bitbucket, or any other online platform, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Alexey Khrabrov, Karen Reid
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2019 Karen Reid
+ */
+
+
+/**
+ * CSC369 Assignment 1 - Fragment map header file.
+ *
+ * Keeps track of which fragments of the blocks that hold file tails are in
+ * use (see A1FS_EXTENT_FRAG). The map lives in memory only: it is rebuilt
+ * from the fragment runs in the extent table when the file system is
+ * mounted. A block with fragments in use is allocated in the block bitmap as
+ * a whole.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "a1fs.h"
+
+
+/** Block with fragments in use. */
+typedef struct frag_block {
+	/** Block number. */
+	a1fs_blk_t block;
+	/** Bit i is set if fragment i is in use. */
+	uint8_t used;
+	/** Longest run of free fragments, i.e. the free list the block is on. */
+	uint8_t longest;
+	/** Neighbours on the free list, as indices into the blocks array; FRAG_NONE at the ends. */
+	uint32_t prev, next;
+
+} frag_block;
+
+static_assert(A1FS_FRAGS_PER_BLOCK <= 8, "fragment mask is too small");
+
+/** End of a free list. */
+#define FRAG_NONE UINT32_MAX
+
+/**
+ * Fragment map - blocks with fragments in use.
+ *
+ * Blocks with free fragments are on the free list for the length of their
+ * longest free run, so a run of n fragments is found by looking at the heads
+ * of at most A1FS_FRAGS_PER_BLOCK lists. A hash table from block number to
+ * position in the blocks array finds the block of a run being taken or
+ * released. Both keep take and release in constant time however many file
+ * tails there are.
+ */
+typedef struct frag_map {
+	/** Number of blocks. */
+	size_t count;
+	/** Capacity of the blocks array. */
+	size_t capacity;
+	/** Blocks with fragments in use, in no particular order. */
+	frag_block *blocks;
+	/** Heads of the free lists; list i has the blocks whose longest free run is i fragments. */
+	uint32_t free_lists[A1FS_FRAGS_PER_BLOCK];
+	/** Open addressing hash table of block numbers; slots hold an index into blocks plus 1, or 0 if unused. */
+	uint32_t *table;
+	/** Number of slots in the table; 0 or a power of 2. */
+	size_t table_size;
+
+} frag_map;
+
+
+/**
+ * Build the fragment map from an extent table.
+ *
+ * @param fm       pointer to the map to initialize.
+ * @param extents  the extent table.
+ * @param count    number of entries in the extent table.
+ * @return         true on success; false if memory runs out.
+ */
+bool frag_map_init(frag_map *fm, const a1fs_extent *extents, size_t count);
+
+/** Release all memory held by the map. */
+void frag_map_destroy(frag_map *fm);
+
+/**
+ * Find and take a run of free fragments in a block that is already in use.
+ *
+ * The block with the shortest free run that fits is used, and among those the
+ * one whose fragments changed last, so tails written one after another end
+ * up next to each other.
+ *
+ * @param fm     pointer to the map.
+ * @param n      number of fragments; at most A1FS_FRAGS_PER_BLOCK.
+ * @param block  receives the block of the run.
+ * @return       index of the first fragment; -1 if no block has room, in
+ *               which case the caller allocates a new block for frag_take().
+ */
+int frag_alloc(frag_map *fm, unsigned int n, a1fs_blk_t *block);
+
+/**
+ * Mark a run of fragments as used, adding the block to the map if needed.
+ *
+ * @param fm     pointer to the map.
+ * @param block  block of the run.
+ * @param first  index of the first fragment.
+ * @param n      number of fragments.
+ * @return       0 on success; -1 if memory runs out.
+ */
+int frag_take(frag_map *fm, a1fs_blk_t block, unsigned int first, unsigned int n);
+
+/**
+ * Mark a run of fragments as free.
+ *
+ * @param fm     pointer to the map.
+ * @param block  block of the run.
+ * @param first  index of the first fragment.
+ * @param n      number of fragments.
+ * @return       true if no fragment of the block is in use any more, i.e. the
+ *               caller must free the block.
+ */
+bool frag_release(frag_map *fm, a1fs_blk_t block, unsigned int first, unsigned int n);
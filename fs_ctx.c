@@ -16,21 +16,267 @@
  * CSC369 Assignment 1 - File system runtime context implementation.
  */
 
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
 #include "fs_ctx.h"
 
 
-bool fs_ctx_init(fs_ctx *fs, void *image, size_t size, a1fs_opts *opts)
+/** Whether count blocks from start lie within the image, past the superblock. */
+static bool area_fits(uint64_t start, uint64_t count, uint64_t image_blocks)
+{
+	return start >= 1 && start <= image_blocks && count <= image_blocks - start;
+}
+
+/**
+ * Resolve the metadata areas recorded in the superblock, falling back to the
+ * original fixed layout for images that predate it. Fails if an area doesn't
+ * fit in the image or is too small for the counts in the superblock.
+ */
+static bool init_layout(fs_ctx *fs)
+{
+	a1fs_superblock *sb = (a1fs_superblock *)fs->image;
+	uint64_t inode_bitmap_start = 1, block_bitmap_start = 2, block_bitmap_blocks = 1;
+	uint64_t inode_bitmap_blocks = 1, extent_table_start = 3, extent_table_blocks = 1;
+	uint64_t inode_table_start = 4, data_start = 4 + sb->inode_blocks, extent_table_uninit = 0;
+	if (sb->inode_bitmap_start != 0) {
+		inode_bitmap_start = sb->inode_bitmap_start;
+		inode_bitmap_blocks = sb->inode_bitmap_blocks;
+		block_bitmap_start = sb->block_bitmap_start;
+		block_bitmap_blocks = sb->block_bitmap_blocks;
+		extent_table_start = sb->extent_table_start;
+		extent_table_blocks = sb->extent_table_blocks;
+		extent_table_uninit = sb->extent_table_uninit;
+		inode_table_start = sb->inode_table_start;
+		data_start = sb->data_start;
+	}
+	uint64_t bits = (uint64_t)A1FS_BLOCK_SIZE * 8;
+	uint64_t image_blocks = fs->size / A1FS_BLOCK_SIZE;
+	if (!area_fits(inode_bitmap_start, inode_bitmap_blocks, image_blocks) ||
+	    !area_fits(block_bitmap_start, block_bitmap_blocks, image_blocks) ||
+	    !area_fits(extent_table_start, extent_table_blocks, image_blocks) ||
+	    !area_fits(inode_table_start, sb->inode_blocks, image_blocks) ||
+	    !area_fits(data_start, sb->data_block_count, image_blocks)) {
+		fprintf(stderr, "The superblock describes areas that don't fit in the image\n");
+		return false;
+	}
+	if (sb->inode_count > inode_bitmap_blocks * bits || sb->data_block_count > block_bitmap_blocks * bits ||
+	    extent_table_uninit >= extent_table_blocks ||
+	    sb->inode_count > sb->inode_blocks * (A1FS_BLOCK_SIZE / sizeof(a1fs_inode)) ||
+	    data_start + sb->data_block_count > UINT32_MAX) {
+		fprintf(stderr, "The superblock describes areas too small for its counts\n");
+		return false;
+	}
+
+	fs->layout.inode_bitmap = (unsigned char *)fs->image + A1FS_BLOCK_SIZE * inode_bitmap_start;
+	fs->layout.block_bitmap = (unsigned char *)fs->image + A1FS_BLOCK_SIZE * block_bitmap_start;
+	fs->layout.extents = (a1fs_extent *)((char *)fs->image + A1FS_BLOCK_SIZE * extent_table_start);
+	fs->layout.extent_count = (extent_table_blocks - extent_table_uninit) * (A1FS_BLOCK_SIZE / sizeof(a1fs_extent));
+	fs->layout.inodes = (a1fs_inode *)((char *)fs->image + A1FS_BLOCK_SIZE * inode_table_start);
+	fs->layout.data_start = data_start;
+	return true;
+}
+
+/** Rebuild the group descriptors by counting the bits of the bitmaps. */
+static void scan_groups(fs_ctx *fs, a1fs_group_desc *descs)
+{
+	a1fs_superblock *sb = (a1fs_superblock *)fs->image;
+	const unsigned char *inode_bitmap = fs->layout.inode_bitmap;
+	const unsigned char *block_bitmap = fs->layout.block_bitmap;
+	const a1fs_inode *inodes = fs->layout.inodes;
+
+	for (unsigned int g = 0; g < fs->group_count; g++) {
+		uint32_t flags = descs[g].flags;
+		memset(&descs[g], 0, sizeof(a1fs_group_desc));
+		descs[g].flags = flags;
+	}
+	// Groups that were never initialized have everything free
+	for (uint64_t i = 0; i < sb->data_block_count; i++) {
+		a1fs_group_desc *desc = &descs[i / A1FS_GROUP_BLOCKS];
+		if ((desc->flags & A1FS_GROUP_BLOCK_UNINIT) || !(block_bitmap[i / 8] & (1 << (i % 8)))) {
+			if (desc->free_blocks++ == 0) desc->first_free_block = i % A1FS_GROUP_BLOCKS;
+		}
+	}
+	for (uint64_t i = 0; i < sb->inode_count; i++) {
+		a1fs_group_desc *desc = &descs[i / fs->group_inodes];
+		if ((desc->flags & A1FS_GROUP_INODE_UNINIT) || !(inode_bitmap[i / 8] & (1 << (i % 8)))) {
+			if (desc->free_inodes++ == 0) desc->first_free_inode = i % fs->group_inodes;
+		} else if (S_ISDIR(inodes[i].mode)) {
+			desc->dirs++;
+		}
+	}
+}
+
+/**
+ * Summarize a bitmap split into groups of group_bits bits. Only the groups
+ * the descriptors say are partly used are read, and only from their first
+ * free hint on; full and empty groups are summarized from their counts.
+ */
+static bool summarize(fs_ctx *fs, bitsum *bs, const unsigned char *bitmap, uint64_t nbits,
+                      uint64_t group_bits, bool blocks)
+{
+	if (!bitsum_init_full(bs, bitmap, nbits, blocks)) return false;
+	for (unsigned int g = 0; g < fs->group_count; g++) {
+		uint64_t first = (uint64_t)g * group_bits;
+		if (first >= nbits) break;
+		uint64_t count = nbits - first < group_bits ? nbits - first : group_bits;
+		const a1fs_group_desc *desc = fs->groups[g].desc;
+		uint64_t free = blocks ? desc->free_blocks : desc->free_inodes;
+		uint64_t hint = blocks ? desc->first_free_block : desc->first_free_inode;
+		if (free == count) {
+			bitsum_set_free(bs, first, count);
+		} else if (free != 0 && hint < count) {
+			bitsum_update(bs, first + hint, count - hint);
+		}
+	}
+	return true;
+}
+
+/**
+ * Set up the allocation groups from the group descriptors, and summarize the
+ * bitmaps. The descriptors are rebuilt from the bitmaps if the file system
+ * wasn't unmounted cleanly, or kept in memory if the image has none.
+ */
+static bool init_groups(fs_ctx *fs)
+{
+	a1fs_superblock *sb = (a1fs_superblock *)fs->image;
+	a1fs_group_desc *descs;
+	bool trusted = false;
+	if (sb->group_desc_start != 0) {
+		fs->group_count = sb->group_count;
+		fs->group_inodes = sb->group_inodes;
+		if (fs->group_count == 0 || fs->group_inodes == 0 || fs->group_inodes % 64 != 0) return false;
+		if ((uint64_t)fs->group_count * A1FS_GROUP_BLOCKS < sb->data_block_count) return false;
+		if ((uint64_t)fs->group_count * fs->group_inodes < sb->inode_count) return false;
+		if (fs->group_count * sizeof(a1fs_group_desc) > sb->group_desc_blocks * A1FS_BLOCK_SIZE) return false;
+		if (sb->group_desc_start + sb->group_desc_blocks > fs->size / A1FS_BLOCK_SIZE) return false;
+		descs = (a1fs_group_desc *)((char *)fs->image + A1FS_BLOCK_SIZE * sb->group_desc_start);
+		trusted = sb->clean != 0;
+	} else {
+		fs->group_count = (sb->data_block_count + A1FS_GROUP_BLOCKS - 1) / A1FS_GROUP_BLOCKS;
+		if (fs->group_count == 0) fs->group_count = 1;
+		fs->group_inodes = (sb->inode_count + fs->group_count - 1) / fs->group_count;
+		fs->group_inodes = (fs->group_inodes + 63) / 64 * 64;
+		fs->mem_descs = calloc(fs->group_count, sizeof(a1fs_group_desc));
+		if (fs->mem_descs == NULL) return false;
+		descs = fs->mem_descs;
+	}
+
+	fs->groups = calloc(fs->group_count, sizeof(alloc_group));
+	if (fs->groups == NULL) return false;
+	for (unsigned int g = 0; g < fs->group_count; g++) {
+		fs->groups[g].desc = &descs[g];
+	}
+	if (!trusted) scan_groups(fs, descs);
+
+	return summarize(fs, &fs->block_sum, fs->layout.block_bitmap, sb->data_block_count, A1FS_GROUP_BLOCKS, true) &&
+	       summarize(fs, &fs->inode_sum, fs->layout.inode_bitmap, sb->inode_count, fs->group_inodes, false);
+}
+
+/**
+ * Drop the entries of the orphan list that aren't allocated regular files with
+ * no links left; the reclaimer would otherwise free the blocks of a live file,
+ * or read past the list. The blocks of dropped inodes are left for a1fsck.
+ */
+static void check_orphans(fs_ctx *fs)
+{
+	a1fs_superblock *sb = (a1fs_superblock *)fs->image;
+	uint64_t count = sb->orphan_count < A1FS_ORPHAN_MAX ? sb->orphan_count : A1FS_ORPHAN_MAX;
+	uint64_t kept = 0;
+	for (uint64_t k = 0; k < count; k++) {
+		a1fs_ino_t ino = sb->orphans[k];
+		if (ino == 0 || ino >= sb->inode_count) continue;
+		const a1fs_inode *inode = &fs->layout.inodes[ino];
+		if ((fs->groups[ino / fs->group_inodes].desc->flags & A1FS_GROUP_INODE_UNINIT) ||
+		    !(fs->layout.inode_bitmap[ino / 8] & (1 << (ino % 8))) ||
+		    !S_ISREG(inode->mode & ~A1FS_S_INLINE) || inode->links != 0) {
+			continue;
+		}
+		sb->orphans[kept++] = ino;
+	}
+	if (kept != sb->orphan_count) {
+		fprintf(stderr, "Dropped %" PRIu64 " bad entries from the orphan list; run a1fsck to free their blocks\n",
+		        sb->orphan_count - kept);
+		sb->orphan_count = kept;
+	}
+}
+
+bool fs_ctx_init(fs_ctx *fs, void *image, size_t size, int fd, a1fs_opts *opts)
 {
 	fs->image = image;
 	fs->size = size;
+	fs->fd = fd;
 	fs->opts = opts;
+	dcache_init(&fs->dcache);
+	pthread_mutex_init(&fs->lock, NULL);
+	pthread_cond_init(&fs->reclaim_wake, NULL);
+
+	a1fs_superblock *sb = (a1fs_superblock *)image;
+	if (sb->magic != A1FS_MAGIC) return false;
+	uint64_t block_size = sb->block_size ? sb->block_size : 4096;
+	if (block_size != A1FS_BLOCK_SIZE) {
+		fprintf(stderr, "The image has %" PRIu64 "-byte blocks; this a1fs is built for %d-byte blocks\n",
+		        block_size, A1FS_BLOCK_SIZE);
+		return false;
+	}
+	if (!init_layout(fs)) return false;
+
+	// Free slot lists are built lazily, per directory
+	fs->dir_slots_count = sb->inode_count;
+	fs->dir_slots = calloc(fs->dir_slots_count, sizeof(dir_slots *));
+	if (fs->dir_slots == NULL) return false;
+	fs->dir_opens = calloc(fs->dir_slots_count, sizeof(unsigned int));
+	if (fs->dir_opens == NULL) return false;
+	fs->file_opens = calloc(fs->dir_slots_count, sizeof(unsigned int));
+	if (fs->file_opens == NULL) return false;
 
-	//TODO
+	if (!init_groups(fs)) return false;
+	check_orphans(fs);
+	fs_ctx_sync_counts(fs);
+	// A crash while mounted may leave the descriptors out of step with the bitmaps
+	sb->clean = 0;
+
+	// Which fragments are in use follows from the fragment runs in the extent table
+	if (!frag_map_init(&fs->frags, fs->layout.extents, fs->layout.extent_count)) return false;
 	return true;
 }
 
+void fs_ctx_drop_dir_slots(fs_ctx *fs, a1fs_ino_t ino)
+{
+	if (ino >= fs->dir_slots_count || fs->dir_slots[ino] == NULL) return;
+	free(fs->dir_slots[ino]->blocks);
+	free(fs->dir_slots[ino]);
+	fs->dir_slots[ino] = NULL;
+}
+
+void fs_ctx_sync_counts(fs_ctx *fs)
+{
+	a1fs_superblock *sb = (a1fs_superblock *)fs->image;
+	uint64_t free_blocks = 0, free_inodes = 0;
+	for (unsigned int g = 0; g < fs->group_count; g++) {
+		free_blocks += fs->groups[g].desc->free_blocks;
+		free_inodes += fs->groups[g].desc->free_inodes;
+	}
+	sb->free_data_block_count = free_blocks;
+	sb->free_inodes_count = free_inodes;
+}
+
 void fs_ctx_destroy(fs_ctx *fs)
 {
-	//TODO
-	(void)fs;
+	for (size_t i = 0; i < fs->dir_slots_count; i++) {
+		fs_ctx_drop_dir_slots(fs, i);
+	}
+	free(fs->dir_slots);
+	free(fs->dir_opens);
+	free(fs->file_opens);
+	free(fs->groups);
+	free(fs->mem_descs);
+	bitsum_destroy(&fs->block_sum);
+	bitsum_destroy(&fs->inode_sum);
+	frag_map_destroy(&fs->frags);
+	dcache_destroy(&fs->dcache);
+	pthread_cond_destroy(&fs->reclaim_wake);
+	pthread_mutex_destroy(&fs->lock);
 }
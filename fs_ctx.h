@@ -18,11 +18,84 @@
 
 #pragma once
 
+#include <pthread.h>
+#include <stdbool.h>
 #include <stddef.h>
+#include <sys/types.h>
 
+#include "a1fs.h"
+#include "bitsum.h"
+#include "dcache.h"
+#include "frag.h"
 #include "options.h"
 
 
+/**
+ * Free slot list of a directory.
+ *
+ * Physical blocks of the directory that have at least one free dentry slot.
+ * Built on the first insertion into the directory and kept up to date by
+ * insertions and removals, so that a new entry goes straight into a hole (or
+ * a new tail block) without scanning the directory.
+ */
+typedef struct dir_slots {
+	/** Number of blocks in the list. */
+	size_t count;
+	/** Capacity of the blocks array. */
+	size_t capacity;
+	/** Blocks with free slots; insertions take from the end. */
+	a1fs_blk_t *blocks;
+
+} dir_slots;
+
+static_assert(A1FS_GROUP_BLOCKS % BITSUM_REGION_BITS == 0,
+              "free run regions must not span allocation groups");
+
+/**
+ * Allocation group - a block group (A1FS_GROUP_BLOCKS data blocks and the
+ * same share of the inode table) as seen by the allocator.
+ *
+ * Files get their inode and blocks in the group of their parent directory,
+ * so that a directory and its files sit close together in the image, while
+ * new directories near the root are spread over groups (see find_group_dir()
+ * in a1fs.c).
+ *
+ * Like the rest of the context, groups are only touched under fs->lock.
+ * Groups start on a bitmap word, so no two share one. The counts in the group
+ * descriptors are the live free counts; the totals in the superblock are only
+ * brought up to date by fs_ctx_sync_counts().
+ */
+typedef struct alloc_group {
+	/** The group's descriptor, in the image (or in memory for images without descriptors). */
+	a1fs_group_desc *desc;
+
+} alloc_group;
+
+/**
+ * Where the metadata areas of the mounted image are, resolved once at mount
+ * from the layout recorded in the superblock.
+ */
+typedef struct fs_layout {
+	/** Inode bitmap. */
+	unsigned char *inode_bitmap;
+	/** Block bitmap; bit i is block data_start + i. */
+	unsigned char *block_bitmap;
+	/** Extent table. */
+	a1fs_extent *extents;
+	/** Number of entries in the initialized part of the extent table. */
+	uint32_t extent_count;
+	/** Inode table. */
+	a1fs_inode *inodes;
+	/** First data block. */
+	a1fs_blk_t data_start;
+
+} fs_layout;
+
+/** Dead bytes a directory needs before it is compacted (two blocks). */
+#define A1FS_COMPACT_MIN_DEAD (2 * A1FS_BLOCK_SIZE)
+/** Directory blocks released per removal by incremental compaction. */
+#define A1FS_COMPACT_STEP 2
+
 /**
  * Mounted file system runtime state - "fs context".
  */
@@ -31,23 +104,121 @@ typedef struct fs_ctx {
 	void *image;
 	/** Image size in bytes. */
 	size_t size;
+	/** Image file descriptor, used for splice-based reads and writes. */
+	int fd;
 	/** Command line options. */
 	a1fs_opts *opts;
+	/** Locations of the metadata areas in the image. */
+	fs_layout layout;
+	/** Entries of the most recently listed directory. */
+	dcache dcache;
+	/** Free slot lists indexed by directory inode number; NULL if not built. */
+	dir_slots **dir_slots;
+	/** Number of entries in dir_slots (the inode count). */
+	size_t dir_slots_count;
+	/** Open handles indexed by directory inode number; listed directories are not compacted. */
+	unsigned int *dir_opens;
+	/** Open handles indexed by file inode number; open files are not moved by the defragmenter. */
+	unsigned int *file_opens;
+	/** Fragments in use in the blocks shared by file tails. */
+	frag_map frags;
+	/** Allocation groups. */
+	alloc_group *groups;
+	/** Group descriptors kept in memory for an image that has none; NULL otherwise. */
+	a1fs_group_desc *mem_descs;
+	/** Number of allocation groups. */
+	unsigned int group_count;
+	/** Group after the one the last spread directory went to (see find_group_dir()). */
+	unsigned int dir_cursor;
+	/** Number of inodes per allocation group; a multiple of 64. */
+	uint32_t group_inodes;
+	/** Summary of the block bitmap, with free runs. */
+	bitsum block_sum;
+	/** Summary of the inode bitmap. */
+	bitsum inode_sum;
+	/** Held by file system operations and by the reclaimer between batches. */
+	pthread_mutex_t lock;
+	/** Signalled when an inode is orphaned, or to stop the reclaimer. */
+	pthread_cond_t reclaim_wake;
+	/** Background thread that frees the blocks of orphaned inodes. */
+	pthread_t reclaimer;
+	/** Whether the reclaimer is running; if not, unlink frees blocks itself. */
+	bool reclaimer_running;
+	/** Set on unmount to stop the reclaimer. */
+	bool reclaim_stop;
+	/** Next inode the background defragmenter looks at (see --defrag). */
+	a1fs_ino_t defrag_next;
 
 	//TODO
 
 } fs_ctx;
 
+/** Initial readahead window, in bytes, once a sequential stream is detected. */
+#define A1FS_RA_MIN (128 * 1024)
+/** Largest readahead window in bytes. */
+#define A1FS_RA_MAX (8 * 1024 * 1024)
+/** Largest file tail, in bytes, that is packed into fragments. */
+#define A1FS_FRAG_TAIL_MAX (A1FS_BLOCK_SIZE / 2)
+/** Smallest file, in blocks, whose blocks are freed in the background after unlink. */
+#define A1FS_ORPHAN_MIN_BLOCKS 16
+/** Blocks freed by the reclaimer each time it takes the lock. */
+#define A1FS_RECLAIM_BATCH 256
+/** Inodes looked at by the background defragmenter each time it takes the lock. */
+#define A1FS_DEFRAG_BATCH 64
+/** Seconds between passes of the background defragmenter over the inode table. */
+#define A1FS_DEFRAG_INTERVAL 30
+
+/**
+ * Open file state - stored in fuse_file_info::fh between open() and release().
+ *
+ * Tracks the access pattern of one open file to drive readahead, and whether
+ * its tail may need packing into fragments when it is closed.
+ */
+typedef struct a1fs_file {
+	/** File offset a sequential read would start at. */
+	off_t next;
+	/** Current readahead window in bytes; 0 while not streaming. */
+	size_t window;
+	/** File offset up to which readahead has already been requested. */
+	off_t ra_end;
+	/** Number of consecutive non-sequential reads. */
+	unsigned int misses;
+	/** Whether the file's blocks are currently advised as MADV_RANDOM. */
+	bool random;
+	/** Inode number of the file. */
+	a1fs_ino_t ino;
+	/** Whether the file has been written to; its tail is packed on release. */
+	bool written;
+
+} a1fs_file;
+
 /**
  * Initialize file system context.
  *
  * @param fs     pointer to the context to initialize.
  * @param image  pointer to the start of the image.
  * @param size   image size in bytes.
+ * @param fd     image file descriptor.
  * @param opts   command line options.
  * @return       true on success; false on failure (e.g. invalid superblock).
  */
-bool fs_ctx_init(fs_ctx *fs, void *image, size_t size, a1fs_opts *opts);
+bool fs_ctx_init(fs_ctx *fs, void *image, size_t size, int fd, a1fs_opts *opts);
+
+/**
+ * Forget the free slot list of a directory, e.g. after it has been removed.
+ *
+ * @param fs   pointer to the context.
+ * @param ino  inode number of the directory.
+ */
+void fs_ctx_drop_dir_slots(fs_ctx *fs, a1fs_ino_t ino);
+
+/**
+ * Store the free block and inode totals of the allocation groups in the
+ * superblock.
+ *
+ * @param fs  pointer to the context.
+ */
+void fs_ctx_sync_counts(fs_ctx *fs);
 
 /**
  * Destroy file system context.
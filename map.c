@@ -26,7 +26,7 @@
 #include "util.h"
 
 
-void *map_file(const char *path, size_t block_size, size_t *size)
+void *map_file(const char *path, size_t block_size, size_t *size, int *fdp)
 {
 	// Open the file for reading and writing
 	int fd = open(path, O_RDWR);
@@ -53,17 +53,35 @@ void *map_file(const char *path, size_t block_size, size_t *size)
 		goto end;
 	}
 
-	// Map file contents into memory
-	addr = mmap(NULL, s.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	// Map file contents into memory, at a block boundary. mmap() only aligns
+	// to pages, which can be smaller than blocks, so reserve a block more
+	// address space than needed and map the file at the first boundary in it.
+	size_t span = s.st_size + block_size;
+	char *area = mmap(NULL, span, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (area == MAP_FAILED) {
+		perror("mmap");
+		goto end;
+	}
+	char *start = (char *)(((size_t)area + block_size - 1) & ~(block_size - 1));
+	addr = mmap(start, s.st_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0);
 	if (addr == MAP_FAILED) {
 		perror("mmap");
+		munmap(area, span);
 		addr = NULL;
 		goto end;
 	}
+	// Give back the reserved space around the mapping
+	if (start > area) munmap(area, start - area);
+	if (area + span > start + s.st_size) munmap(start + s.st_size, area + span - (start + s.st_size));
 	assert(is_aligned((size_t)addr, block_size));
 	*size = s.st_size;
 
 end:
+	// Hand the descriptor over to the caller if it wants to do fd-based I/O
+	if (addr && fdp) {
+		*fdp = fd;
+		return addr;
+	}
 	//NOTE: memory mapping keeps a reference to the open file; can safely close
 	// the file descriptor now; a future munmap() will close the file
 	close(fd);
@@ -29,7 +29,10 @@
  * @param path        image file path.
  * @param block_size  file system block size.
  * @param size        pointer to the variable that will be set to file size.
+ * @param fd          if not NULL, receives the file descriptor, which is then
+ *                    kept open (e.g. for splice-based I/O); the caller must
+ *                    close it. If NULL, the descriptor is closed.
  * @return            pointer to the file mapping in memory on success;
  *                    NULL on failure.
  */
-void *map_file(const char *path, size_t block_size, size_t *size);
+void *map_file(const char *path, size_t block_size, size_t *size, int *fd);
@@ -16,6 +16,11 @@
  * CSC369 Assignment 1 - a1fs formatting tool.
  */
 
+// For fallocate()
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -25,21 +30,16 @@
 #include <time.h>
 
 #include "a1fs.h"
+#include "dirblk.h"
 #include "map.h"
 
+/** Number of inodes in a block. */
+#define INODES_PER_BLOCK (A1FS_BLOCK_SIZE / sizeof(struct a1fs_inode))
+
 /*Helper function*/
 int ceiling(size_t n_inodes){
-	unsigned int k = n_inodes / 32;
-	if (k * 32 < n_inodes){
-		return k + 1;
-	}else{
-		return k;
-	}
-}
-
-int ceiling_bit(uint64_t number){
-	unsigned int k = number / 8;
-	if (k * 8 < number){
+	unsigned int k = n_inodes / INODES_PER_BLOCK;
+	if (k * INODES_PER_BLOCK < n_inodes){
 		return k + 1;
 	}else{
 		return k;
@@ -62,6 +62,8 @@ typedef struct mkfs_opts {
 	bool verbose;
 	/** Zero out image contents. */
 	bool zero;
+	/** Block size in bytes; 0 for the one this mkfs is built for. */
+	size_t block_size;
 
 } mkfs_opts;
 
@@ -69,15 +71,16 @@ static const char *help_str = "\
 Usage: %s options image\n\
 \n\
 Format the image file into a1fs file system. The file must exist and\n\
-its size must be a multiple of a1fs block size - %zu bytes.\n\
+its size must be a multiple of a1fs block size - %zu bytes by default.\n\
 \n\
 Options:\n\
     -i num  number of inodes; required argument\n\
+    -b size block size: 4096, 16384 or 65536\n\
     -h      print help and exit\n\
     -f      force format - overwrite existing a1fs file system\n\
     -s      sync image file contents to disk\n\
     -v      verbose output\n\
-    -z      zero out image contents\n\
+    -z      zero out image contents, leaving a sparse image file\n\
 ";
 
 static void print_help(FILE *f, const char *progname)
@@ -89,9 +92,10 @@ static void print_help(FILE *f, const char *progname)
 static bool parse_args(int argc, char *argv[], mkfs_opts *opts)
 {
 	char o;
-	while ((o = getopt(argc, argv, "i:hfsvz")) != -1) {
+	while ((o = getopt(argc, argv, "i:b:hfsvz")) != -1) {
 		switch (o) {
 			case 'i': opts->n_inodes = strtoul(optarg, NULL, 10); break;
+			case 'b': opts->block_size = strtoul(optarg, NULL, 10); break;
 
 			case 'h': opts->help    = true; return true;// skip other arguments
 			case 'f': opts->force   = true; break;
@@ -114,9 +118,116 @@ static bool parse_args(int argc, char *argv[], mkfs_opts *opts)
 		fprintf(stderr, "Missing or invalid number of inodes\n");
 		return false;
 	}
+	if (opts->block_size != 0 && opts->block_size != 4096 &&
+	    opts->block_size != 16384 && opts->block_size != 65536) {
+		fprintf(stderr, "Invalid block size\n");
+		return false;
+	}
+	return true;
+}
+
+
+/** Extent table entries per inode; files and directories mostly need one or two. */
+#define EXTENTS_PER_INODE 4
+
+/**
+ * Lay out the image: the superblock, the group descriptor table, the inode
+ * bitmap, the block bitmap, the extent table and the inode table, followed
+ * by the data blocks. The bitmaps take as many blocks as their bits need, so
+ * any image size can be tracked, and the extent table grows with the number
+ * of inodes.
+ *
+ * @param sb      superblock with inode_count and inode_blocks set.
+ * @param blocks  image size in blocks.
+ * @return        true on success; false if the metadata leaves no room for
+ *                the root directory.
+ */
+static bool mkfs_layout(struct a1fs_superblock *sb, uint64_t blocks)
+{
+	const uint64_t bits = (uint64_t)A1FS_BLOCK_SIZE * 8;
+	const uint64_t per_block = A1FS_BLOCK_SIZE / sizeof(struct a1fs_extent);
+
+	// Enough descriptors for every block of the image to be a data block
+	uint64_t max_groups = (blocks + A1FS_GROUP_BLOCKS - 1) / A1FS_GROUP_BLOCKS;
+	sb->group_desc_start = 1;
+	sb->group_desc_blocks = (max_groups * sizeof(a1fs_group_desc) + A1FS_BLOCK_SIZE - 1) / A1FS_BLOCK_SIZE;
+
+	sb->inode_bitmap_start = sb->group_desc_start + sb->group_desc_blocks;
+	sb->inode_bitmap_blocks = (sb->inode_count + bits - 1) / bits;
+	uint64_t extents = sb->inode_count * EXTENTS_PER_INODE;
+	sb->extent_table_blocks = (extents + per_block - 1) / per_block;
+	// Extent numbers are stored in 32 bits
+	if (sb->extent_table_blocks * per_block > UINT32_MAX) {
+		sb->extent_table_blocks = UINT32_MAX / per_block;
+	}
+
+	// Block numbers are stored in 32 bits
+	if (blocks > UINT32_MAX) return false;
+	uint64_t fixed = sb->inode_bitmap_start + sb->inode_bitmap_blocks + sb->extent_table_blocks + sb->inode_blocks;
+	if (fixed >= blocks) return false;
+	// Each block bitmap block covers itself and the data blocks it tracks
+	uint64_t rest = blocks - fixed;
+	sb->block_bitmap_blocks = (rest + bits) / (bits + 1);
+	sb->data_block_count = rest - sb->block_bitmap_blocks;
+	if (sb->data_block_count < 2) return false;
+
+	sb->block_bitmap_start = sb->inode_bitmap_start + sb->inode_bitmap_blocks;
+	sb->extent_table_start = sb->block_bitmap_start + sb->block_bitmap_blocks;
+	sb->inode_table_start = sb->extent_table_start + sb->extent_table_blocks;
+	sb->data_start = sb->inode_table_start + sb->inode_blocks;
+
+	sb->group_count = (sb->data_block_count + A1FS_GROUP_BLOCKS - 1) / A1FS_GROUP_BLOCKS;
+	sb->group_inodes = (sb->inode_count + sb->group_count - 1) / sb->group_count;
+	sb->group_inodes = (sb->group_inodes + 63) / 64 * 64;
 	return true;
 }
 
+/**
+ * Write the group descriptors of a new file system, whose only used blocks
+ * and inodes are the first two of each. Only the bitmaps and inode table of
+ * group 0 are written by mkfs; the other groups are marked uninitialized and
+ * a1fs zeroes their parts when it first allocates there.
+ */
+static void mkfs_groups(void *image, struct a1fs_superblock *sb)
+{
+	a1fs_group_desc *descs = (a1fs_group_desc *)(image + A1FS_BLOCK_SIZE * sb->group_desc_start);
+	memset(descs, 0, A1FS_BLOCK_SIZE * sb->group_desc_blocks);
+	for (uint64_t g = 0; g < sb->group_count; g++) {
+		uint64_t first_block = g * A1FS_GROUP_BLOCKS;
+		uint64_t blocks = sb->data_block_count - first_block;
+		descs[g].free_blocks = blocks < A1FS_GROUP_BLOCKS ? blocks : A1FS_GROUP_BLOCKS;
+		uint64_t first_inode = g * sb->group_inodes;
+		if (first_inode < sb->inode_count) {
+			uint64_t inodes = sb->inode_count - first_inode;
+			descs[g].free_inodes = inodes < sb->group_inodes ? inodes : sb->group_inodes;
+		}
+		if (g > 0) descs[g].flags = A1FS_GROUP_BLOCK_UNINIT | A1FS_GROUP_INODE_UNINIT;
+	}
+	// The reserved blocks and inodes, and the root directory
+	descs[0].free_blocks -= 2;
+	descs[0].first_free_block = 2;
+	descs[0].free_inodes -= 2;
+	descs[0].first_free_inode = 2;
+	descs[0].dirs = 1;
+}
+
+
+/**
+ * Run the mkfs built for another block size instead of this one. The builds
+ * sit side by side: mkfs.a1fs for 4 KiB blocks, mkfs.a1fs-16k and
+ * mkfs.a1fs-64k for 16 and 64 KiB blocks. Returns only on failure.
+ */
+static void exec_block_size(char *argv[], size_t block_size)
+{
+	const char *suffix = block_size == 16384 ? "-16k" : block_size == 65536 ? "-64k" : "";
+	const char *slash = strrchr(argv[0], '/');
+	int dir_len = slash ? slash - argv[0] + 1 : 0;
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%.*smkfs.a1fs%s", dir_len, argv[0], suffix);
+	execvp(path, argv);
+	perror(path);
+}
+
 
 /** Determine if the image has already been formatted into a1fs. */
 static bool a1fs_is_present(void *image)
@@ -150,55 +261,54 @@ static bool mkfs(void *image, size_t size, mkfs_opts *opts)
 	
 	/** The total number of blocks that can be partitioned in this file system */
 	size_t max_segs = size / A1FS_BLOCK_SIZE;
-	
-	/** Input number of inodes is too large to fit in the file system */
-	if (opts->n_inodes / 32 > max_segs) { return false; }
 
     /** Initialize superblock */
     struct a1fs_superblock *sb = (struct a1fs_superblock *)(image); // First block
+	memset(sb, 0, A1FS_BLOCK_SIZE);
 	sb->size = size;
 	sb->magic = A1FS_MAGIC;
+	sb->block_size = A1FS_BLOCK_SIZE;
 	sb->inode_count = opts->n_inodes; // Get from input
 	sb->inode_blocks = ceiling(opts->n_inodes); // Number of inodes != Number of blocks they will occupy
-	sb->free_inodes_count = opts->n_inodes - 1; // One inode is reserved for root directory
-	sb->data_block_count = max_segs - 4 - sb->inode_blocks;
-	sb->free_data_block_count = max_segs - 5 - sb->inode_blocks;
 	sb->reserved_extent_number = 1; // The first reserved extent will be "0"
+	sb->orphan_count = 0;
+
+	/** Input number of inodes is too large to fit in the file system */
+	if (opts->n_inodes < 2 || !mkfs_layout(sb, max_segs)) { return false; }
+	mkfs_groups(image, sb);
+	sb->clean = 1;
+	sb->free_inodes_count = opts->n_inodes - 2; // The root directory and the reserved inode
+	sb->free_data_block_count = sb->data_block_count - 2; // Likewise for blocks, as in the descriptors
+
+	/** The parts of the bitmaps and the inode table that belong to group 0 */
+	uint64_t group0_blocks = sb->data_block_count < A1FS_GROUP_BLOCKS ? sb->data_block_count : A1FS_GROUP_BLOCKS;
+	uint64_t group0_inodes = sb->inode_count < sb->group_inodes ? sb->inode_count : sb->group_inodes;
 
 	/** Set the inode bitmap; */
-    unsigned char *inode_bitmap = (unsigned char *)(image + A1FS_BLOCK_SIZE * 1); // Second block
-	
-	for (int i = 0; i < ceiling_bit(sb->inode_count + 1); i++) {
-		inode_bitmap[i] = inode_bitmap[i] & 0;	
-	}
+    unsigned char *inode_bitmap = (unsigned char *)(image + A1FS_BLOCK_SIZE * sb->inode_bitmap_start);
+	memset(inode_bitmap, 0, (group0_inodes + 7) / 8);
 	inode_bitmap[0] |= (1 << 0); // The first inode is reserved
 	inode_bitmap[0] |= (1 << 1);
 	sb->inode_bitmap = inode_bitmap; // Add it to the superblock
 
 	/** Set the block bitmap; */
-    unsigned char *block_bitmap = (unsigned char *)(image + A1FS_BLOCK_SIZE * 2); // Third block
-	
-	for (int i = 0; i < ceiling_bit(sb->data_block_count + 1); i++) {
-		block_bitmap[i] = block_bitmap[i] & 0;	
-	}
+    unsigned char *block_bitmap = (unsigned char *)(image + A1FS_BLOCK_SIZE * sb->block_bitmap_start);
+	memset(block_bitmap, 0, (group0_blocks + 7) / 8);
 	block_bitmap[0] |= (1 << 0); // The first block is reserved
 	block_bitmap[0] |= (1 << 1);
 	sb->block_bitmap = block_bitmap; // Add it to the superblock
 
-	/** Set the extent block; */
-	struct a1fs_extent *extent_block = (struct a1fs_extent *)(image + A1FS_BLOCK_SIZE * 3); // Forth block
-	for (int extent_number = 1;extent_number < 512;extent_number++){
-		struct a1fs_extent new_extent;
-		new_extent.start = 0; 
-		new_extent.count = 0;
-		memcpy(image+ A1FS_BLOCK_SIZE * 3+ extent_number * sizeof(struct a1fs_extent), &new_extent, sizeof(struct a1fs_extent));
-	}
+	/** Set the extent table; */
+	struct a1fs_extent *extent_block = (struct a1fs_extent *)(image + A1FS_BLOCK_SIZE * sb->extent_table_start);
+	memset(extent_block, 0, A1FS_BLOCK_SIZE);
+	sb->extent_table_uninit = sb->extent_table_blocks - 1; // Zeroed by a1fs as needed
 	
-	/** Set the first inode (each block will contain 32 inodes) */
-	struct a1fs_inode *inode = (struct a1fs_inode *)(image + A1FS_BLOCK_SIZE * 4); // Fifth block
+	/** Set the first inode */
+	struct a1fs_inode *inode = (struct a1fs_inode *)(image + A1FS_BLOCK_SIZE * sb->inode_table_start);
+	memset(inode, 0, group0_inodes * sizeof(struct a1fs_inode));
 	inode->mode = S_IFDIR | 0755;
 	inode->links = 2;
-	inode->size = 2 * sizeof(struct a1fs_dentry);
+	inode->size = A1FS_DIRENT_SIZE(1) + A1FS_DIRENT_SIZE(2); // "." and ".."
 	struct timespec tp;
 	if (clock_gettime(CLOCK_REALTIME, &tp) != 0) { return false; }
 	inode->mtime = tp;
@@ -208,44 +318,18 @@ static bool mkfs(void *image, size_t size, mkfs_opts *opts)
 	}
 
 	
-	/** Set the first data block for root directory */
-	//struct a1fs_dentry *root_directory = (struct a1fs_dentry *)(image + A1FS_BLOCK_SIZE * (4 + sb->inode_blocks));
-
-	// initialize the "." entry
-	struct a1fs_dentry first_dentry;
-	first_dentry.ino = 0;
-	first_dentry.name[0] = '\0';
-	strcat(first_dentry.name, ".");
-	//root_directory[0] = first_dentry;
-	memcpy((image + A1FS_BLOCK_SIZE * (4 + sb->inode_blocks)), &first_dentry, sizeof(struct a1fs_dentry));
-	
-	// initialize the ".." entry
-	struct a1fs_dentry second_dentry;
-	second_dentry.ino = 0;
-	second_dentry.name[0] = '\0';
-	strcat(second_dentry.name, "..");
-	//root_directory[1] = second_dentry;
-	memcpy(image + A1FS_BLOCK_SIZE * (4 + sb->inode_blocks) + sizeof(struct a1fs_dentry), &second_dentry, sizeof(struct a1fs_dentry));
-
-	// initialize other entries as empty ones
-	for (unsigned int i = 2; i < A1FS_BLOCK_SIZE / sizeof(struct a1fs_dentry); i++) {
-		struct a1fs_dentry empty_dentry;
-		empty_dentry.name[0] = '\0';
-		empty_dentry.ino = opts->n_inodes + 1;
-		//root_directory[i] = empty_dentry;
-		memcpy(image + A1FS_BLOCK_SIZE * (4 + sb->inode_blocks) + i * sizeof(struct a1fs_dentry), &empty_dentry, sizeof(struct a1fs_dentry));
-	}
+	/** Set the first data block for root directory, in the packed format */
+	void *root_block = image + A1FS_BLOCK_SIZE * sb->data_start;
+	dirblk_init(root_block);
+	dirblk_insert(root_block, opts->n_inodes, 0, ".", 1);
+	dirblk_insert(root_block, opts->n_inodes, 0, "..", 2);
+
 	/** The extent for root directory */
 	struct a1fs_extent root_extent;
-	root_extent.start = 4 + sb->inode_blocks;
+	root_extent.start = sb->data_start;
 	root_extent.count = 1;
 	extent_block[0] = root_extent;
 	
-	/** Do memcpy */
-	memcpy(image, sb, sizeof(struct a1fs_superblock));
-	memcpy(image + A1FS_BLOCK_SIZE * 3, &root_extent, sizeof(struct a1fs_extent));
-	memcpy(image + A1FS_BLOCK_SIZE * 4, inode, sizeof(struct a1fs_inode));
-	
 	return true;
 }
 
@@ -264,9 +348,15 @@ int main(int argc, char *argv[])
 		return 0;
 	}
 
+	if (opts.block_size != 0 && opts.block_size != A1FS_BLOCK_SIZE) {
+		exec_block_size(argv, opts.block_size);
+		return 1;
+	}
+
 	// Map image file into memory
 	size_t size;
-	void *image = map_file(opts.img_path, A1FS_BLOCK_SIZE, &size);
+	int fd;
+	void *image = map_file(opts.img_path, A1FS_BLOCK_SIZE, &size, &fd);
 	if (image == NULL) return 1;
 
 	// Check if overwriting existing file system
@@ -277,7 +367,11 @@ int main(int argc, char *argv[])
 	}
 	
 
-	if (opts.zero) memset(image, 0, size);
+	// Punch the whole image out rather than writing zeros over it, leaving a
+	// sparse file that only takes disk space for what mkfs writes below
+	if (opts.zero && fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 0, size) < 0) {
+		memset(image, 0, size);
+	}
 	if (!mkfs(image, size, &opts)) {
 		fprintf(stderr, "Failed to format the image\n");
 		goto end;
@@ -294,5 +388,6 @@ int main(int argc, char *argv[])
 	ret = 0;
 end:
 	munmap(image, size);
+	close(fd);
 	return ret;
 }
@@ -37,6 +37,9 @@ static const struct fuse_opt opt_spec[] = {
 
 	A1FS_OPT("--sync"   , sync   ),
 	A1FS_OPT("--verbose", verbose),
+	A1FS_OPT("--punch"  , punch  ),
+	A1FS_OPT("--defrag" , defrag ),
+	A1FS_OPT("--copy"   , copy   ),
 
 	FUSE_OPT_END
 };
@@ -46,6 +49,7 @@ Usage: %s image dir [options]\n\
 \n\
 Mount a1fs image file at given mount point. Use fusermount(1) to unmount.\n\
 Only single-threaded mount is supported; -s FUSE option is implied.\n\
+Requests of up to 128 KiB are used (big_writes, max_read, max_write).\n\
 \n\
 general options:\n\
     -o opt,[opt...]        mount options\n\
@@ -55,6 +59,13 @@ general options:\n\
 a1fs options:\n\
     --sync                 sync image file contents to disk on unmount\n\
     --verbose              verbose output; only useful in foreground mode (-f)\n\
+    --punch                punch holes in the image file where blocks are freed,\n\
+                           so that its disk usage follows the data it holds\n\
+    --defrag               move fragmented files into contiguous free space in\n\
+                           the background (see also a1fs-defrag)\n\
+    --copy                 copy file data through read()/write() instead of\n\
+                           splicing it with read_buf()/write_buf(); for\n\
+                           comparing throughput\n\
 \n\
 ";
 
@@ -93,5 +104,8 @@ bool a1fs_opt_parse(struct fuse_args *args, a1fs_opts *opts)
 
 	// Only single-threaded mount is supported
 	fuse_opt_add_arg(args, "-s");
+	// Fewer, larger requests; each read_buf()/write_buf() call can then splice
+	// up to 32 blocks instead of one page at a time
+	fuse_opt_add_arg(args, "-obig_writes,max_read=131072,max_write=131072");
 	return true;
 }
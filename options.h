@@ -37,6 +37,12 @@ typedef struct a1fs_opts {
 	int sync;
 	/** Verbose output. Only print logging/debug info if this flag is set. */
 	int verbose;
+	/** Punch holes in the image file where blocks are freed. */
+	int punch;
+	/** Defragment files in the background. */
+	int defrag;
+	/** Serve data with read()/write() copies instead of read_buf()/write_buf(). */
+	int copy;
 
 } a1fs_opts;
 
@@ -0,0 +1,81 @@
+/*
+ * This code is provided solely for the personal and private use of students
+ * taking the CSC369H course at the University of Toronto. Copying for purposes
+ * other than this use is expressly prohibited. All forms of distribution of
+ * this code, including but not limited to public repositories on GitHub,
+ * GitLab, Bitbucket, or any other online platform, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Alexey Khrabrov, Karen Reid
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2019 Karen Reid
+ */
+
+/**
+ * CSC369 Assignment 1 - Path component iterator.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+/**
+ * Path component iterator.
+ *
+ * Walks an absolute path in place: components are not copied or
+ * null-terminated, and each character of the path is visited exactly once.
+ * The length and name_hash() of a component are computed in the same pass.
+ */
+typedef struct path_iter {
+	/** Start of the current component; NOT null-terminated. */
+	const char *name;
+	/** Length of the current component. */
+	size_t len;
+	/** name_hash() of the current component. */
+	uint32_t hash;
+	/** Position right after the current component. */
+	const char *next;
+
+} path_iter;
+
+/** Start iterating over the components of path. */
+static inline void path_iter_init(path_iter *it, const char *path)
+{
+	it->name = path;
+	it->len = 0;
+	it->hash = 0;
+	it->next = path;
+}
+
+/**
+ * Advance to the next component.
+ *
+ * "/a//b/" yields "a" and "b".
+ *
+ * @param it  pointer to the iterator.
+ * @return    true if it now points to a component; false at the end of path.
+ */
+static inline bool path_iter_next(path_iter *it)
+{
+	const char *p = it->next;
+	while (*p == '/') p++;
+	if (*p == '\0') return false;
+
+	// Same as name_hash() in dirblk.h, folded into the scan for the end of
+	// the component
+	uint32_t h = 2166136261u;
+	const char *start = p;
+	for (; *p != '\0' && *p != '/'; p++) {
+		h = (h ^ (unsigned char)*p) * 16777619u;
+	}
+
+	it->name = start;
+	it->len = p - start;
+	it->hash = h;
+	it->next = p;
+	return true;
+}
@@ -111,4 +111,120 @@ fusermount -u /tmp/mnt
 ./a1fs img /tmp/mnt
 ls -al /tmp/mnt
 
+echo "-------------Read a file while the background defragmenter runs-------------"
+fusermount -u /tmp/mnt
+./a1fs img /tmp/mnt --defrag
+echo "Append to two files in turns so that both end up in many extents"
+for i in $(seq 1 64); do
+    head -c 8192 /dev/urandom >> /tmp/mnt/frag1
+    head -c 8192 /dev/urandom >> /tmp/mnt/frag2
+done
+cp /tmp/mnt/frag1 /tmp/frag1.copy
+echo "Keep frag1 open and read it over and over through a defragmentation pass;"
+echo "every read should match (frag2 is closed and gets moved)"
+exec 3< /tmp/mnt/frag1
+for i in $(seq 1 40); do
+    cmp /tmp/mnt/frag1 /tmp/frag1.copy || echo "frag1 changed while being read!"
+    sleep 1
+done
+exec 3<&-
+rm -f /tmp/mnt/frag1 /tmp/mnt/frag2 /tmp/frag1.copy
+echo ""
+
+echo "-------------Touch storm: create and remove many empty files-------------"
+fusermount -u /tmp/mnt
+truncate -s 256M bench.img
+./mkfs.a1fs -f -i 20000 bench.img
+./a1fs bench.img /tmp/mnt
+echo "Empty files take an inode and a directory entry but no data blocks,"
+echo "so only the directories should use up blocks"
+for d in 0 1 2 3 4; do
+    mkdir /tmp/mnt/storm$d
+    ./timetest touch /tmp/mnt/storm$d 2000
+done
+for d in 0 1 2 3 4; do
+    ./timetest unlink /tmp/mnt/storm$d 2000
+    rmdir /tmp/mnt/storm$d
+done
+echo ""
+
+echo "-------------Bulk create: the same files through the batch ioctls-------------"
+echo "One ioctl creates or removes up to a batch of files, instead of a lookup"
+echo "and a create or unlink request for every file"
+for d in 0 1 2 3 4; do
+    mkdir /tmp/mnt/bulk$d
+    ./timetest batch /tmp/mnt/bulk$d 2000
+done
+echo "bulk0 should hold 2000 files:"
+ls /tmp/mnt/bulk0 | wc -l
+for d in 0 1 2 3 4; do
+    ./timetest batch-unlink /tmp/mnt/bulk$d 2000
+    rmdir /tmp/mnt/bulk$d
+done
+fusermount -u /tmp/mnt
+rm -f bench.img
+./a1fs img /tmp/mnt
+echo ""
+
+echo "-------------Block sizes: metadata and throughput trade-offs-------------"
+fusermount -u /tmp/mnt
+for bs in 4096 16384 65536; do
+    case $bs in
+        4096) fs=./a1fs ;;
+        16384) fs=./a1fs-16k ;;
+        65536) fs=./a1fs-64k ;;
+    esac
+    echo "$bs-byte blocks"
+    truncate -s 512M bench.img
+    ./mkfs.a1fs -f -b $bs -i 20000 bench.img
+    $fs bench.img /tmp/mnt
+    echo "Space left for data on the empty file system:"
+    df -k /tmp/mnt
+    mkdir /tmp/mnt/small
+    ./timetest small /tmp/mnt/small 2000 3000
+    ./timetest stat /tmp/mnt/small
+    ./timetest write /tmp/mnt/big 256
+    echo "Remount so that the read comes from the image, not the page cache"
+    fusermount -u /tmp/mnt
+    $fs bench.img /tmp/mnt
+    ./timetest read /tmp/mnt/big
+    fusermount -u /tmp/mnt
+    rm -f bench.img
+done
+./a1fs img /tmp/mnt
+echo ""
+
+echo "-------------Data path: copying read/write against read_buf/write_buf-------------"
+echo "--copy moves file data through a user-space buffer; the default splices it"
+echo "between the image file and the kernel"
+fusermount -u /tmp/mnt
+for opt in --copy ""; do
+    echo "a1fs $opt"
+    truncate -s 512M bench.img
+    ./mkfs.a1fs -f -i 100 bench.img
+    ./a1fs bench.img /tmp/mnt $opt
+    ./timetest write /tmp/mnt/big 256
+    echo "Remount so that the read comes from the image, not the page cache"
+    fusermount -u /tmp/mnt
+    ./a1fs bench.img /tmp/mnt $opt
+    ./timetest read /tmp/mnt/big
+    fusermount -u /tmp/mnt
+    rm -f bench.img
+done
+./a1fs img /tmp/mnt
+echo ""
+
+echo "-------------Path depth: cost of a lookup against the number of components-------------"
+echo "The kernel's attribute and entry caches are off, so every stat walks the"
+echo "whole path in a1fs; the time per stat should grow with the depth"
+fusermount -u /tmp/mnt
+truncate -s 64M bench.img
+./mkfs.a1fs -f -i 100 bench.img
+./a1fs bench.img /tmp/mnt -o attr_timeout=0,entry_timeout=0,negative_timeout=0
+./timetest depth /tmp/mnt 32
+fusermount -u /tmp/mnt
+rm -f bench.img
+./a1fs img /tmp/mnt
+echo ""
+
 echo "===========The End==========="
@@ -1,12 +1,40 @@
+/*
+ * This code is provided solely for the personal and private use of students
+ * taking the CSC369H course at the University of Toronto. Copying for purposes
+ * other than this use is expressly prohibited. All forms of distribution of
+ * this code, including but not limited to public repositories on GitHub,
+ * GitLab, Bitbucket, or any other online platform, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Alexey Khrabrov, Karen Reid
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2019 Karen Reid
+ */
 
+/**
+ * CSC369 Assignment 1 - Timing harness.
+ *
+ * Without arguments, prints the current date and time. Otherwise runs one
+ * timed workload against a directory of a mounted a1fs (see runit.sh) and
+ * prints how long it took, the rate, and how much space it used up.
+ */
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <inttypes.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
 #include <unistd.h>
 #include <time.h>
 
+#include "batch.h"
+
 void cal_date(struct timespec *tp){
 	int microsecond = tp->tv_nsec;
 	int days = tp->tv_sec / (3600 * 24);
@@ -60,9 +88,293 @@ void cal_date(struct timespec *tp){
 
 }
 
+static const char *help_str = "\
+Usage: %s [command args]\n\
+\n\
+Without a command, print the current date and time.\n\
+\n\
+Commands:\n\
+    touch dir n     create n empty files in dir\n\
+    unlink dir n    remove the files made by touch\n\
+    small dir n sz  create n files of sz bytes each in dir\n\
+    stat dir        list dir and stat every entry\n\
+    depth dir n     nest n directories in dir and time stat at each depth\n\
+    write file mib  write mib MiB to file in 1 MiB chunks, then fsync\n\
+    read file       read file in 1 MiB chunks\n\
+    batch dir n     like touch, but with A1FS_IOC_BATCH_CREATE\n\
+    batch-unlink dir n\n\
+                    like unlink, but with A1FS_IOC_BATCH_UNLINK\n\
+";
+
+/** Size of the buffer that file data is written and read in. */
+#define CHUNK (1 << 20)
+
+/** Stats of each path in the depth run; enough to swamp the clock's resolution. */
+#define DEPTH_STATS 2000
+
+/** Seconds since an arbitrary point, for timing. */
+static double now(void)
+{
+	struct timespec tp;
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return tp.tv_sec + tp.tv_nsec / 1e9;
+}
+
+/** Space in use, in KiB, on the file system that holds path; comparable across block sizes. */
+static long used_kib(const char *path)
+{
+	struct statvfs st;
+	if (statvfs(path, &st) < 0) {
+		perror("statvfs");
+		return 0;
+	}
+	return (long)((st.f_blocks - st.f_bfree) * st.f_frsize / 1024);
+}
+
+/** Print the result of a timed run of n operations. */
+static void report(const char *what, long n, double secs, long kib)
+{
+	printf("%s: %ld in %.3f s, %.0f/s, %ld KiB used\n", what, n, secs, secs > 0 ? n / secs : 0.0, kib);
+}
+
+/** Create n empty files named f0, f1, ... in dir, as touch(1) would. */
+static int touch_storm(const char *dir, long n)
+{
+	char path[4096];
+	long before = used_kib(dir);
+	double start = now();
+	for (long i = 0; i < n; i++) {
+		snprintf(path, sizeof(path), "%s/f%ld", dir, i);
+		int fd = open(path, O_CREAT | O_WRONLY, 0644);
+		if (fd < 0) {
+			perror(path);
+			return 1;
+		}
+		close(fd);
+	}
+	report("touch", n, now() - start, used_kib(dir) - before);
+	return 0;
+}
+
+/** Remove the files made by touch_storm(). */
+static int unlink_storm(const char *dir, long n)
+{
+	char path[4096];
+	long before = used_kib(dir);
+	double start = now();
+	for (long i = 0; i < n; i++) {
+		snprintf(path, sizeof(path), "%s/f%ld", dir, i);
+		if (unlink(path) < 0) {
+			perror(path);
+			return 1;
+		}
+	}
+	report("unlink", n, now() - start, used_kib(dir) - before);
+	return 0;
+}
+
+/** Create n files of size bytes named f0, f1, ... in dir. */
+static int small_files(const char *dir, long n, size_t size)
+{
+	char path[4096];
+	char *data = malloc(size ? size : 1);
+	if (data == NULL) {
+		perror("malloc");
+		return 1;
+	}
+	memset(data, 'a', size);
+	long before = used_kib(dir);
+	double start = now();
+	for (long i = 0; i < n; i++) {
+		snprintf(path, sizeof(path), "%s/f%ld", dir, i);
+		int fd = open(path, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+		if (fd < 0 || write(fd, data, size) != (ssize_t)size) {
+			perror(path);
+			free(data);
+			return 1;
+		}
+		close(fd);
+	}
+	report("small", n, now() - start, used_kib(dir) - before);
+	free(data);
+	return 0;
+}
+
+/** List dir and stat every entry, as ls -l does. */
+static int stat_all(const char *dir)
+{
+	char path[4096];
+	DIR *d = opendir(dir);
+	if (d == NULL) {
+		perror(dir);
+		return 1;
+	}
+	long n = 0;
+	double start = now();
+	struct dirent *ent;
+	while ((ent = readdir(d)) != NULL) {
+		struct stat st;
+		snprintf(path, sizeof(path), "%s/%s", dir, ent->d_name);
+		if (stat(path, &st) < 0) {
+			perror(path);
+			closedir(d);
+			return 1;
+		}
+		n++;
+	}
+	report("stat", n, now() - start, 0);
+	closedir(d);
+	return 0;
+}
+
+/**
+ * Make a chain of n nested directories in dir and time stat() on the path to
+ * each level, so that the cost of resolving a path can be read off against
+ * its number of components.
+ */
+static int path_depth(const char *dir, long n)
+{
+	char path[4096];
+	size_t len = snprintf(path, sizeof(path), "%s", dir);
+	for (long depth = 1; depth <= n; depth++) {
+		if (len + sizeof("/level") > sizeof(path)) {
+			fprintf(stderr, "%s: path too long at depth %ld\n", dir, depth);
+			return 1;
+		}
+		len += snprintf(path + len, sizeof(path) - len, "/level");
+		if (mkdir(path, 0755) < 0) {
+			perror(path);
+			return 1;
+		}
+		struct stat st;
+		double start = now();
+		for (long i = 0; i < DEPTH_STATS; i++) {
+			if (stat(path, &st) < 0) {
+				perror(path);
+				return 1;
+			}
+		}
+		double secs = now() - start;
+		printf("depth %ld: %.2f us per stat\n", depth, secs * 1e6 / DEPTH_STATS);
+	}
+	return 0;
+}
+
+/** Write or read a file sequentially and print the throughput. */
+static int stream(const char *path, bool writing, long mib)
+{
+	char *buf = malloc(CHUNK);
+	int fd = open(path, writing ? O_CREAT | O_WRONLY | O_TRUNC : O_RDONLY, 0644);
+	if (buf == NULL || fd < 0) {
+		perror(path);
+		free(buf);
+		return 1;
+	}
+	memset(buf, 'a', CHUNK);
+	long before = used_kib(path);
+	long bytes = 0;
+	double start = now();
+	for (long i = 0; !writing || i < mib; i++) {
+		ssize_t n = writing ? write(fd, buf, CHUNK) : read(fd, buf, CHUNK);
+		if (n < 0) {
+			perror(path);
+			close(fd);
+			free(buf);
+			return 1;
+		}
+		if (n == 0) break;
+		bytes += n;
+	}
+	if (writing) fsync(fd);
+	double secs = now() - start;
+	printf("%s: %ld MiB in %.3f s, %.1f MiB/s, %ld KiB used\n", writing ? "write" : "read",
+	       bytes >> 20, secs, secs > 0 ? (bytes >> 20) / secs : 0.0, used_kib(path) - before);
+	close(fd);
+	free(buf);
+	return 0;
+}
+
+/**
+ * Create (or remove) the files f0, f1, ... of touch_storm() with the batch
+ * ioctls, as many to a call as fit in a batch.
+ */
+static int batch_storm(const char *dir, long n, bool create)
+{
+	int fd = open(dir, O_RDONLY | O_DIRECTORY);
+	a1fs_batch *batch = malloc(sizeof(a1fs_batch));
+	if (fd < 0 || batch == NULL) {
+		perror(dir);
+		free(batch);
+		return 1;
+	}
+	long before = used_kib(dir);
+	long calls = 0;
+	double start = now();
+	for (long i = 0; i < n;) {
+		char name[32];
+		size_t used = 0;
+		batch->count = 0;
+		for (; i < n; i++) {
+			snprintf(name, sizeof(name), "f%ld", i);
+			if (!a1fs_batch_add(batch, &used, name, S_IFREG | 0644)) break;
+		}
+		uint32_t count = batch->count;
+		int ret = ioctl(fd, create ? A1FS_IOC_BATCH_CREATE : A1FS_IOC_BATCH_UNLINK, batch);
+		if (ret < 0 || batch->count != count) {
+			if (ret < 0) {
+				perror(dir);
+			} else {
+				fprintf(stderr, "%s: batch stopped after %" PRIu32 " of %" PRIu32 ": %s\n", dir,
+				        batch->count, count, strerror(batch->error));
+			}
+			close(fd);
+			free(batch);
+			return 1;
+		}
+		calls++;
+	}
+	double secs = now() - start;
+	report(create ? "batch" : "batch-unlink", n, secs, used_kib(dir) - before);
+	printf("  in %ld ioctl calls\n", calls);
+	close(fd);
+	free(batch);
+	return 0;
+}
+
 int main(int argc, char *argv[]){
-    struct timespec sp;
-    clock_gettime(CLOCK_REALTIME, &sp);
-    cal_date(&sp);
-    return 0;
-}
\ No newline at end of file
+	if (argc < 2) {
+		struct timespec sp;
+		clock_gettime(CLOCK_REALTIME, &sp);
+		cal_date(&sp);
+		return 0;
+	}
+	if (argc == 4 && strcmp(argv[1], "touch") == 0) {
+		return touch_storm(argv[2], atol(argv[3]));
+	}
+	if (argc == 4 && strcmp(argv[1], "unlink") == 0) {
+		return unlink_storm(argv[2], atol(argv[3]));
+	}
+	if (argc == 5 && strcmp(argv[1], "small") == 0) {
+		return small_files(argv[2], atol(argv[3]), strtoul(argv[4], NULL, 10));
+	}
+	if (argc == 3 && strcmp(argv[1], "stat") == 0) {
+		return stat_all(argv[2]);
+	}
+	if (argc == 4 && strcmp(argv[1], "depth") == 0) {
+		return path_depth(argv[2], atol(argv[3]));
+	}
+	if (argc == 4 && strcmp(argv[1], "write") == 0) {
+		return stream(argv[2], true, atol(argv[3]));
+	}
+	if (argc == 3 && strcmp(argv[1], "read") == 0) {
+		return stream(argv[2], false, 0);
+	}
+	if (argc == 4 && strcmp(argv[1], "batch") == 0) {
+		return batch_storm(argv[2], atol(argv[3]), true);
+	}
+	if (argc == 4 && strcmp(argv[1], "batch-unlink") == 0) {
+		return batch_storm(argv[2], atol(argv[3]), false);
+	}
+	fprintf(stderr, help_str, argv[0]);
+	return 1;
+}